@@ -106,9 +106,17 @@
 #define ALIGNMENT 8
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes, more with -DWIDE_HEAP to go past what
+ * 32-bit offsets reach. The shared library (-DMM_SHARED) reserves all
+ * that 32-bit offsets reach, pages are only taken when touched.
  */
+#ifdef WIDE_HEAP
+#define MAX_HEAP (8UL*(1<<30))  /* 8 GB */
+#elif defined(MM_SHARED)
+#define MAX_HEAP (4UL*(1<<30))  /* 4 GB */
+#else
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -0,0 +1,659 @@
+/*
+ * mbench.c - Microbenchmarks for the malloc/free fast path of mm.c
+ *
+ * Each workload is a script of mallocs and frees over a set of slots,
+ * built from a fixed seed before anything is timed, so every run and
+ * every allocator sees the same requests. The script is replayed on a
+ * fresh heap and timed by fcyc with the cycle counter: the K best runs
+ * must agree, so a run slowed down by another process does not count.
+ * The driver reports the cycles, time and throughput per operation.
+ * Before it is timed, a script is replayed once with every payload
+ * filled and checked before it is freed, and mm_checkheap after each
+ * batch of the batch workload and at the end of the others.
+ * With -c it checks mm_compact instead of timing anything, with -a the
+ * aligned allocations.
+ *
+ *   fixed     churn of 64 blocks of 32 bytes, a random one is replaced
+ *   lifo      512 blocks of 48 bytes, freed newest first
+ *   fifo      512 blocks of 48 bytes, freed oldest first
+ *   random    1024 blocks of 1 to 4096 bytes, most of them small,
+ *             a random one is replaced
+ *   prodcons  a queue: bursts of 16 to 512 byte blocks go in, bursts
+ *             come out oldest first, like buffers handed between a
+ *             producer and a consumer (mtdriver -x does it with threads)
+ *   batch     batches of 1 to 512 blocks of one size from 16 to 512
+ *             bytes, by mm_malloc_batch, each freed by mm_free_batch in
+ *             random order after the next batch came in
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "fcyc.h"
+#include "clock.h"
+#include "config.h"
+
+#define DEFAULT_OPS 200000  /* mallocs and frees per workload */
+#define MAXSLOTS 1024       /* blocks a script can hold at once */
+#define SEED 15213
+#define COMPACT_ROUNDS 4    /* fill, free half and compact, -c */
+#define ALIGN_ROUNDS 4      /* fill with aligned blocks and free, -a */
+#define ALIGN_MAX (1 << 16) /* largest alignment, -a */
+
+/* One request: malloc size bytes into slot, or free slot if size is 0 */
+typedef struct {
+    unsigned int slot;
+    unsigned int size;
+} benchop_t;
+
+typedef struct {
+    benchop_t *ops;
+    int num_ops;
+    int max_ops;
+} script_t;
+
+/* The allocator under test */
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+} allocator_t;
+
+/* A workload, gen writes its script */
+typedef struct {
+    const char *name;
+    void (*gen)(script_t *sp);
+    int batched;            /* mm replays runs of ops as batches */
+} workload_t;
+
+/* Parameters of one timed replay, passed through fcyc */
+typedef struct {
+    const script_t *script;
+    const allocator_t *alloc;
+    int check;              /* fill and check payloads, check the heap */
+    int errors;
+} run_t;
+
+static int verbose = 0;     /* report the clock rate */
+
+static const allocator_t mm_allocator = { "mm", mm_malloc, mm_free };
+static const allocator_t libc_allocator = { "libc", malloc, free };
+
+static void gen_fixed(script_t *sp);
+static void gen_lifo(script_t *sp);
+static void gen_fifo(script_t *sp);
+static void gen_random(script_t *sp);
+static void gen_prodcons(script_t *sp);
+static void gen_batch(script_t *sp);
+static void add_op(script_t *sp, unsigned int slot, unsigned int size);
+static void replay(void *arg);
+static void replay_batch(void *arg);
+static int batch_len(const benchop_t *op, const benchop_t *end);
+static void start_heap(void);
+static void fill_block(unsigned int slot, unsigned int size);
+static void check_block(run_t *rp, unsigned int slot);
+static int check_compact(void);
+static int check_aligned(void);
+static void report(const char *name, const char *alloc, int ops,
+                   double cycles, double mhz);
+static void usage(void);
+
+static const workload_t workloads[] = {
+    { "fixed",    gen_fixed,    0 },
+    { "lifo",     gen_lifo,     0 },
+    { "fifo",     gen_fifo,     0 },
+    { "random",   gen_random,   0 },
+    { "prodcons", gen_prodcons, 0 },
+    { "batch",    gen_batch,    1 },
+    { NULL, NULL, 0 }
+};
+
+static void *blocks[MAXSLOTS];
+static unsigned int sizes[MAXSLOTS];    /* payload sizes, when checking */
+static void *ptrs[MAXSLOTS];            /* a batch for mm_free_batch */
+static mm_handle_t handles[MAXSLOTS];   /* movable blocks, -c */
+
+int main(int argc, char **argv)
+{
+    const char *only = NULL;
+    int max_ops = DEFAULT_OPS, libc = 0, compact = 0, aligned = 0;
+    int c, i, found = 0, errors = 0;
+    double cycles, total_ops = 0, total_cycles = 0, Mhz;
+    script_t script;
+    run_t run;
+
+    while ((c = getopt(argc, argv, "n:w:aclvh")) != EOF) {
+        switch (c) {
+        case 'n': /* Mallocs and frees per workload */
+            max_ops = atoi(optarg);
+            break;
+        case 'w': /* Run one workload only */
+            only = optarg;
+            break;
+        case 'a': /* Check the aligned allocations, time nothing */
+            aligned = 1;
+            break;
+        case 'c': /* Check mm_compact, time nothing */
+            compact = 1;
+            break;
+        case 'l': /* Run libc malloc as well */
+            libc = 1;
+            break;
+        case 'v': /* Report the clock rate */
+            verbose = 1;
+            break;
+        case 'h': /* Print this message */
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (max_ops < 2 * MAXSLOTS) {
+        fprintf(stderr, "mbench: -n must be at least %d\n", 2 * MAXSLOTS);
+        exit(1);
+    }
+
+    script.max_ops = max_ops;
+    if ((script.ops = malloc(max_ops * sizeof(benchop_t))) == NULL) {
+        fprintf(stderr, "mbench: out of memory for the scripts\n");
+        exit(1);
+    }
+    mem_init();
+    if (compact || aligned) {
+        if (compact)
+            errors += check_compact();
+        if (aligned)
+            errors += check_aligned();
+        mem_deinit();
+        return errors ? 1 : 0;
+    }
+    set_fcyc_k(3);
+    set_fcyc_maxsamples(20);
+    set_fcyc_epsilon(0.01);
+    set_fcyc_compensate(1);
+    Mhz = mhz(verbose);
+
+    printf("%-10s %6s %9s %8s %7s %7s\n",
+           "workload", "alloc", "ops", "Kops", "cyc/op", "ns/op");
+    for (i = 0; workloads[i].name != NULL; i++) {
+        if (only != NULL && strcmp(only, workloads[i].name) != 0)
+            continue;
+        found = 1;
+        srand(SEED);
+        script.num_ops = 0;
+        workloads[i].gen(&script);
+
+        run.script = &script;
+        run.alloc = &mm_allocator;
+
+        /* Correctness first: no payload may change, the heap must check */
+        run.check = 1;
+        run.errors = 0;
+        (workloads[i].batched ? replay_batch : replay)(&run);
+        if (run.errors) {
+            printf("%-10s %6s %9s\n", workloads[i].name, "mm", "ERROR");
+            errors++;
+            continue;
+        }
+
+        run.check = 0;
+        cycles = fcyc(workloads[i].batched ? replay_batch : replay, &run);
+        total_ops += script.num_ops;
+        total_cycles += cycles;
+        report(workloads[i].name, "mm", script.num_ops, cycles, Mhz);
+
+        /* libc has no batches, it runs the same ops one at a time */
+        if (libc) {
+            run.alloc = &libc_allocator;
+            report("", "libc", script.num_ops, fcyc(replay, &run), Mhz);
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "mbench: no workload named %s\n", only);
+        exit(1);
+    }
+    if (only == NULL && !errors)
+        report("total", "mm", total_ops, total_cycles, Mhz);
+
+    free(script.ops);
+    mem_deinit();
+    return errors ? 1 : 0;
+}
+
+/*
+ * gen_fixed - a working set of 64 blocks of 32 bytes, replace a random
+ *             one until the script is full
+ */
+static void gen_fixed(script_t *sp)
+{
+    unsigned int slot;
+
+    for (slot = 0; slot < 64; slot++)
+        add_op(sp, slot, 32);
+    while (sp->num_ops + 2 + 64 <= sp->max_ops) {
+        slot = rand() % 64;
+        add_op(sp, slot, 0);
+        add_op(sp, slot, 32);
+    }
+    for (slot = 0; slot < 64; slot++)
+        add_op(sp, slot, 0);
+}
+
+/*
+ * gen_lifo - 512 blocks of 48 bytes, freed newest first
+ */
+static void gen_lifo(script_t *sp)
+{
+    int slot;
+
+    while (sp->num_ops + 2 * 512 <= sp->max_ops) {
+        for (slot = 0; slot < 512; slot++)
+            add_op(sp, slot, 48);
+        for (slot = 511; slot >= 0; slot--)
+            add_op(sp, slot, 0);
+    }
+}
+
+/*
+ * gen_fifo - 512 blocks of 48 bytes, freed oldest first
+ */
+static void gen_fifo(script_t *sp)
+{
+    int slot;
+
+    while (sp->num_ops + 2 * 512 <= sp->max_ops) {
+        for (slot = 0; slot < 512; slot++)
+            add_op(sp, slot, 48);
+        for (slot = 0; slot < 512; slot++)
+            add_op(sp, slot, 0);
+    }
+}
+
+/*
+ * gen_random - a working set of 1024 blocks of 1 to 4096 bytes, 3 in 4
+ *              of at most 128 bytes, replace a random one until the
+ *              script is full
+ */
+static void gen_random(script_t *sp)
+{
+    unsigned int slot;
+
+#define RANDOM_SIZE() (1 + rand() % (rand() % 4 ? 128 : 4096))
+    for (slot = 0; slot < MAXSLOTS; slot++)
+        add_op(sp, slot, RANDOM_SIZE());
+    while (sp->num_ops + 2 + MAXSLOTS <= sp->max_ops) {
+        slot = rand() % MAXSLOTS;
+        add_op(sp, slot, 0);
+        add_op(sp, slot, RANDOM_SIZE());
+    }
+    for (slot = 0; slot < MAXSLOTS; slot++)
+        add_op(sp, slot, 0);
+#undef RANDOM_SIZE
+}
+
+/*
+ * gen_prodcons - a queue of up to MAXSLOTS blocks of 16 to 512 bytes,
+ *                filled and drained in bursts of 1 to 32 blocks
+ */
+static void gen_prodcons(script_t *sp)
+{
+    unsigned int head = 0, tail = 0, n;
+
+    while (sp->num_ops + 2 * 32 + 2 * MAXSLOTS <= sp->max_ops) {
+        for (n = 1 + rand() % 32; n > 0 && tail - head < MAXSLOTS; n--)
+            add_op(sp, tail++ % MAXSLOTS, 16 + rand() % 497);
+        for (n = 1 + rand() % 32; n > 0 && head < tail; n--)
+            add_op(sp, head++ % MAXSLOTS, 0);
+    }
+    while (head < tail)
+        add_op(sp, head++ % MAXSLOTS, 0);
+}
+
+/*
+ * gen_batch - batches of 1 to 512 blocks of one size, 16 to 512 bytes,
+ *             in the two halves of the slots by turns. A batch comes in,
+ *             then the one before it goes, in random order.
+ */
+static void gen_batch(script_t *sp)
+{
+    unsigned int order[MAXSLOTS / 2], count[2] = { 0, 0 };
+    unsigned int half = 0, n, size, i, j, t;
+
+    while (sp->num_ops + 2 * MAXSLOTS <= sp->max_ops) {
+        n = 1 + rand() % (MAXSLOTS / 2);
+        size = 16 + rand() % 497;
+        for (i = 0; i < n; i++)
+            add_op(sp, half * MAXSLOTS / 2 + i, size);
+        count[half] = n;
+
+        half ^= 1;
+        for (i = 0; i < count[half]; i++)
+            order[i] = i;
+        for (i = count[half]; i > 1; i--) {
+            j = rand() % i;
+            t = order[i - 1];
+            order[i - 1] = order[j];
+            order[j] = t;
+        }
+        for (i = 0; i < count[half]; i++)
+            add_op(sp, half * MAXSLOTS / 2 + order[i], 0);
+        count[half] = 0;
+    }
+    for (half = 0; half < 2; half++)
+        for (i = 0; i < count[half]; i++)
+            add_op(sp, half * MAXSLOTS / 2 + i, 0);
+}
+
+/*
+ * add_op - append a request to the script, the generator leaves room
+ */
+static void add_op(script_t *sp, unsigned int slot, unsigned int size)
+{
+    sp->ops[sp->num_ops].slot = slot;
+    sp->ops[sp->num_ops].size = size;
+    sp->num_ops++;
+}
+
+/*
+ * report - print the throughput and the time per operation of a run
+ */
+static void report(const char *name, const char *alloc, int ops,
+                   double cycles, double mhz)
+{
+    printf("%-10s %6s %9d %8.0f %7.1f %7.1f\n", name, alloc, ops,
+           ops * mhz / cycles * 1e3, cycles / ops, cycles / mhz * 1e3 / ops);
+}
+
+/*
+ * replay - run a script on a fresh heap, timed by fcyc
+ *          The first byte of each block is written, as a program would.
+ */
+static void replay(void *arg)
+{
+    run_t *rp = arg;
+    const benchop_t *op = rp->script->ops;
+    const benchop_t *end = op + rp->script->num_ops;
+    void *(*alloc)(size_t) = rp->alloc->malloc;
+    void (*release)(void *) = rp->alloc->free;
+    char *p;
+
+    if (rp->alloc == &mm_allocator)
+        start_heap();
+    for (; op < end; op++) {
+        if (op->size == 0) {
+            if (rp->check)
+                check_block(rp, op->slot);
+            release(blocks[op->slot]);
+            continue;
+        }
+        if ((p = alloc(op->size)) == NULL) {
+            fprintf(stderr, "mbench: %s malloc failed\n", rp->alloc->name);
+            exit(1);
+        }
+        *p = 1;
+        blocks[op->slot] = p;
+        if (rp->check)
+            fill_block(op->slot, op->size);
+    }
+    if (rp->check && rp->alloc == &mm_allocator)
+        mm_checkheap(__LINE__);
+}
+
+/*
+ * replay_batch - run a script on a fresh mm heap, each run of mallocs
+ *                into consecutive slots by mm_malloc_batch and each run
+ *                of frees by mm_free_batch, timed by fcyc
+ */
+static void replay_batch(void *arg)
+{
+    run_t *rp = arg;
+    const benchop_t *op = rp->script->ops;
+    const benchop_t *end = op + rp->script->num_ops;
+    int i, n;
+
+    start_heap();
+    for (; op < end; op += n) {
+        n = batch_len(op, end);
+        if (op->size == 0) {
+            for (i = 0; i < n; i++) {
+                if (rp->check)
+                    check_block(rp, op[i].slot);
+                ptrs[i] = blocks[op[i].slot];
+            }
+            mm_free_batch(ptrs, n);
+        }
+        else {
+            if (mm_malloc_batch(op->size, n, blocks + op->slot) != (size_t)n) {
+                fprintf(stderr, "mbench: mm_malloc_batch failed\n");
+                exit(1);
+            }
+            for (i = 0; i < n; i++) {
+                *(char *)blocks[op->slot + i] = 1;
+                if (rp->check)
+                    fill_block(op->slot + i, op->size);
+            }
+        }
+        if (rp->check)
+            mm_checkheap(__LINE__);
+    }
+}
+
+/*
+ * batch_len - the ops from op on that go as one batch: frees, or
+ *             mallocs of one size into consecutive slots
+ */
+static int batch_len(const benchop_t *op, const benchop_t *end)
+{
+    int n;
+
+    for (n = 1; op + n < end; n++) {
+        if (op->size == 0 ? op[n].size != 0 :
+            op[n].size != op->size || op[n].slot != op->slot + n)
+            break;
+    }
+    return n;
+}
+
+/*
+ * start_heap - a fresh mm heap for a replay
+ */
+static void start_heap(void)
+{
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mbench: mm_init failed\n");
+        exit(1);
+    }
+}
+
+/*
+ * fill_block - fill the payload in slot with a byte tagged by the slot
+ */
+static void fill_block(unsigned int slot, unsigned int size)
+{
+    memset(blocks[slot], slot & 0xff, size);
+    sizes[slot] = size;
+}
+
+/*
+ * check_block - count an error if the payload in slot lost its tag
+ */
+static void check_block(run_t *rp, unsigned int slot)
+{
+    unsigned char *p = blocks[slot];
+    unsigned int i;
+
+    for (i = 0; i < sizes[slot]; i++) {
+        if (p[i] != (slot & 0xff)) {
+            fprintf(stderr, "mbench: block %u (%p) garbled at byte %u\n",
+                    slot, p, i);
+            rp->errors++;
+            return;
+        }
+    }
+}
+
+/*
+ * check_compact - fill the heap with movable blocks around a pinned one,
+ *                 free every other handle and compact, a few times over.
+ *                 The heap must shrink by what mm_compact says, every
+ *                 payload left must be intact, and the heap must check.
+ *
+ *	return the number of errors
+ */
+static int check_compact(void)
+{
+    unsigned char *p;
+    size_t before, shrank;
+    unsigned int i, k;
+    int round, errors = 0;
+    void *pin;
+
+    srand(SEED);
+    start_heap();
+    for (round = 0; round < COMPACT_ROUNDS; round++) {
+        pin = NULL;
+        for (i = 0; i < MAXSLOTS; i++) {
+            if (i == MAXSLOTS / 2 && (pin = mm_malloc(64)) == NULL)
+                break;
+            sizes[i] = 1 + rand() % (rand() % 8 ? 128 : 4096);
+            if ((handles[i] = mm_halloc(sizes[i])) == 0)
+                break;
+            memset(mm_hptr(handles[i]), i & 0xff, sizes[i]);
+        }
+        if (i < MAXSLOTS) {
+            fprintf(stderr, "mbench: mm_halloc failed\n");
+            exit(1);
+        }
+        for (i = 1; i < MAXSLOTS; i += 2) {
+            mm_hfree(handles[i]);
+            handles[i] = 0;
+        }
+
+        before = mem_heapsize();
+        shrank = mm_compact();
+        mm_checkheap(__LINE__);
+        if (shrank == 0 || mem_heapsize() != before - shrank) {
+            fprintf(stderr, "mbench: mm_compact shrank %zu bytes of %zu, "
+                    "the heap is %zu\n", shrank, before, mem_heapsize());
+            errors++;
+        }
+        for (i = 0; i < MAXSLOTS; i += 2) {
+            p = mm_hptr(handles[i]);
+            for (k = 0; k < sizes[i] && p[k] == (i & 0xff); k++)
+                ;
+            if (k < sizes[i]) {
+                fprintf(stderr, "mbench: handle %u (%p) garbled at byte %u "
+                        "after mm_compact\n", handles[i], p, k);
+                errors++;
+            }
+            mm_hfree(handles[i]);
+        }
+        mm_free(pin);
+        mm_checkheap(__LINE__);
+    }
+    printf("compact %s\n", errors ? "ERROR" : "OK");
+    return errors;
+}
+
+/*
+ * check_aligned - fill the heap with blocks of mixed sizes at alignments
+ *                 from 16 bytes to ALIGN_MAX, through memalign,
+ *                 posix_memalign and aligned_alloc in turn, and free them
+ *                 in random order, a few times over. Every block must be
+ *                 aligned, have as many usable bytes as it asked for and
+ *                 keep its payload, and the heap must check.
+ *
+ *	return the number of errors
+ */
+static int check_aligned(void)
+{
+    unsigned int order[MAXSLOTS], i, j, t, k;
+    size_t align, usable;
+    unsigned char *p;
+    int round, errors = 0;
+
+    srand(SEED);
+    start_heap();
+    for (round = 0; round < ALIGN_ROUNDS; round++) {
+        for (i = 0; i < MAXSLOTS; i++) {
+            align = (size_t)16 << rand() % 13;
+            sizes[i] = 1 + rand() % (rand() % 8 ? 256 : 3 * ALIGN_MAX);
+            switch (i % 3) {
+            case 0:
+                blocks[i] = mm_memalign(align, sizes[i]);
+                break;
+            case 1:
+                if (mm_posix_memalign(&blocks[i], align, sizes[i]) != 0)
+                    blocks[i] = NULL;
+                break;
+            default:
+                blocks[i] = mm_aligned_alloc(align, sizes[i]);
+                break;
+            }
+            if (blocks[i] == NULL) {
+                fprintf(stderr, "mbench: aligned malloc of %u bytes at %zu "
+                        "failed\n", sizes[i], align);
+                exit(1);
+            }
+            if ((size_t)blocks[i] & (align - 1)) {
+                fprintf(stderr, "mbench: block %u (%p) is not aligned to "
+                        "%zu\n", i, blocks[i], align);
+                errors++;
+            }
+            if ((usable = mm_malloc_usable_size(blocks[i])) < sizes[i]) {
+                fprintf(stderr, "mbench: block %u (%p) has %zu usable bytes "
+                        "of %u\n", i, blocks[i], usable, sizes[i]);
+                errors++;
+            }
+            memset(blocks[i], i & 0xff, sizes[i]);
+            order[i] = i;
+        }
+        mm_checkheap(__LINE__);
+
+        for (i = MAXSLOTS; i > 1; i--) {
+            j = rand() % i;
+            t = order[i - 1];
+            order[i - 1] = order[j];
+            order[j] = t;
+        }
+        for (i = 0; i < MAXSLOTS; i++) {
+            p = blocks[order[i]];
+            for (k = 0; k < sizes[order[i]] && p[k] == (order[i] & 0xff); k++)
+                ;
+            if (k < sizes[order[i]]) {
+                fprintf(stderr, "mbench: block %u (%p) garbled at byte %u\n",
+                        order[i], p, k);
+                errors++;
+            }
+            mm_free(p);
+        }
+        mm_checkheap(__LINE__);
+    }
+    printf("aligned %s\n", errors ? "ERROR" : "OK");
+    return errors;
+}
+
+static void usage(void)
+{
+    int i;
+
+    fprintf(stderr, "Usage: mbench [-achlv] [-n <ops>] [-w <workload>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-n <ops>   Mallocs and frees per workload (default %d).\n",
+            DEFAULT_OPS);
+    fprintf(stderr, "\t-w <name>  Run one workload only:");
+    for (i = 0; workloads[i].name != NULL; i++)
+        fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, ".\n");
+    fprintf(stderr, "\t-a         Check the aligned allocations, time nothing.\n");
+    fprintf(stderr, "\t-c         Check mm_compact, time nothing.\n");
+    fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-v         Report the clock rate.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
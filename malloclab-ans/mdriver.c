@@ -34,6 +34,9 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+#define RSS_SAMPLES   20 /* resident heap samples per trace (-r) */
+#define PROFILE_CHECK_RATE 4096 /* mean bytes between heap samples (-p) */
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -105,6 +108,10 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double heap;     /* peak heap size in bytes */
+    double rss;      /* peak bytes of the heap in memory (-r) */
+    double rss_end;  /* bytes of the heap in memory at the end (-r) */
+    double sbrks;    /* mem_sbrk calls that grew the heap (-b) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -124,8 +131,11 @@ typedef struct {
  * realloc and when we free.  With DBG_EXPENSIVE, we check every block
  * every operation.
  * randint_t should be a byte, in case students return unaligned memory.
+ * A trace with ignore_ranges set is too big to touch every byte, only
+ * the first BIG_CHECK_LEN of each of its blocks are used.
  *******************/
 #define RANDOM_DATA_LEN (1<<16)
+#define BIG_CHECK_LEN (1<<12)
 typedef unsigned char randint_t;
 static const char randint_t_name[] = "byte";
 static randint_t random_data[RANDOM_DATA_LEN];
@@ -140,6 +150,10 @@ static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
 int verbose = 1;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 int onetime_flag = 0;
+static int rss_flag = 0; /* sample the resident heap size */
+static int sized_flag = 0; /* free with mm_free_sized */
+static int sbrk_flag = 0; /* report the number of heap extensions */
+static int profile_flag = 0; /* check mm_profile_dump halfway each trace */
 
 /* by default, no timeouts */
 static int set_timeout = 0;
@@ -167,6 +181,9 @@ static int add_range(range_t **ranges, char *lo, int size,
                      const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static int check_stats(const trace_t *trace, int opnum, range_t *ranges);
+static int check_profile(const trace_t *trace, int opnum);
+static int cmp_size(const void *a, const void *b);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
@@ -186,7 +203,7 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
 
 /* Various helper routines */
@@ -245,7 +262,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
@@ -290,7 +307,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlDbprz")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -348,6 +365,22 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'r': /* Report the resident heap size */
+            rss_flag = 1;
+            break;
+
+        case 'b': /* Report the number of heap extensions */
+            sbrk_flag = 1;
+            break;
+
+        case 'z': /* Free with the size of each block */
+            sized_flag = 1;
+            break;
+
+        case 'p': /* Check the heap profile, mm.c built with -DHEAP_PROFILE */
+            profile_flag = 1;
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -368,6 +401,14 @@ int main(int argc, char **argv)
         init_random_data();
     }
 
+    /* mm.c reads the sampling rate on its first malloc */
+    if (profile_flag) {
+        char rate[32];
+
+        snprintf(rate, sizeof(rate), "%d", PROFILE_CHECK_RATE);
+        setenv("MM_PROFILE_RATE", rate, 1);
+    }
+
     /* Initialize the timing package */
     init_fsecs();
 
@@ -668,6 +709,159 @@ static void clear_ranges(range_t **ranges)
     *ranges = NULL;
 }
 
+/*
+ * check_stats - Check that the totals of mm_stats agree with each other
+ *     and with the blocks of the range list: every live payload byte
+ *     must be held, and the free bytes are what is left of the heap.
+ *     mm_checkheap checks the free byte counters against its heap walk.
+ */
+static int check_stats(const trace_t *trace, int opnum, range_t *ranges)
+{
+    mm_stats_t st;
+    size_t live = 0, class_free = 0;
+    range_t *p;
+    int i;
+
+    mm_stats(&st);
+    for (p = ranges;  p != NULL;  p = p->next)
+        live += p->hi - p->lo + 1;
+    for (i = 0;  i < st.nclasses;  i++)
+        class_free += st.class_free[i];
+
+    if (st.heap != mem_heapsize() || st.peak < st.heap) {
+        malloc_error(trace, opnum, "mm_stats heap %zu, peak %zu, "
+                     "the heap is %zu", st.heap, st.peak, mem_heapsize());
+        return 0;
+    }
+    if (st.held + st.free_bytes != st.heap || live > st.held) {
+        malloc_error(trace, opnum, "mm_stats holds %zu and has %zu free "
+                     "of %zu, %zu are live", st.held, st.free_bytes,
+                     st.heap, live);
+        return 0;
+    }
+    if (class_free != st.free_bytes || st.largest_free > st.free_bytes ||
+        (st.free_bytes > 0 && st.largest_free == 0)) {
+        malloc_error(trace, opnum, "mm_stats has %zu free, %zu by class, "
+                     "the largest free block is %zu", st.free_bytes,
+                     class_free, st.largest_free);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * check_profile - Dump the heap profile before request opnum and check
+ *     it: the header must count the samples that follow and their bytes,
+ *     at the rate we asked for, and each sample must be the size of a
+ *     block live at that point, no block sampled twice. With enough live
+ *     bytes, there must be samples.
+ */
+static int check_profile(const trace_t *trace, int opnum)
+{
+    char line[MAXLINE];
+    unsigned long n, bytes, n2, bytes2, c, size, size2;
+    unsigned long count = 0, sum = 0;
+    size_t *live, *sampled, total = 0;
+    int i, nlive = 0, ok = 1;
+    long rate;
+    FILE *fp;
+
+    /* The blocks live before request opnum, and their sizes */
+    if ((live = calloc(trace->num_ids, sizeof(size_t))) == NULL)
+        unix_error("calloc error in check_profile");
+    for (i = 0;  i < opnum;  i++) {
+        if (trace->ops[i].type != FREE)
+            live[trace->ops[i].index] = trace->ops[i].size;
+        else if (trace->ops[i].index >= 0)
+            live[trace->ops[i].index] = 0;
+    }
+    for (i = 0;  i < trace->num_ids;  i++) {
+        if (live[i] != 0) {
+            total += live[i];
+            live[nlive++] = live[i];
+        }
+    }
+    qsort(live, nlive, sizeof(size_t), cmp_size);
+    if ((sampled = calloc(nlive + 1, sizeof(size_t))) == NULL)
+        unix_error("calloc error in check_profile");
+
+    if ((fp = tmpfile()) == NULL)
+        unix_error("tmpfile error in check_profile");
+    if (mm_profile_dump(fileno(fp)) < 0) {
+        malloc_error(trace, opnum, "mm_profile_dump failed (mm.c must be "
+                     "built with -DHEAP_PROFILE)");
+        ok = 0;
+        goto out;
+    }
+    rewind(fp);
+
+    if (fgets(line, MAXLINE, fp) == NULL ||
+        sscanf(line, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%ld",
+               &n, &bytes, &n2, &bytes2, &rate) != 5 ||
+        n != n2 || bytes != bytes2 || rate != PROFILE_CHECK_RATE) {
+        malloc_error(trace, opnum, "bad heap profile header");
+        ok = 0;
+        goto out;
+    }
+    while (fgets(line, MAXLINE, fp) != NULL && line[0] != '\n') {
+        if (sscanf(line, "%lu: %lu [%lu: %lu] @", &c, &size, &n2,
+                   &size2) != 4 || c != 1 || n2 != 1 || size != size2 ||
+            count == (unsigned long)nlive) {
+            malloc_error(trace, opnum, "bad heap profile sample %lu",
+                         count + 1);
+            ok = 0;
+            goto out;
+        }
+        sampled[count++] = size;
+        sum += size;
+    }
+    if (fgets(line, MAXLINE, fp) == NULL ||
+        strcmp(line, "MAPPED_LIBRARIES:\n") != 0) {
+        malloc_error(trace, opnum, "heap profile has no MAPPED_LIBRARIES");
+        ok = 0;
+        goto out;
+    }
+    if (count != n || sum != bytes) {
+        malloc_error(trace, opnum, "heap profile counts %lu samples of %lu "
+                     "bytes, it has %lu of %lu", n, bytes, count, sum);
+        ok = 0;
+        goto out;
+    }
+    if (count == 0 && total >= 32 * PROFILE_CHECK_RATE) {
+        malloc_error(trace, opnum, "heap profile has no sample of %zu live "
+                     "bytes", total);
+        ok = 0;
+        goto out;
+    }
+
+    /* Every sample is a live block, each block is sampled once at most */
+    qsort(sampled, count, sizeof(size_t), cmp_size);
+    for (c = 0, i = 0;  c < count;  c++) {
+        while (i < nlive && live[i] < sampled[c])
+            i++;
+        if (i == nlive || live[i] != sampled[c]) {
+            malloc_error(trace, opnum, "heap profile samples a block of "
+                         "%zu bytes that is not live", sampled[c]);
+            ok = 0;
+            goto out;
+        }
+        i++;
+    }
+
+out:
+    fclose(fp);
+    free(sampled);
+    free(live);
+    return ok;
+}
+
+static int cmp_size(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+
+    return (x > y) - (x < y);
+}
+
 /**********************************************
  * The following routines handle the random data used for
  * checking memory access.
@@ -696,6 +890,8 @@ static void randomize_block(trace_t *traces, int index) {
     block = (randint_t*)traces->blocks[index];
     size = traces->block_sizes[index] / sizeof(*block);
     base = traces->block_rand_base[index];
+    if(traces->ignore_ranges && size > BIG_CHECK_LEN)
+        size = BIG_CHECK_LEN;
 
     for(i = 0; i < size; i++) {
         block[i] = random_data[(base + i) % RANDOM_DATA_LEN];
@@ -716,6 +912,8 @@ static void check_index(const trace_t *trace, int opnum, int index) {
     block = (randint_t*)trace->blocks[index];
     size = trace->block_sizes[index] / sizeof(*block);
     base = trace->block_rand_base[index];
+    if(trace->ignore_ranges && size > BIG_CHECK_LEN)
+        size = BIG_CHECK_LEN;
 
     for(i = 0; i < size; i++) {
         if(block[i] != random_data[(base + i) % RANDOM_DATA_LEN]) {
@@ -892,11 +1090,17 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
+        if (profile_flag && i == trace->num_ops / 2 &&
+            !check_profile(trace, i))
+            return 0;
+
         if(debug_mode == DBG_EXPENSIVE) {
             range_t *r;
                         
             /* Let the students check their own heap */
             mm_checkheap(verbose);
+            if (!check_stats(trace, i, *ranges))
+                return 0;
 
             /* Now check that all our allocated blocks have the right data */
             r = *ranges;
@@ -982,7 +1186,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            if (sized_flag && p != NULL)
+                mm_free_sized(p, trace->block_sizes[index]);
+            else
+                mm_free(p);
             break;
 
         default:
@@ -991,6 +1198,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
     }
 
+    /* The statistics must add up with the blocks still live */
+    if (!check_stats(trace, trace->num_ops - 1, *ranges))
+        return 0;
+
     /* As far as we know, this is a valid malloc package */
     return 1;
 }
@@ -1000,25 +1211,34 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   high water mark of the heap in bytes while running the student's
+ *   malloc package on the trace. mem_sbrk() lets the students
+ *   decrement the brk pointer, so this is not always the final brk.
+ *
+ *   With -r, the bytes of the heap in memory are sampled RSS_SAMPLES
+ *   times along the trace, the peak and final values go to stats.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
     int i;
     int index;
     int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
+    long max_total_size = 0;  /* may pass 2GB with a wide heap */
+    long total_size = 0;
+    int interval = trace->num_ops / RSS_SAMPLES + 1;
+    size_t rss;
     char *p;
     char *newp, *oldp;
 
     reinit_trace(trace);
 
+    /* start from a heap with no page in memory */
+    if (rss_flag)
+        mem_release(mem_heap_lo(), mem_maxheapsize());
+    stats->rss = 0;
+
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
     if (mm_init() < 0)
@@ -1071,7 +1291,10 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            if (sized_flag && p != NULL)
+                mm_free_sized(p, size);
+            else
+                mm_free(p);
 
             total_size -= size;
             break;
@@ -1084,11 +1307,25 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
+
+        /* sample the resident heap size */
+        if (rss_flag && (i % interval == 0 || i == trace->num_ops - 1)) {
+            rss = mem_rss();
+            if (rss > stats->rss)
+                stats->rss = rss;
+            if (verbose > 2)
+                printf("op %6d: heap %8zu KB, payload %8ld KB, rss %8zu KB\n",
+                       i, mem_heapsize() / 1024, total_size / 1024,
+                       rss / 1024);
+        }
     }
 
     printf(".");
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    stats->heap = mem_maxheapsize();
+    stats->rss_end = rss_flag ? mem_rss() : 0;
+    stats->sbrks = mem_sbrkcount();
+    return ((double)max_total_size / (double)mem_maxheapsize());
 }
 
 
@@ -1118,6 +1355,7 @@ static void eval_mm_speed(void *ptr)
             if ((p = mm_malloc(size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
             break;
 
         case REALLOC: /* mm_realloc */
@@ -1127,6 +1365,7 @@ static void eval_mm_speed(void *ptr)
             if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
                 app_error("mm_realloc error in eval_mm_speed");
             trace->blocks[index] = newp;
+            trace->block_sizes[index] = newsize;
             break;
 
         case FREE: /* mm_free */
@@ -1136,7 +1375,10 @@ static void eval_mm_speed(void *ptr)
             } else {
                 block = trace->blocks[index];
             }
-            mm_free(block);
+            if (sized_flag && block != NULL)
+                mm_free_sized(block, trace->block_sizes[index]);
+            else
+                mm_free(block);
             break;
 
         default:
@@ -1264,8 +1506,13 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     char wstr;
 
     /* Print the individual results for each trace */
-    printf("  %2s%6s %5s%8s%9s  %s\n",
-           "valid", "util", "ops", "secs", "Kops", "trace");
+    printf("  %2s%6s %5s%8s%9s  ",
+           "valid", "util", "ops", "secs", "Kops");
+    if (rss_flag)
+        printf("%8s%8s%8s  ", "heapKB", "rssKB", "endKB");
+    if (sbrk_flag)
+        printf("%8s  ", "sbrks");
+    printf("%s\n", "trace");
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
             switch(stats[i].weight)
@@ -1307,6 +1554,19 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
             else
                 printf("%8s%10s%6s", "--", "--", "--");
 
+            /* the resident heap size, if it was sampled */
+            if (rss_flag && stats[i].heap > 0)
+                printf("%10.0f%8.0f%8.0f", stats[i].heap / 1024,
+                       stats[i].rss / 1024, stats[i].rss_end / 1024);
+            else if (rss_flag)
+                printf("%10s%8s%8s", "--", "--", "--");
+
+            /* the heap extensions, if the trace was run for util */
+            if (sbrk_flag && stats[i].heap > 0)
+                printf("%8.0f", stats[i].sbrks);
+            else if (sbrk_flag)
+                printf("%8s", "--");
+
             printf(" %s\n", stats[i].filename);
 
             if(stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1417,7 +1677,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlVdDbprz] [-f <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1428,5 +1688,9 @@ static void usage(void)
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
+    fprintf(stderr, "\t-r         Report the peak and final resident heap size.\n");
+    fprintf(stderr, "\t-b         Report the number of mem_sbrk calls that grew the heap.\n");
+    fprintf(stderr, "\t-z         Free with mm_free_sized and the size of each block.\n");
+    fprintf(stderr, "\t-p         Check mm_profile_dump halfway through each trace (mdriver_prof).\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
 }
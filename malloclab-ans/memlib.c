@@ -19,7 +19,9 @@
 /* private variables */
 static char *heap;
 static char *mem_brk;
+static char *mem_peak_brk;		/* highest brk since the last reset */
 static char *mem_max_addr;
+static size_t mem_sbrks;		/* calls that grew the heap since the reset */
 
 /* 
  * mem_init - initialize the memory system model
@@ -29,11 +31,17 @@ void mem_init(void){
 	heap = mmap((void *)0x800000000, /* suggested start*/
 			MAX_HEAP,				/* length */
 			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
+			MAP_PRIVATE | MAP_NORESERVE,	/* pages are only taken when touched */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
-	mem_max_addr = heap + MAX_HEAP;
+	close(dev_zero);
+	if (heap == MAP_FAILED) {
+		fprintf(stderr, "ERROR: mem_init failed. Could not map the heap...\n");
+		heap = NULL;				/* every mem_sbrk fails */
+	}
+	mem_max_addr = heap ? heap + MAX_HEAP : NULL;
 	mem_brk = heap;					/* heap is empty initially */
+	mem_peak_brk = heap;
 }
 
 /* 
@@ -48,28 +56,61 @@ void mem_deinit(void){
  */
 void mem_reset_brk(){
 	mem_brk = heap;
+	mem_peak_brk = heap;
+	mem_sbrks = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area. A
+ *		negative incr shrinks the heap and gives its pages back to the OS.
  */
-void *mem_sbrk(int incr) {
+void *mem_sbrk(intptr_t incr) {
 	char *old_brk = mem_brk;
 
+	if (incr < 0) {
+		if (mem_brk + incr < heap) {
+			errno = EINVAL;
+			fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap...\n");
+			return (void *)-1;
+		}
+		mem_brk += incr;
+		mem_release(mem_brk, -incr);
+		return (void *)old_brk;
+	}
+
     // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
-            sbrk(incr) == (void *) -1) {
+    // As the malloc of a real program, the mapping is all there is.
+	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)
+#ifndef MM_SHARED
+            || sbrk(incr) == (void *) -1
+#endif
+            ) {
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 		return (void *)-1;
 	}
 
 	mem_brk += incr;
+	mem_sbrks++;
+	if (mem_brk > mem_peak_brk)
+		mem_peak_brk = mem_brk;
 	return (void *)old_brk;
 }
 
+/*
+ * mem_release - give the whole pages in [lo, lo + len) back to the OS.
+ *		They stay in the heap and read as zero when touched again.
+ */
+void mem_release(void *lo, size_t len) {
+	size_t pagesize = mem_pagesize();
+	char *start = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+	char *end = (char *)(((size_t)lo + len) & ~(pagesize - 1));
+
+	if (start < end)
+		madvise(start, end - start, MADV_DONTNEED);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -91,6 +132,43 @@ size_t mem_heapsize() {
 	return (size_t)((void *)mem_brk - (void *)heap);
 }
 
+/*
+ * mem_maxheapsize() - returns the largest heap size in bytes since the
+ *		last reset
+ */
+size_t mem_maxheapsize() {
+	return (size_t)((void *)mem_peak_brk - (void *)heap);
+}
+
+/*
+ * mem_sbrkcount() - returns the number of mem_sbrk calls that grew the
+ *		heap since the last reset
+ */
+size_t mem_sbrkcount() {
+	return mem_sbrks;
+}
+
+/*
+ * mem_rss() - returns the bytes of the heap that are in memory
+ */
+size_t mem_rss() {
+	size_t pagesize = mem_pagesize(), len, n, i, rss = 0;
+	unsigned char vec[1024];
+	char *p;
+
+	for (p = heap; p < mem_peak_brk; p += n * pagesize) {
+		len = mem_peak_brk - p;
+		n = (len + pagesize - 1) / pagesize;
+		if (n > sizeof(vec))
+			n = sizeof(vec);
+		if (mincore(p, n * pagesize, vec) < 0)
+			return 0;
+		for (i = 0; i < n; i++)
+			rss += vec[i] & 1;
+	}
+	return rss * pagesize;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,11 +1,16 @@
+#include <stdint.h>
 #include <unistd.h>
 
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
+void mem_release(void *lo, size_t len);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_maxheapsize(void);
+size_t mem_sbrkcount(void);
+size_t mem_rss(void);
 size_t mem_pagesize(void);
 
@@ -12,28 +12,134 @@
  *      csapp: mm.c
  *
  * Settings:
- *      1) Number of seglists: 9
- *          [16B,32B), [32B, 64B), ..., [4096B, +inf)
- *      2) Chunksize: 256B
+ *      1) Number of seglists: 41, 4 per power of 2
+ *          [16B,20B), [20B,24B), [24B,28B), [28B,32B), [32B,40B), ...,
+ *          [14336B,16384B), [16384B, +inf)
+ *          the last one is a size-keyed bitwise trie, not a list
+ *      2) Chunksize: 256B to start with, see Other policies 7
  *      3) Min block size: 16B
  *      4) Alignment: 8B
  *           All block pointers should be 8B aligned
  *
  * Optimizations:
- *      1) Use 4 byte offsets instead of 8 byte pointers
+ *      1) Use 4 byte offsets instead of 8 byte pointers. Built with
+ *         -DWIDE_HEAP, offsets and headers take 8 bytes for heaps past
+ *         4GB, and the smallest block grows to 32B.
  *      2) Eliminate the footers
  *      3) Use a released best fit policy when scanning the seglist
  *      4) Take the last block into account when extending the heap
+ *      5) Exact best fit for large blocks in O(log n): the trie branches
+ *         on one size bit per level, same-size blocks share a node
+ *      6) A bitmap of the non-empty seglists, the first one that fits is
+ *         found with one count-trailing-zeros
+ *      7) Payloads up to SLAB_MAX bytes are packed in slab runs, one
+ *         object size per run and no header per object (default build).
+ *         Only sizes the header would push to the next 8B go there, once
+ *         their class has been asked for SLAB_WARMUP times.
+ *      8) The fast path of malloc is inlined: the first block list_fit
+ *         would look at in the class of the request, taken if it needs
+ *         no split. find_fit and place are the fallback.
  *
  * Other policies:
  *      1) LIFO insert policy within a seglist
  *      2) Split if the remaining part is larger than min block size
  *      3) Immediately coalesce
+ *      4) A free block of at least release_min bytes gives its pages back
+ *         to the OS, the heap is trimmed if the block ends it. When the
+ *         heap grows back over a trim, release_min doubles (up to
+ *         RELEASE_MAX), so a program cycling through its peak does not
+ *         fault the pages in again every time.
+ *      5) Realloc in place when it can: shrink by freeing the tail,
+ *         grow into a free next block or at the end of the heap
+ *      6) Each arena counts the free bytes of every seglist as blocks
+ *         come and go, so mm_stats never walks the heap
+ *      7) The heap grows by at least the arena's chunk, which doubles
+ *         with every extension up to GROW_MAX, 1/2^GROW_SHIFT of the
+ *         heap and GROW_REQS times the average of the requests that
+ *         extended it, whichever is smallest. A trim starts it over
+ *         at CHUNKSIZE. mm_reserve extends the heap ahead of a burst
+ *         of allocations, it is not trimmed below the reservation.
+ *      8) mm_malloc_batch carves n blocks of one size from a single free
+ *         block. mm_free_batch sorts its pointers, runs of adjacent
+ *         blocks are coalesced into one before they are freed.
+ *      9) Blocks from mm_halloc are movable: the program holds a handle,
+ *         an index into a table of block offsets, and the block keeps
+ *         its handle in its last payload word. mm_compact swaps each
+ *         free block with the movable blocks after it, so holes bubble
+ *         up to the end of the heap, and trims it.
+ *
+ * Deferred coalescing (-DDEFER_COALESCE, default build only):
+ *      1) free puts a block of at most QUICK_MAX bytes on the quick list
+ *         of its exact size, still marked allocated. malloc takes from
+ *         it first, with no seglist or coalescing work. free_sized goes
+ *         by the size it is given, so a block may be up to MINBLOCK - 1
+ *         bytes larger than its list, the slack place does not split.
+ *      2) All the quick lists are coalesced at once when a fit fails or
+ *         a list would hold more than QUICK_COUNT blocks.
+ *      3) Trades utilization for throughput on ping-pong patterns,
+ *         make builds mdriver_dc with it.
+ *
+ * Thread-safe build (-DTHREAD_SAFE):
+ *      1) Up to NARENAS arenas, each with its own seglist headers and
+ *         lock. Threads are assigned to arenas round robin.
+ *      2) An arena grows by ARENA_SEG aligned segments, a side table
+ *         maps every segment to its arena. Only memlib is shared, under
+ *         sbrk_lock.
+ *      3) A block freed by a thread of another arena is pushed onto the
+ *         owner's lock-free remote list, the owner drains it before its
+ *         next allocation from the seglists
+ *      4) Each thread caches free blocks up to TCACHE_MAX bytes, one
+ *         LIFO bin per block size. The common case takes no lock.
+ *      5) Cached blocks stay allocated in the heap's view. A bin is
+ *         refilled and flushed TCACHE_BATCH blocks per lock.
+ *      6) mm_init starts a new heap epoch, caches of an older epoch
+ *         are dropped on their next use
+ *
+ * Hardened build (-DHARDENED), cheap checks on every free:
+ *      1) The prev/next offsets of the seglist rings are xor'd with a
+ *         random heap_key, a free block overwritten through a dangling
+ *         pointer can't name a block of the attacker's choice. A block
+ *         is only unlinked if its neighbours point back at it.
+ *      2) An allocated block ends with a canary word, heap_key xor its
+ *         offset, checked by free and realloc. It catches overflows into
+ *         the next block and headers that were overwritten.
+ *      3) A block that is not allocated, or is cached in a tcache bin, a
+ *         quick list or a remote list (CACHED bit), is a double free.
+ *      4) A block goes to the head or the tail of its seglist at random.
+ *      5) No slab runs, every block has a header and a canary.
+ *      Any failed check aborts. make builds mdriver_hd with it.
+ *
+ * Heap profile (-DHEAP_PROFILE), not with -DHARDENED:
+ *      1) Each thread counts down the bytes it allocates, the malloc
+ *         that takes it below 0 is sampled. The next count is drawn from
+ *         an exponential distribution with a mean of profile_rate bytes.
+ *      2) A sampled block comes from the seglists, SAMPLE_EXTRA bytes
+ *         larger. Its sample record (size and backtrace) goes at its end
+ *         and its header gets the SAMPLED bit, free only looks for the
+ *         record when the bit is set. The live records form a list.
+ *      3) mm_profile_dump writes the live samples as a pprof heap
+ *         profile. With MM_PROFILE=<prefix>, sampling is on and so is a
+ *         dump on PROFILE_SIGNAL. MM_PROFILE_RATE=<bytes> sets the mean,
+ *         0 turns sampling off.
+ *      4) memalign and realloc in place are not sampled, a sampled
+ *         block that is reallocated loses its sample.
+ *      make builds mdriver_prof with it, mdriver_prof -p checks a dump
+ *      halfway through each trace.
+ *
+ * Trace recorder (-DTRACE_RECORD):
+ *      1) With MM_TRACE=<prefix>, every malloc, free and realloc goes
+ *         into a buffer of the calling thread, with a seq from a global
+ *         counter and its size in the thread's histogram. No lock: a
+ *         full buffer is appended to <prefix>.<pid>.raw in one write.
+ *      2) At exit the log is sorted by seq, blocks are numbered and
+ *         written as <prefix>.<pid>.rep for mdriver -f, the histogram
+ *         of the sizes asked for as <prefix>.<pid>.hist.
  *
  * Heap structure:
- * low  +---------------------------+  <-- free_listp
- *      | 9 x 8B seglist headers    |
- *      +---------------------------+  <-- seglist_end
+ * low  +---------------------------+  <-- free_listp (main arena)
+ *      | 41 x 8B seglist headers   |
+ *      | 8B non-empty bitmap       |
+ *      +---------------------------+
  *      | 4B Padding                |
  *      +---------------------------+
  *      | 4B header     first block |
@@ -43,6 +149,11 @@
  *      | Epilogue header           |
  * high +---------------------------+  <-- brk pointer
  *
+ *      In the thread-safe build every arena starts with the same layout,
+ *      with the lock and the remote list after the seglist headers.
+ *      A later segment of an arena holds only the padding, its blocks
+ *      and an epilogue. Offsets are always taken from free_listp.
+ *
  *      Seglist header contains two offsets, the seglist structure is:
  *        +------------------------------+ 
  *        | +----+    +----+    +----+   |
@@ -64,16 +175,55 @@
  *      |footer:block size | undefine |  
  * high +-----------------------------+
  *
+ *      A free block in the tree also keeps 4B offsets of its two
+ *      children and its parent after the next free block offset.
+ *      With -DWIDE_HEAP every 4B field above is 8B wide.
+ *
  *      Only the free block has a footer and the two offsets.   
  *      The pa/pf bit in header indicates whether the previous block is free.
  *      Block pointers always point to the payload.
  *      The "block size" in the epilogue header is always 0.
+ *
+ * Slab run structure (the payload of an allocated block, RUN_SIZE aligned):
+ *  low +-----------------------------+  <-- run pointer
+ *      |4B prev / 4B next run offset |  ring of the runs with free slots
+ *      +-----------------------------+
+ *      |8B bitmap of the used slots  |  slots past the end are set
+ *      +-----------------------------+
+ *      |4B object size | 4B padding  |
+ *      +-----------------------------+
+ *      |slot 0 | slot 1 | ...        |
+ * high +-----------------------------+
+ *
+ *      A bitmap in a heap block, one bit per RUN_SIZE of the heap, tells
+ *      free whether a pointer is in a run. The object size is read from
+ *      the run the pointer is in.
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+#ifdef HARDENED
+#include <sys/random.h>
+#include <time.h>
+#endif
+#ifdef TRACE_RECORD
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#endif
+#ifdef HEAP_PROFILE
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -95,41 +245,107 @@
 /* create aliases for driver tests */
 #define malloc mm_malloc
 #define free mm_free
+#define free_sized mm_free_sized
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define malloc_usable_size mm_malloc_usable_size
 #endif /* def DRIVER */
 
 /* private global variables */
 static char *free_listp = 0;    // Pointer to the first seglist header
 static char *heap_listp = 0;    // Pointer to the first block (virtual)
-static char *seglist_end = 0;   // Boundary of the seglist header array
+static size_t release_min = 0;  // Free blocks this large go back to the OS
+static size_t heap_peak = 0;    // Heap size before the last trim, at least
+#ifndef THREAD_SAFE
+static char *trim_brk = 0;      // Heap end before the last trim
+static char *reserve_brk = 0;   // Heap end after the last mm_reserve
+#endif
+static char *handles = 0;       // Handle table, a block of the heap
+static unsigned int handle_cap = 0;     // Entries in the handle table
+static unsigned int handle_free = 0;    // First free entry, 0 if none
 
 
 // Begin mallocmacros
+// Word width: headers, footers and offsets from free_listp
+#ifdef WIDE_HEAP
+typedef unsigned long word_t;
+#define WSIZE 8
+#define LOGWORDS 5              // log2(4 * WSIZE)
+#define HEAP_BITS 36            // Heap size limit, 64GB
+#else
+typedef unsigned int word_t;
+#define WSIZE 4
+#define LOGWORDS 4              // log2(4 * WSIZE)
+#define HEAP_BITS 32            // Heap size limit, what an offset can reach
+#endif
+
+// Payload alignment, -DMM_ALIGNMENT=16 or 64 for wider default alignment
+#ifndef MM_ALIGNMENT
+#define MM_ALIGNMENT 8
+#endif
+#if MM_ALIGNMENT == 8
+#define LOGALIGN 3
+#elif MM_ALIGNMENT == 16
+#define LOGALIGN 4
+#elif MM_ALIGNMENT == 32
+#define LOGALIGN 5
+#elif MM_ALIGNMENT == 64
+#define LOGALIGN 6
+#else
+#error "MM_ALIGNMENT must be 8, 16, 32 or 64"
+#endif
+
 // Basic constants
-#define ALIGNMENT 8 	 		// double word allignment
-#define WSIZE 4 	  			// word size, footer/header/offset
-#define DSIZE 8	      		// size of: size_t, pointers, seglist headers
-#define MINBLOCK 16				// Minimal block size:
-							    //	4B header, 4B*2 offsets, 4B footer
-#define LOGMINSB 4              // log2(MINBLOCK)
-#define LOGMAXSB 12             // Max seglist block size is 2^(LOGMAXSB) Byte
-#define CHUNKSIZE (1 << 8)      // Extend heap by this amount 
-#define UIMAX     (1 << 31)     // Max unsigned int
+#define ALIGNMENT MM_ALIGNMENT  // double word allignment
+#define DSIZE (2 * WSIZE)       // seglist headers, header + footer
+#define WBITS (8 * WSIZE)       // bits in a word
+#define LOGMINSB (LOGALIGN > LOGWORDS ? LOGALIGN : LOGWORDS) // log2(MINBLOCK)
+#define MINBLOCK (1 << LOGMINSB)    // Minimal block size:
+							    //	header, 2 offsets, footer, aligned
+#define MAX_PAYLOAD ((size_t)1 << (HEAP_BITS - 1)) // Larger requests fail
+#define LOGMAXSB 14             // Blocks of 2^(LOGMAXSB) Byte go in the tree
+#define LOGSUBCLASS 2           // 2^(LOGSUBCLASS) seglists per power of 2
+#define CHUNKSIZE (1 << 8)      // Extend heap by at least this amount
+#define GROW_MAX (1 << 20)      // The chunk stops doubling here,
+#define GROW_SHIFT 5            // at 1/32 of the heap,
+#define GROW_REQS 16            // or at 16 times the average request
+#define RELEASE_MIN (1 << 20)   // Initial release_min
+#define RELEASE_MAX (1 << 26)   // release_min stops doubling here
 
 //flags
 #define ALLOC 0x1
 #define PREALLOC 0x2
+#define CACHED 0x4      // Hardened: allocated, but in a cache of free blocks
+#define SAMPLED 0x4     // Heap profile: allocated, with a sample record
+#if defined(HARDENED) && defined(HEAP_PROFILE)
+#error "CACHED and SAMPLED share a header bit"
+#endif
+
+#ifdef HARDENED
+static word_t heap_key = 0;     // xor'd into free list offsets and canaries
+#define OVERHEAD DSIZE          // Header and canary of an allocated block
+#define LINK_KEY heap_key
+#else
+#define OVERHEAD WSIZE          // Header of an allocated block
+#define LINK_KEY 0
+#endif
 
 #define MAX(x,y) ((x) > (y)? (x) : (y))
 #define MIN(x,y) ((x) < (y)? (x) : (y))
 
+/* Branch layout hints for the fast paths */
+#define LIKELY(x)   __builtin_expect(!!(x), 1)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+
 /* Pack a size prev block's allocated bit, allocated bit into a word */
 #define PACK(size, prev_alloc, alloc)  ((size) | (prev_alloc) | (alloc))
 
 /* Read and write a word at address p */
-#define GETW(p)       (*(unsigned int *)(p))         
-#define PUTW(p, val)  (*(unsigned int *)(p) = (unsigned int)(val)) 
+#define GETW(p)       (*(word_t *)(p))         
+#define PUTW(p, val)  (*(word_t *)(p) = (word_t)(val)) 
 
 /* Read a 8 byte pointer at address p, *p is the offset from heap */
 #define GETPT(p)        ((char *)(free_listp + GETW(p)))
@@ -147,24 +363,61 @@ static char *seglist_end = 0;   // Boundary of the seglist header array
 #define GET_ALLOC(bp) (GETW(HDRP(bp)) & ALLOC)
 #define GET_PREALLOC(bp) (GETW(HDRP(bp)) & PREALLOC)
 
-/* Given block ptr bp, return the block pointer of the prev/next free block */
-#define GET_PREVFBP(bp) GETPT(bp)
-#define GET_NEXTFBP(bp) GETPT(((char *)(bp) + WSIZE))
-
 /* Given block ptr bp, return the address where prev/next offset is stored */
 #define PREV_FPP(bp)    ((char*)(bp))
-#define NEXT_FPP(bp)    ((char*)(bp)+4)
+#define NEXT_FPP(bp)    ((char*)(bp)+WSIZE)
+
+/* Given block ptr bp, read/write the block pointer of the prev/next free
+ * block, the offsets are stored xor LINK_KEY */
+#define GET_PREVFBP(bp) (free_listp + (GETW(PREV_FPP(bp)) ^ LINK_KEY))
+#define GET_NEXTFBP(bp) (free_listp + (GETW(NEXT_FPP(bp)) ^ LINK_KEY))
+#define PUT_PREVFBP(bp, p) PUTW(PREV_FPP(bp), GETOFFSET(p) ^ LINK_KEY)
+#define PUT_NEXTFBP(bp, p) PUTW(NEXT_FPP(bp), GETOFFSET(p) ^ LINK_KEY)
 
 /* Given block ptr bp, compute address of adjacent blocks */
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(bp))
 #define PREV_BLKP(bp)  ((char *)(bp) - \
                         (GETW((char *)bp - DSIZE) & ~(ALIGNMENT-1)) )
 
+/* Set/clear flag bits in the header of bp. A thread that caches or samples
+ * an allocated block flags it without the arena lock, while the owner of
+ * the previous block may write its pa/pf bit: then both have to be atomic.
+ */
+#if defined(THREAD_SAFE) && (defined(HARDENED) || defined(HEAP_PROFILE))
+#define HDR_OR(bp, f)  __atomic_fetch_or((word_t *)HDRP(bp), (f), \
+                                         __ATOMIC_RELAXED)
+#define HDR_AND(bp, f) __atomic_fetch_and((word_t *)HDRP(bp), (f), \
+                                          __ATOMIC_RELAXED)
+#else
+#define HDR_OR(bp, f)  PUTW(HDRP(bp), GETW(HDRP(bp)) | (f))
+#define HDR_AND(bp, f) PUTW(HDRP(bp), GETW(HDRP(bp)) & (f))
+#endif
+
 /* set/reset next block's PREALLOC bit */
-#define SET_NBLK_PREALLOC(bp) (PUTW(HDRP(NEXT_BLKP(bp)), \
-                              (GETW(HDRP(NEXT_BLKP(bp)))|PREALLOC) ) )
-#define RESET_NBLK_PREALLOC(bp) (PUTW(HDRP(NEXT_BLKP(bp)), \
-                                (GETW(HDRP(NEXT_BLKP(bp)))& ~PREALLOC)))
+#define SET_NBLK_PREALLOC(bp)   HDR_OR(NEXT_BLKP(bp), PREALLOC)
+#define RESET_NBLK_PREALLOC(bp) HDR_AND(NEXT_BLKP(bp), ~PREALLOC)
+
+/* The canary of allocated block bp, its last word, and the CACHED bit */
+#ifdef HARDENED
+#define CANARY(bp)       ((word_t)(heap_key ^ GETOFFSET(bp)))
+#define SET_CANARY(bp)   PUTW(FTRP(bp), CANARY(bp))
+#define SET_CACHED(bp)   HDR_OR(bp, CACHED)
+#define CLEAR_CACHED(bp) HDR_AND(bp, ~CACHED)
+#else
+#define SET_CANARY(bp)
+#define SET_CACHED(bp)
+#define CLEAR_CACHED(bp)
+#endif
+
+/* Handle h's entry: the offset of its block, or the next free entry
+ * shifted left and 1. The handle of a movable block is its last payload
+ * word, before the canary.
+ */
+#define HANDLE_MIN   64         // Entries in the first handle table
+#define HANDLE(h)    (handles + (size_t)(h) * WSIZE)
+#define HANDLEP(bp)  (FTRP(bp) - (OVERHEAD - WSIZE))
+#define HANDLE_LIVE(h) ((h) != 0 && (h) < handle_cap && \
+                        !(GETW(HANDLE(h)) & 1))
 
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(p) (((size_t)(p) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
@@ -172,49 +425,463 @@ static char *seglist_end = 0;   // Boundary of the seglist header array
 //Points to the "payload" if the epilogue header
 #define LASTBP ((unsigned char*)mem_heap_hi()+1)
 
+// Number of seglists, the tree included
+#define NLISTS (((LOGMAXSB - LOGMINSB) << LOGSUBCLASS) + 1)
+#if NLISTS > 64
+#error "One bit per seglist in a 64-bit bitmap"
+#endif
+
+/* Slab runs, for payloads of at most SLAB_MAX bytes */
+#ifdef HARDENED
+#define SLABS        0                  // Every block has its canary
+#else
+#define SLABS        1
+#endif
+#define SLAB_MAX     ((40 + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)     // One per 8B of object size
+#define RUN_SHIFT    9
+#define RUN_SIZE     (1 << RUN_SHIFT)
+#define SLAB_WARMUP  64                 // Mallocs of a class before its runs
+#define RUN_HDR      ((DSIZE + 16 + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+                                        // ring offsets, bitmap, object size
+#if (RUN_SIZE - RUN_HDR - WSIZE) / ALIGNMENT > 64
+#error "One bit per slot in a 64-bit bitmap"
+#endif
+
+/* Quick lists of freed blocks, for block sizes of at most QUICK_MAX */
+#define QUICK_MAX    256
+#define QUICK_LISTS  ((QUICK_MAX - MINBLOCK) / ALIGNMENT + 1)
+#define QUICK_COUNT  32                 // Max blocks per quick list
+#if defined(DEFER_COALESCE) && defined(THREAD_SAFE)
+#error "The thread cache already defers coalescing in the thread-safe build"
+#endif
+
+/* An arena: the seglist headers, first thing in its first segment */
+typedef struct {
+    word_t seglists[NLISTS * 2];            // prev/next offset per list
+    unsigned long long nonempty;            // Bit i: seglist i is not empty
+    word_t free_bytes[NLISTS];              // Free bytes in each seglist
+    word_t grow;                // Extend the heap by at least this
+    word_t req_avg;             // Average request that extended the heap
+#ifdef HARDENED
+    unsigned int rand;          // xorshift state for seglist insertion
+#endif
+#ifdef THREAD_SAFE
+    char *end;                  // End of the segment holding the epilogue
+    void *remote;               // Blocks freed by other arenas' threads
+    pthread_mutex_t lock;
+#else
+#ifdef DEFER_COALESCE
+    word_t quick[QUICK_LISTS];              // First block offset, 0 if none
+    unsigned int quick_count[QUICK_LISTS];  // Blocks in each quick list
+#endif
+#endif
+} arena_t;
+
+#ifndef THREAD_SAFE
+/* The slab state of the main arena. It is kept out of the arena header,
+ * so a heap that never starts a run pays nothing for it: the first run
+ * allocates a block with the ring header of each class, then the run
+ * bitmap, and the block moves when the bitmap grows. */
+static word_t slab_block = 0;           // Offset of that block, 0 if none
+static unsigned int slabmap_len = 0;    // Bytes in the run bitmap
+static unsigned int slab_warmup[SLAB_CLASSES];  // Mallocs left before a run
+#endif
+
+/*
+ * Free blocks of the last seglist form a bitwise trie keyed by size,
+ * rooted at the first word of the last seglist header. A tree node keeps
+ * its child and parent offsets after the prev/next offsets, 0 is none.
+ * Like the ring offsets, they are stored xor LINK_KEY.
+ */
+#define TREE_MIN (1 << LOGMAXSB)                // Smallest block in the tree
+#define TREE_ROOT(ap)   SEGLIST(ap, NLISTS - 1)
+
+/* Given block ptr bp of a tree node, compute address of its links */
+#define CHILDP(bp, i)   ((char *)(bp) + DSIZE + (i) * WSIZE)
+#define PARENTP(bp)     ((char *)(bp) + DSIZE + 2 * WSIZE)
+
+/* Read the block pointer at address p, NULL for offset 0 */
+#define GETNODE(p)      (GETW(p) ? GETPT(p) : NULL)
+
+/* Read/write the tree link at address p, NULL for none */
+#define HAS_TREEP(p)    ((GETW(p) ^ LINK_KEY) != 0)
+#define GET_TREEP(p)    (HAS_TREEP(p) ? free_listp + (GETW(p) ^ LINK_KEY) : NULL)
+#define PUT_TREEP(p, bp) PUTW(p, ((bp) ? GETOFFSET(bp) : 0) ^ LINK_KEY)
+
+/* Space taken by the arena, including the padding of the first block */
+#define ARENA_SIZE ALIGN(sizeof(arena_t) + DSIZE)
+
+/* Space before the first block of a later segment of an arena */
+#define SEG_HDR ALIGN(DSIZE)
+
+/* Given an arena, compute its seglist header i */
+#define SEGLIST(ap, i)   ((char *)(ap) + (i) * DSIZE)
+
+/* Mark seglist i of arena ap as empty or not */
+#define SET_NONEMPTY(ap, i)   ((ap)->nonempty |= 1ULL << (i))
+#define CLEAR_NONEMPTY(ap, i) ((ap)->nonempty &= ~(1ULL << (i)))
+
+#define MAIN_ARENA ((arena_t *)free_listp)
+
+/* The first multiple of align at bp, or at least MINBLOCK past it */
+#define ALIGN_UP(bp, align) ((char *)((size_t)(bp) & ((align) - 1) ? \
+    ((size_t)(bp) + MINBLOCK + (align) - 1) & ~((size_t)(align) - 1) : \
+    (size_t)(bp)))
+
+/* Given a slab object or run, compute its run and the run's fields */
+#define RUN_OF(bp)      ((char *)((size_t)(bp) & ~(size_t)(RUN_SIZE - 1)))
+#define RUN_BITMAP(rp)  (*(unsigned long long *)((char *)(rp) + DSIZE))
+#define RUN_OBJSIZE(rp) GETW((char *)(rp) + DSIZE + 8)
+
+/* The bitmap of a run of objects of size bytes with no slot in use */
+#define RUN_EMPTY(size) (~0ULL << ((RUN_SIZE - RUN_HDR - WSIZE) / (size)))
+
+/* Given an arena, compute the ring header of slab class i, its bitmap */
+#define SLAB_HDR        (SLAB_CLASSES * DSIZE)
+#define SLABLIST(ap, i) (free_listp + slab_block + (i) * DSIZE)
+#define SLABMAP(ap)     ((unsigned char *)free_listp + slab_block + SLAB_HDR)
+
+/* Given a block size, compute its quick list */
+#define QUICK_INDEX(asize) (((asize) - MINBLOCK) / ALIGNMENT)
+
+#ifdef THREAD_SAFE
+#define NARENAS      8          // Max arenas
+#define ARENA_SHIFT  16
+#define ARENA_SEG    (1 << ARENA_SHIFT) // Arenas grow by multiples of this
+#define ARENA_MAP    (1 << (HEAP_BITS - ARENA_SHIFT)) // Segments in a heap
+
+/* Given block ptr bp, compute the arena owning it */
+#define ARENA_OF(bp) \
+    (arenas[arena_map[GETOFFSET(bp) >> ARENA_SHIFT] - 1])
+
+#define TCACHE_MAX   256        // Largest block size kept in a thread cache
+#define TCACHE_BINS  ((TCACHE_MAX - MINBLOCK) / ALIGNMENT + 1)
+#define TCACHE_COUNT 32         // Max blocks per bin
+#define TCACHE_BATCH 16         // Blocks moved per refill/flush
+
+/* Given a block size, compute its bin in the thread cache */
+#define TCACHE_INDEX(asize) (((asize) - MINBLOCK) / ALIGNMENT)
+
+/* Cached and remote freed blocks are linked through the payload */
+#define LINK(bp) (*(void **)(bp))
+
+typedef struct {
+    void *bins[TCACHE_BINS];
+    unsigned int count[TCACHE_BINS];
+    arena_t *arena;             // Arena of this thread
+    unsigned int epoch;         // heap_epoch the cached blocks belong to
+    int registered;             // flushed on thread exit
+} tcache_t;
+
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static volatile unsigned int heap_epoch = 1;
+static unsigned int next_arena = 0;
+static arena_t *arenas[NARENAS];
+static unsigned int locked_arenas;    // Arenas held by lock_all
+static unsigned char arena_map[ARENA_MAP];  // Segment -> arena index + 1
+static __thread tcache_t tcache;
+
+#define ARENA(i) (arenas[i])
+#define LOCK_ARENA(ap)   pthread_mutex_lock(&(ap)->lock)
+#define UNLOCK_ARENA(ap) pthread_mutex_unlock(&(ap)->lock)
+#define LOCK_ALL()   lock_all()
+#define UNLOCK_ALL() unlock_all()
+#define LOCK_HANDLES()   pthread_mutex_lock(&handle_lock)
+#define UNLOCK_HANDLES() pthread_mutex_unlock(&handle_lock)
+#define PER_THREAD __thread
+#else
+#define NARENAS 1
+#define ARENA(i) MAIN_ARENA
+#define LOCK_ARENA(ap)
+#define UNLOCK_ARENA(ap)
+#define LOCK_ALL()
+#define UNLOCK_ALL()
+#define LOCK_HANDLES()
+#define UNLOCK_HANDLES()
+#define PER_THREAD
+#endif
+
+#ifdef HEAP_PROFILE
+#define PROFILE_RATE   (1 << 19)        // Default mean bytes between samples
+#define PROFILE_DEPTH  32               // Frames kept per sample
+#define PROFILE_SIGNAL SIGUSR2          // Dumps the profile, with MM_PROFILE
+
+/* The record at the end of a sampled block */
+typedef struct sample {
+    struct sample *prev, *next;         // List of the live samples
+    size_t size;                        // Bytes asked for
+    int depth;                          // Frames in stack
+    void *stack[PROFILE_DEPTH];         // Return addresses, innermost first
+} sample_t;
+
+/* Bytes a sampled block gets on top of its size, the record and padding */
+#define SAMPLE_EXTRA (sizeof(sample_t) + 7)
+
+/* Given block ptr bp of a sampled block, compute its sample record */
+#define SAMPLE_OF(bp) ((sample_t *)((char *)(bp) + \
+    ((GET_SIZE(bp) - OVERHEAD - sizeof(sample_t)) & ~(size_t)7)))
+
+/* Is bp a sampled block? A slab object has no header to tell. */
+#ifdef THREAD_SAFE
+#define IS_SAMPLED(bp) (GETW(HDRP(bp)) & SAMPLED)
+#else
+#define IS_SAMPLED(bp) (!is_slab(MAIN_ARENA, bp) && \
+                        (GETW(HDRP(bp)) & SAMPLED))
+#endif
+
+static long profile_rate = -1;          // Mean bytes between samples,
+                                        // 0: off, -1: not read yet
+static const char *profile_path = NULL; // Dump file prefix, MM_PROFILE
+static unsigned int profile_seq = 0;    // Dumps written
+static sample_t *samples = NULL;        // Live samples, newest first
+static volatile sig_atomic_t dump_pending = 0;
+
+/* The sample list lock. The signal handler only tries it, a dump it
+ * can't take the lock for is written by the holder when it lets go. */
+#ifdef THREAD_SAFE
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define PROFILE_LOCK()    pthread_mutex_lock(&profile_mutex)
+#define PROFILE_TRYLOCK() (pthread_mutex_trylock(&profile_mutex) == 0)
+#define PROFILE_UNLOCK()  pthread_mutex_unlock(&profile_mutex)
+#else
+static volatile sig_atomic_t profile_busy = 0;
+#define PROFILE_LOCK()    (profile_busy = 1)
+#define PROFILE_TRYLOCK() (profile_busy ? 0 : (profile_busy = 1))
+#define PROFILE_UNLOCK()  (profile_busy = 0)
+#endif
+
+static PER_THREAD long sample_left;     // Bytes to this thread's next sample
+static PER_THREAD unsigned long long sample_rand;   // xorshift state
+#endif
+
+#ifdef TRACE_RECORD
+#define TRACE_BUF   512                 // Records a thread buffers
+#define HIST_FINE   64                  // 8B bins up to 512B, then 4 bins
+#define HIST_BINS   (HIST_FINE + 4 * (HEAP_BITS - 9))   // per power of 2
+
+/* One malloc, free or realloc in the raw log */
+typedef struct {
+    unsigned long seq;                  // Order across threads
+    void *ptr;                          // The block, a realloc's new one
+    void *old;                          // The block a realloc was given
+    size_t size;                        // Bytes asked for
+    char op;                            // 'a', 'f' or 'r'
+} trace_rec_t;
+
+/* What a thread records before it takes anything shared */
+typedef struct {
+    trace_rec_t recs[TRACE_BUF];
+    unsigned int n;                     // Records in recs
+    int depth;                          // Calls in a traced call are not
+    unsigned long hist[HIST_BINS];      // Mallocs per size bin
+    unsigned long hist_bytes[HIST_BINS];
+} trace_buf_t;
+
+static int trace_on = -1;               // 1: recording, 0: off,
+                                        // -1: MM_TRACE not read yet
+static int trace_fd = -1;               // Raw log, a whole buffer per write
+static const char *trace_path = NULL;   // Output prefix, MM_TRACE
+static unsigned long trace_seq = 0;     // Next record's seq
+static unsigned long trace_hist[HIST_BINS];         // Flushed histograms
+static unsigned long trace_hist_bytes[HIST_BINS];
+static PER_THREAD trace_buf_t tbuf;
+#define ATOMIC_ADD(p, n) __atomic_fetch_add(p, n, __ATOMIC_RELAXED)
+#ifdef THREAD_SAFE
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+#define TRACE_SETUP() pthread_once(&trace_once, trace_setup)
+#else
+#define TRACE_SETUP() trace_setup()
+#endif
+
+/* Is this a call to record, not one made by a traced call? */
+#define TRACING() (trace_on != 0 && tbuf.depth == 0)
+#endif
+
 /* Function prototypes for internal helper routines */
-static void *extend_heap(size_t size);
-static void place(void *bp, size_t asize);
-static void *find_fit(size_t asize);
-static void *coalesce(void *bp);
+static int init_heap(void);
+static arena_t *init_arena(char *p);
+static void *heap_malloc(arena_t *ap, size_t asize);
+static void heap_free(arena_t *ap, void *bp);
+static void sort_ptrs(void **ptrs, size_t n);
+static mm_handle_t handle_new(arena_t *ap, char *bp);
+#ifndef THREAD_SAFE
+static unsigned int movable(char *bp);
+#endif
+static int checkhandles(int verbose);
+static void release(arena_t *ap, char *bp, char *lo, char *hi);
+static int resize(void *bp, size_t size);
+static void split(arena_t *ap, void *bp, size_t asize);
+static inline size_t adjust_size(size_t size) __attribute__((always_inline));
+static void *extend_heap(arena_t *ap, size_t size) __attribute__((cold));
+static size_t grow_size(arena_t *ap, size_t asize, size_t need);
+static inline void *class_hit(arena_t *ap, size_t asize)
+    __attribute__((always_inline));
+static void place(arena_t *ap, void *bp, size_t asize);
+static void *find_fit(arena_t *ap, size_t asize);
+static void *list_fit(char *fp, size_t asize);
+static void *heap_malloc_aligned(arena_t *ap, size_t asize, size_t align);
+static void *aligned_fit(arena_t *ap, size_t asize, size_t align);
+static void *coalesce(arena_t *ap, void *bp);
 static void printblock(void *bp); 
 static int checkheap(int verbose);
 static int checkblock(void *bp);
-static int checkfreelist(int verbose, int freeCount);
+static int checkfreelist(arena_t *ap, int verbose, int freeCount);
 static inline int in_heap(const void *p);
-static void seg_insert(void *bp, size_t size);
-static inline void delete(void *bp);
-static inline size_t get_seg_index(size_t size);
+static void seg_insert(arena_t *ap, void *bp, size_t size);
+static inline void delete(arena_t *ap, void *bp)
+    __attribute__((always_inline));
+static void tree_insert(arena_t *ap, char *bp, size_t size);
+static void tree_delete(arena_t *ap, char *bp);
+static void *tree_find(arena_t *ap, size_t asize);
+static int checktree(char *bp, int verbose, int *count, size_t *bytes);
+static size_t largest_free(arena_t *ap);
+static inline size_t get_seg_index(size_t size)
+    __attribute__((always_inline));
+static inline void ring_insert(char *fp, char *bp)
+    __attribute__((always_inline));
+static inline void ring_remove(char *bp) __attribute__((always_inline));
+#ifndef THREAD_SAFE
+static void *slab_malloc(arena_t *ap, size_t size);
+static void slab_free(arena_t *ap, void *bp);
+static char *slab_run(arena_t *ap, size_t index);
+static int slabmap_set(arena_t *ap, char *rp, int used);
+static inline int is_slab(arena_t *ap, void *bp);
+static int checkslabs(arena_t *ap, int verbose);
+#endif
+#ifdef HARDENED
+static void check_free(void *bp);
+static void corrupt(const char *what, void *bp) __attribute__((noreturn));
+#endif
+#ifdef HEAP_PROFILE
+static void *profile_malloc(size_t size) __attribute__((noinline));
+static void profile_free(void *bp);
+static void profile_setup(void);
+static long profile_next(void);
+static void profile_unlock(void);
+static void profile_signal(int sig);
+static int profile_write(int fd);
+#endif
+#if defined(HEAP_PROFILE) || defined(TRACE_RECORD)
+static int write_all(int fd, const char *buf, size_t len);
+#endif
+#ifdef TRACE_RECORD
+static void *trace_malloc(size_t size);
+static void *trace_memalign(size_t alignment, size_t size);
+static void *trace_realloc(void *bp, size_t size);
+static void trace_record(char op, void *ptr, void *old, size_t size);
+static void trace_flush(void);
+static void trace_setup(void);
+#ifdef THREAD_SAFE
+static void trace_stop(void);
+#endif
+static void trace_finish(void) __attribute__((destructor));
+static int trace_convert(void);
+static int trace_cmp(const void *a, const void *b);
+static size_t trace_slot(void **keys, size_t cap, void *ptr);
+static inline size_t hist_bin(size_t size);
+#endif
+#ifdef DEFER_COALESCE
+static void quick_free(arena_t *ap, void *bp, size_t size);
+static int quick_flush(arena_t *ap);
+static int checkquick(arena_t *ap, int verbose);
+#endif
+#ifdef THREAD_SAFE
+static arena_t *create_arena(unsigned int id);
+static arena_t *my_arena(void);
+static void *arena_sbrk(arena_t *ap, size_t *sizep);
+static void arena_free(void *bp);
+static void remote_free(arena_t *ap, void *bp);
+static void arena_drain(arena_t *ap);
+static char *next_segment(char *bp);
+static void lock_all(void);
+static void unlock_all(void);
+static void *tcache_malloc(size_t asize);
+static void tcache_free(void *bp, size_t asize);
+static void tcache_reset(void);
+static void tcache_flush(size_t index, unsigned int n);
+static void tcache_release(void *arg);
+static void process_setup(void);
+#endif
 
 
 /*
  * Initialize: return -1 on error, 0 on success.
  */
 int mm_init(void) {
+    int res;
+
+    heap_peak = 0;
+    //The handle table was in the old heap
+    handles = NULL;
+    handle_cap = 0;
+    handle_free = 0;
+#ifdef HEAP_PROFILE
+    //The sample records were in the old heap
+    PROFILE_LOCK();
+    samples = NULL;
+    PROFILE_UNLOCK();
+#endif
+
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&sbrk_lock);
+    memset(arenas, 0, sizeof(arenas));
+    memset(arena_map, 0, sizeof(arena_map));
+    next_arena = 0;
+    res = init_heap();
+    //Blocks cached by any thread belong to the old heap
+    ++heap_epoch;
+    pthread_mutex_unlock(&sbrk_lock);
+#else
+    res = init_heap();
+#endif
+    return res;
+}
+
+/*
+ * init_heap - set up the main arena and the first free block
+ *             In the thread-safe build, the caller holds sbrk_lock.
+ */
+static int init_heap(void) {
     dbg_printf("Enter mm_init()\n");
-    int i;
 
-    if((free_listp = mem_sbrk((LOGMAXSB-LOGMINSB+2)*DSIZE)) == (void *)-1) {
+    //release_min is learnt from the program, a new heap keeps it
+    if( release_min == 0 )
+        release_min = RELEASE_MIN;
+#ifndef DRIVER
+    //Nobody calls mem_init for a preloaded malloc
+    if( mem_heap_lo() == NULL )
+        mem_init();
+#endif
+#ifdef HARDENED
+    //A new key for every heap, there are no links or canaries to keep
+    if( getrandom(&heap_key, sizeof(heap_key), GRND_NONBLOCK) !=
+            sizeof(heap_key) )
+        heap_key = (word_t)time(NULL) ^ (word_t)(size_t)&heap_key;
+#endif
+
+#ifdef THREAD_SAFE
+    free_listp = mem_heap_lo();
+    if( create_arena(0) == NULL ) {
+        dbg_printf("Exit mm_init() with error\n");
     	return -1;
     }
-
-    //init seglist headers
-    for( i = 0; i <= (LOGMAXSB - LOGMINSB); ++i ) {
-        PUTW(free_listp + i*DSIZE, i*DSIZE);
-        PUTW(free_listp + i*DSIZE + WSIZE, i*DSIZE);
+#else
+    if((free_listp = mem_sbrk(ARENA_SIZE)) == (void *)-1) {
+    	return -1;
     }
+    init_arena(free_listp);
+    reserve_brk = 0;
 
-    PUTW(free_listp + i*DSIZE, 0);      //Padding
-    PUTW(free_listp + i*DSIZE + WSIZE, 
-         PACK(0, PREALLOC, ALLOC));	    //Epilogue header
-
-    heap_listp = free_listp + (i+1)*DSIZE;
-    seglist_end = heap_listp - DSIZE;
-
-    if( extend_heap(CHUNKSIZE) == NULL) {
+    if( extend_heap(MAIN_ARENA, CHUNKSIZE) == NULL) {
         dbg_printf("Exit mm_init() with error\n");
     	return -1;
     }
+#endif
+    heap_listp = free_listp + ARENA_SIZE;
 
     dbg_printf("\theap_listp = %p, free_listp = %p\nExit mm_init()\n", 
         heap_listp, free_listp);
@@ -222,52 +889,161 @@ int mm_init(void) {
     return 0;
 }
 
+/*
+ * init_arena - set up the seglist headers, the padding and the epilogue
+ *              header of an arena starting at p
+ */
+static arena_t *init_arena(char *p) {
+    arena_t *ap = (arena_t *)p;
+    int i;
+
+    //init seglist headers, and an empty tree
+    for( i = 0; i < NLISTS - 1; ++i ) {
+        PUT_PREVFBP(SEGLIST(ap, i), SEGLIST(ap, i));
+        PUT_NEXTFBP(SEGLIST(ap, i), SEGLIST(ap, i));
+    }
+    PUT_TREEP(TREE_ROOT(ap), NULL);
+    PUTW(TREE_ROOT(ap) + WSIZE, 0);
+    ap->nonempty = 0;
+    memset(ap->free_bytes, 0, sizeof(ap->free_bytes));
+    ap->grow = CHUNKSIZE;
+    ap->req_avg = 0;
+#ifdef HARDENED
+    ap->rand = (unsigned int)(heap_key ^ GETOFFSET(ap)) | 1;
+#endif
+
+#ifndef THREAD_SAFE
+    slab_block = 0;
+    slabmap_len = 0;
+    for( i = 0; i < SLAB_CLASSES; ++i )
+        slab_warmup[i] = SLAB_WARMUP;
+#endif
+#ifdef DEFER_COALESCE
+    memset(ap->quick, 0, sizeof(ap->quick));
+    memset(ap->quick_count, 0, sizeof(ap->quick_count));
+#endif
+
+    PUTW(p + ARENA_SIZE - DSIZE, 0);        //Padding
+    PUTW(p + ARENA_SIZE - WSIZE, 
+         PACK(0, PREALLOC, ALLOC));	        //Epilogue header
+    return ap;
+}
+
 /*
  * malloc
  */
 void *malloc (size_t size) {
     size_t asize;		// Adjusted block size
-    size_t extendsize;  // Amount to extend heap if no fit
+    arena_t *ap;
     void *bp;
 
     dbg_printf("Enter malloc(size = %lu)\n",size);
 
-    if( heap_listp == NULL ){
-    	mm_init();
-    }
-
-    if( size == 0 ){
+    if( UNLIKELY(size == 0 || size > MAX_PAYLOAD) ){
+#ifndef DRIVER
+        //A unique pointer, as glibc gives: callers take NULL for no memory
+        if( size == 0 )
+            return malloc(1);
+#endif
+        if( size != 0 )
+            errno = ENOMEM;
     	dbg_printf("Exit malloc()\n");
         return NULL;
     }
+#ifdef TRACE_RECORD
+    if( TRACING() )
+        return trace_malloc(size);
+#endif
+#ifdef HEAP_PROFILE
+    if( (sample_left -= (long)size) < 0 )
+        return profile_malloc(size);
+#endif
 
-    if( size <= MINBLOCK - WSIZE ){
-    	asize = MINBLOCK;
+    asize = adjust_size(size);
+#ifdef THREAD_SAFE
+    if( LIKELY(asize <= TCACHE_MAX) )
+        return tcache_malloc(asize);
+    if((ap = my_arena()) == NULL )
+        return NULL;
+#else
+    if( UNLIKELY(heap_listp == NULL) ){
+    	init_heap();
     }
-    else{
-    	asize = ALIGN(size+WSIZE);
+    ap = MAIN_ARENA;
+    //A slab only pays off if the header would take another 8 bytes,
+    //and only for a size that is used often
+    if( SLABS && size <= SLAB_MAX && ALIGN(size) < asize &&
+        (slab_warmup[(size - 1) / ALIGNMENT] == 0 ||
+         --slab_warmup[(size - 1) / ALIGNMENT] == 0) )
+        return slab_malloc(ap, size);
+#endif
+
+    LOCK_ARENA(ap);
+    bp = heap_malloc(ap, asize);
+    UNLOCK_ARENA(ap);
+    return bp;
+}
+
+/*
+ * heap_malloc - allocate a block of asize bytes from the seglists of ap
+ *               The caller holds the arena lock.
+ */
+static void *heap_malloc(arena_t *ap, size_t asize) {
+    size_t extendsize;  // Amount to extend heap if no fit
+    void *bp;
+
+#ifdef THREAD_SAFE
+    if( __atomic_load_n(&ap->remote, __ATOMIC_RELAXED) != NULL )
+        arena_drain(ap);
+#endif
+#ifdef DEFER_COALESCE
+    //A quick list block is still allocated, hand it out as it is
+    if( asize <= QUICK_MAX && ap->quick[QUICK_INDEX(asize)] != 0 ) {
+        bp = GETPT(&ap->quick[QUICK_INDEX(asize)]);
+        ap->quick[QUICK_INDEX(asize)] = GETW(bp);
+        --ap->quick_count[QUICK_INDEX(asize)];
+        CLEAR_CACHED(bp);
+        dbg_printf("Exit malloc()\n");
+        return bp;
     }
+#endif
 
-    if((bp = find_fit(asize)) !=  NULL ){
+    if((bp = class_hit(ap, asize)) != NULL ){
+        dbg_printf("Exit malloc()\n");
+        return bp;
+    }
+    if((bp = find_fit(ap, asize)) !=  NULL ){
         //Find suitable free block
-    	place(bp, asize);
+    	place(ap, bp, asize);
         dbg_printf("Exit malloc()\n");
     	return bp;
     }
 
+#ifdef DEFER_COALESCE
+    //Coalesce the deferred blocks before growing the heap
+    if( quick_flush(ap) && (bp = find_fit(ap, asize)) != NULL ) {
+        place(ap, bp, asize);
+        dbg_printf("Exit malloc()\n");
+        return bp;
+    }
+#endif
+
     //No fit block
     extendsize = asize;
+#ifndef THREAD_SAFE
+    //arena_sbrk does this under sbrk_lock in the thread-safe build
     if( !GET_PREALLOC(LASTBP) ){
         extendsize -= GET_SIZE(PREV_BLKP(LASTBP));
     }
+#endif
 
-    extendsize = MAX(extendsize, CHUNKSIZE);
-    if(( bp = extend_heap(extendsize)) == NULL ){
+    extendsize = grow_size(ap, asize, extendsize);
+    if(( bp = extend_heap(ap, extendsize)) == NULL ){
         dbg_printf("Exit malloc() with error in extend_heap()\n");
     	return NULL;
     }
 
-    place(bp,asize);
+    place(ap, bp, asize);
     
     dbg_printf("Exit malloc()\n");
     return bp;
@@ -278,442 +1054,2989 @@ void *malloc (size_t size) {
  */
 void free(void *bp) {
 
-    dbg_printf("Enter free(bp = %p), size = %u\n",
-                 bp, (bp == NULL)? 0: GET_SIZE(bp));
+    dbg_printf("Enter free(bp = %p), size = %lu\n",
+                 bp, (bp == NULL)? 0: (unsigned long)GET_SIZE(bp));
 
     if( bp == NULL ) {
         dbg_printf("Exit free()\n");
     	return;
     }
 
-    size_t size = GET_SIZE(bp);
+#ifndef DRIVER
+    //Handed out before we were loaded, or by another allocator
+    if( !in_heap(bp) ) {
+        dbg_printf("Exit free(), not in the heap\n");
+        return;
+    }
+#endif
+#ifdef TRACE_RECORD
+    //Before the block can be handed out again
+    if( TRACING() )
+        trace_record('f', bp, NULL, 0);
+#endif
+#ifdef HARDENED
+    check_free(bp);
+#endif
+#ifdef HEAP_PROFILE
+    if( IS_SAMPLED(bp) )
+        profile_free(bp);
+#endif
 
-    //Set the flag bits
-    PUTW(HDRP(bp),PACK(size, GET_PREALLOC(bp), 0)); //Set header
-    PUTW(FTRP(bp),GETW(HDRP(bp)));                  //Set footer
-    RESET_NBLK_PREALLOC(bp);          //Reset the pa/pf bit in the next block
-    coalesce(bp);
-    dbg_printf("Exit free()\n");
+#ifdef THREAD_SAFE
+    //Only the owner of an allocated block writes its size
+    if( GET_SIZE(bp) <= TCACHE_MAX ) {
+        tcache_free(bp, GET_SIZE(bp));
+        return;
+    }
+    arena_free(bp);
+#else
+    if( is_slab(MAIN_ARENA, bp) )
+        slab_free(MAIN_ARENA, bp);
+#ifdef DEFER_COALESCE
+    else if( GET_SIZE(bp) <= QUICK_MAX )
+        quick_free(MAIN_ARENA, bp, GET_SIZE(bp));
+#endif
+    else
+        heap_free(MAIN_ARENA, bp);
+#endif
 }
 
 /*
- * realloc - reference: csapp:mm.c
+ * free_sized - free bp, allocated or reallocated for size bytes
+ *              The size picks the thread cache bin or quick list and
+ *              skips the slab lookup of large blocks, without reading
+ *              the header. Debug builds check it against the header.
  */
-void *realloc(void *bp, size_t size) {
-	size_t oldsize;
-	void *newptr;
-
-    dbg_printf("Enter realloc(bp = %p, size = %lu)\n", bp, size);
-
-	if( size == 0 ) {
-		free(bp);
-        dbg_printf("Exit realloc()\n");
-		return 0;
-	}
-
-	if( bp == NULL ) {
-		newptr = malloc(size);
-        dbg_printf("Exit realloc()\n");
-        return newptr;
-	}
+void free_sized(void *bp, size_t size) {
+    dbg_printf("Enter free_sized(bp = %p, size = %lu)\n", bp, size);
 
-	if((newptr = malloc(size)) == NULL ) {
-        dbg_printf("Exit realloc() with error in malloc()\n");
-		return 0;
-	}
+    if( bp == NULL )
+        return;
 
-	oldsize = GET_SIZE(bp);
-	if( size < oldsize ) {
-		oldsize = size;
-	}
+#ifndef DRIVER
+    if( !in_heap(bp) )
+        return;
+#endif
+#ifdef DEBUG
+    if( size == 0 || size > malloc_usable_size(bp) ) {
+        printf("Error: free_sized(%p, %lu), the block has %lu bytes\n",
+            bp, size, (unsigned long)malloc_usable_size(bp));
+        free(bp);
+        return;
+    }
+#endif
+#ifdef HARDENED
+    check_free(bp);
+    if( adjust_size(size) > GET_SIZE(bp) )
+        corrupt("free_sized with a wrong size", bp);
+#endif
+#ifdef HEAP_PROFILE
+    //A sampled block is larger than size says, free goes by its header
+    if( IS_SAMPLED(bp) ) {
+        free(bp);
+        return;
+    }
+#endif
+#ifdef TRACE_RECORD
+    if( TRACING() )
+        trace_record('f', bp, NULL, 0);
+#endif
 
-    //Copy and free
-	memcpy(newptr, bp, oldsize);
-    free(bp);
-    dbg_printf("Exit realloc()\n");
-    return newptr;
+#ifdef THREAD_SAFE
+    if( adjust_size(size) <= TCACHE_MAX ) {
+        tcache_free(bp, adjust_size(size));
+        return;
+    }
+    arena_free(bp);
+#else
+    if( size <= SLAB_MAX && is_slab(MAIN_ARENA, bp) )
+        slab_free(MAIN_ARENA, bp);
+#ifdef DEFER_COALESCE
+    else if( adjust_size(size) <= QUICK_MAX )
+        quick_free(MAIN_ARENA, bp, adjust_size(size));
+#endif
+    else
+        heap_free(MAIN_ARENA, bp);
+#endif
 }
 
 /*
- * calloc - you may want to look at mm-naive.c
- * This function is not tested by mdriver, but it is
- * needed to run the traces.
+ * mm_malloc_batch - allocate n blocks of size bytes into ptrs
+ *                   The blocks are carved from one free region, found or
+ *                   made with a single seglist search, and come out in
+ *                   address order. They are not sampled by the heap
+ *                   profiler and bypass the thread cache.
+ *
+ *	return the number of blocks allocated, less than n if the heap is
+ *	out of memory
  */
-void *calloc (size_t nmemb, size_t size) {
-	size_t bytes = nmemb * size;
-
-    dbg_printf("Enter calloc(nmemb = %lu, size = %lu)", nmemb, size);
-
-    void *newptr = malloc(bytes);
-    if( newptr == NULL )
-    	return NULL;
-    memset( newptr, 0, bytes );
-    dbg_printf("Exit calloc()\n");
-    return newptr;
-}
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t asize, bsize, done = 0, k, i;
+    arena_t *ap;
+    char *bp;
 
-/*
- * mm_checkheap
- */
-void mm_checkheap(int lineno) {
-    int res = 0;
-    dbg_printf("CHECK START\n");
+    dbg_printf("Enter mm_malloc_batch(size = %lu, n = %lu)\n", size, n);
 
-    //check heap structure consistency
-    if( (res = checkheap(VERBOSE)) < 0 ) {
-        printf("\tError occur at line %d\n", lineno);
-        return;
-    }   
+    if( size == 0 || size > MAX_PAYLOAD )
+        return 0;
+    asize = adjust_size(size);
+#ifdef THREAD_SAFE
+    if((ap = my_arena()) == NULL )
+        return 0;
+#else
+    if( heap_listp == NULL && init_heap() < 0 )
+        return 0;
+    ap = MAIN_ARENA;
+#endif
 
-    //check free list structure consistency
-    if( checkfreelist(VERBOSE,res) < 0 ) {
-        printf("\tError occur at line %d in free list test\n", lineno);
+    while( done < n ) {
+        k = MIN(n - done, MAX_PAYLOAD / asize);
+        LOCK_ARENA(ap);
+        bp = heap_malloc(ap, k * asize);
+        UNLOCK_ARENA(ap);
+        if( bp == NULL )
+            break;
+
+        //The last block takes the slack place did not split off
+        bsize = GET_SIZE(bp);
+        for( i = 0; i < k; ++i, bp += asize ) {
+            PUTW(HDRP(bp), PACK(i < k - 1 ? asize : bsize - i * asize,
+                                i == 0 ? GET_PREALLOC(bp) : PREALLOC, ALLOC));
+            SET_CANARY(bp);
+            ptrs[done++] = bp;
+        }
     }
 
-    dbg_printf("CHECK END\n");
-    return;
+#ifdef TRACE_RECORD
+    if( TRACING() ) {
+        TRACE_SETUP();
+        for( i = 0; i < done && trace_on > 0; ++i )
+            trace_record('a', ptrs[i], NULL, size);
+    }
+#endif
+    dbg_printf("Exit mm_malloc_batch(), %lu blocks\n", done);
+    return done;
 }
 
 /*
- * 
- * The remaining routines are internal helper routines 
- */
-
-/* 
- * extend_heap - Extend heap with free block and return its block pointer
+ * mm_free_batch - free the n blocks in ptrs, NULL entries are skipped
+ *                 ptrs is sorted by address, and each run of adjacent
+ *                 blocks goes back to the seglists as one block, under
+ *                 one lock. It bypasses the thread cache, quick lists
+ *                 and slab rings except for the blocks that live there.
  */
-static void *extend_heap(size_t size) {
+void mm_free_batch(void **ptrs, size_t n) {
+    size_t i, j, m = 0, size;
+    arena_t *ap;
     char *bp;
 
-    if ((bp = mem_sbrk(size)) == (void*)-1)  
-		return NULL;                                      
+    dbg_printf("Enter mm_free_batch(n = %lu)\n", n);
 
-    /* Initialize free block header/footer and the epilogue header */
-    PUTW(HDRP(bp), PACK(size, GET_PREALLOC(bp), 0)); /* Free block header */
-    PUTW(FTRP(bp), GETW(HDRP(bp)));                  /* Free block footer */  
-    PUTW(HDRP(NEXT_BLKP(bp)), PACK(0, 0, ALLOC));    /* New epilogue header */
+#ifdef THREAD_SAFE
+    if((ap = my_arena()) == NULL )
+        return;
+#else
+    ap = MAIN_ARENA;
+#endif
+    //Blocks that can't be merged are freed one at a time
+    for( i = 0; i < n; ++i ) {
+        if((bp = ptrs[i]) == NULL )
+            continue;
+#ifndef DRIVER
+        if( !in_heap(bp) )
+            continue;
+#endif
+#ifdef HEAP_PROFILE
+        if( IS_SAMPLED(bp) ) {
+            free(bp);
+            continue;
+        }
+#endif
+#ifdef TRACE_RECORD
+        if( TRACING() )
+            trace_record('f', bp, NULL, 0);
+#endif
+#ifdef HARDENED
+        check_free(bp);
+#endif
+#ifdef THREAD_SAFE
+        if( ARENA_OF(bp) != ap ) {
+            remote_free(ARENA_OF(bp), bp);
+            continue;
+        }
+#else
+        if( is_slab(ap, bp) ) {
+            slab_free(ap, bp);
+            continue;
+        }
+#endif
+        ptrs[m++] = bp;
+    }
+
+    sort_ptrs(ptrs, m);
+    LOCK_ARENA(ap);
+    for( i = 0; i < m; i = j ) {
+        bp = ptrs[i];
+        size = GET_SIZE(bp);
+        for( j = i + 1; j < m && (char *)ptrs[j] == bp + size; ++j )
+            size += GET_SIZE(ptrs[j]);
+#ifdef HARDENED
+        if( j < m && ptrs[j] == ptrs[j - 1] )
+            corrupt("double free", ptrs[j]);
+#endif
+        PUTW(HDRP(bp), PACK(size, GET_PREALLOC(bp), ALLOC));
+        heap_free(ap, bp);
+    }
+    UNLOCK_ARENA(ap);
+    dbg_printf("Exit mm_free_batch()\n");
+}
+
+/*
+ * sort_ptrs - sort the n pointers of ptrs in ascending order, in place
+ *             A batch from mm_malloc_batch is often freed in the order
+ *             it came, or backwards, one pass finds out. Anything else
+ *             is heapsorted: no recursion and no memory from malloc.
+ */
+static void sort_ptrs(void **ptrs, size_t n) {
+    size_t i, root, child;
+    void *t;
+
+    for( i = 1; i < n && ptrs[i - 1] < ptrs[i]; ++i );
+    if( i == n )
+        return;
+    for( i = 1; i < n && ptrs[i - 1] > ptrs[i]; ++i );
+    if( i == n ) {
+        for( i = 0; i < n / 2; ++i ) {
+            t = ptrs[i];
+            ptrs[i] = ptrs[n - 1 - i];
+            ptrs[n - 1 - i] = t;
+        }
+        return;
+    }
+
+    for( i = n / 2; n > 1; ) {
+        if( i > 0 )
+            t = ptrs[--i];              //Build the heap
+        else {
+            t = ptrs[--n];              //Move the largest to the end
+            ptrs[n] = ptrs[0];
+        }
+        for( root = i; (child = 2 * root + 1) < n; root = child ) {
+            if( child + 1 < n && ptrs[child + 1] > ptrs[child] )
+                ++child;
+            if( ptrs[child] <= t )
+                break;
+            ptrs[root] = ptrs[child];
+        }
+        ptrs[root] = t;
+    }
+}
+
+#ifdef HARDENED
+/*
+ * check_free - abort unless bp is an allocated block, not in a cache,
+ *              whose header and canary are intact
+ */
+static void check_free(void *bp) {
+    if( (GETW(HDRP(bp)) & (ALLOC | CACHED)) != ALLOC )
+        corrupt("double free", bp);
+    if( GET_SIZE(bp) < MINBLOCK || !in_heap(FTRP(bp)) ||
+        GETW(FTRP(bp)) != CANARY(bp) )
+        corrupt("overwritten header or canary", bp);
+}
+
+/*
+ * corrupt - report heap corruption found at bp, and abort
+ */
+static void corrupt(const char *what, void *bp) {
+    fprintf(stderr, "mm: %s at %p\n", what, bp);
+    abort();
+}
+#endif
+
+#ifdef HEAP_PROFILE
+/*
+ * profile_malloc - malloc size bytes with a sample record, for the malloc
+ *                  that used up this thread's countdown
+ */
+static void *profile_malloc(size_t size) {
+    void *stack[PROFILE_DEPTH + 1];
+    sample_t *sp;
+    arena_t *ap;
+    void *bp;
+    int depth;
+
+    if( profile_rate < 0 )
+        profile_setup();
+    if( profile_rate == 0 ) {
+        //Not sampling, this thread won't be back
+        sample_left = LONG_MAX;
+        return malloc(size);
+    }
+
+    //Count down from here, anything backtrace mallocs is not sampled
+    sample_left = profile_next();
+    depth = backtrace(stack, PROFILE_DEPTH + 1) - 1;
+
+    //Straight from the seglists, a slab object has no header for the bit
+#ifdef THREAD_SAFE
+    if((ap = my_arena()) == NULL )
+        return NULL;
+#else
+    if( heap_listp == NULL ){
+    	init_heap();
+    }
+    ap = MAIN_ARENA;
+#endif
+    LOCK_ARENA(ap);
+    bp = heap_malloc(ap, adjust_size(size + SAMPLE_EXTRA));
+    UNLOCK_ARENA(ap);
+    if( bp == NULL )
+        return NULL;
+
+    //Frame 0 is ours
+    sp = SAMPLE_OF(bp);
+    sp->size = size;
+    sp->depth = MAX(depth, 0);
+    memcpy(sp->stack, stack + 1, sp->depth * sizeof(void *));
+    HDR_OR(bp, SAMPLED);
+
+    PROFILE_LOCK();
+    sp->prev = NULL;
+    sp->next = samples;
+    if( samples != NULL )
+        samples->prev = sp;
+    samples = sp;
+    profile_unlock();
+    return bp;
+}
+
+/*
+ * profile_free - take the sample of bp off the list before bp is freed
+ */
+static void profile_free(void *bp) {
+    sample_t *sp = SAMPLE_OF(bp);
+
+    PROFILE_LOCK();
+    if( sp->prev != NULL )
+        sp->prev->next = sp->next;
+    else
+        samples = sp->next;
+    if( sp->next != NULL )
+        sp->next->prev = sp->prev;
+    profile_unlock();
+    HDR_AND(bp, ~SAMPLED);
+}
+
+/*
+ * profile_setup - read the rate and the dump prefix from the environment,
+ *                 on the first sample of the process
+ */
+static void profile_setup(void) {
+    const char *env = getenv("MM_PROFILE_RATE");
+    struct sigaction sa;
+    void *stack[1];
+    long rate;
+
+    profile_path = getenv("MM_PROFILE");
+    if( env != NULL )
+        rate = MAX(strtol(env, NULL, 10), 0);
+    else
+        rate = (profile_path != NULL) ? PROFILE_RATE : 0;
+
+    if( rate > 0 ) {
+        //backtrace loads libgcc on its first call, which mallocs
+        sample_left = LONG_MAX;
+        backtrace(stack, 1);
+    }
+    if( profile_path != NULL ) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = profile_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(PROFILE_SIGNAL, &sa, NULL);
+    }
+    profile_rate = rate;
+}
+
+/*
+ * profile_next - bytes to the next sample, exponentially distributed with
+ *                a mean of profile_rate, so a program can't line up its
+ *                allocations with the samples
+ */
+static long profile_next(void) {
+    double u;
+
+    if( sample_rand == 0 )
+        sample_rand = ((size_t)&sample_left * 0x9e3779b97f4a7c15ULL) | 1;
+    sample_rand ^= sample_rand << 13;
+    sample_rand ^= sample_rand >> 7;
+    sample_rand ^= sample_rand << 17;
+    u = ((sample_rand >> 11) + 1) / 9007199254740992.0;    // (0, 1]
+    return (long)(-log(u) * profile_rate);
+}
+
+/*
+ * profile_unlock - let go of the sample list, and write the dump a signal
+ *                  asked for while it was held
+ */
+static void profile_unlock(void) {
+    PROFILE_UNLOCK();
+    if( dump_pending )
+        profile_signal(PROFILE_SIGNAL);
+}
+
+/*
+ * profile_signal - write the profile to <MM_PROFILE>.<pid>.<n>.heap
+ */
+static void profile_signal(int sig) {
+    char path[PATH_MAX];
+    int fd, saved = errno;
+
+    (void)sig;
+    if( !PROFILE_TRYLOCK() ) {
+        dump_pending = 1;
+        return;
+    }
+    dump_pending = 0;
+    snprintf(path, sizeof(path), "%s.%d.%04u.heap",
+        profile_path, (int)getpid(), ++profile_seq);
+    if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0 ) {
+        profile_write(fd);
+        close(fd);
+    }
+    PROFILE_UNLOCK();
+    errno = saved;
+}
+
+/*
+ * profile_write - write the live samples to fd in the legacy heap profile
+ *                 format of pprof, heap_v2 with the sampling rate, and
+ *                 the memory map pprof needs to find the symbols
+ *                 The caller holds the sample list lock.
+ *
+ *	return -1 on error
+ *	return 0 on success
+ */
+static int profile_write(int fd) {
+    char buf[4096];
+    size_t len, bytes = 0;
+    unsigned long count = 0;
+    sample_t *sp;
+    ssize_t n;
+    int i, mfd;
+
+    for( sp = samples; sp != NULL; sp = sp->next ) {
+        ++count;
+        bytes += sp->size;
+    }
+    len = snprintf(buf, sizeof(buf),
+        "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%ld\n",
+        count, (unsigned long)bytes, count, (unsigned long)bytes,
+        profile_rate);
+
+    //One line per sample, pprof adds up the ones with the same stack
+    for( sp = samples; sp != NULL; sp = sp->next ) {
+        for( i = -1; i < sp->depth; ++i ) {
+            if( len > sizeof(buf) - 64 ) {
+                if( write_all(fd, buf, len) < 0 )
+                    return -1;
+                len = 0;
+            }
+            if( i < 0 )
+                len += snprintf(buf + len, sizeof(buf) - len,
+                    "1: %lu [1: %lu] @", (unsigned long)sp->size,
+                    (unsigned long)sp->size);
+            else
+                len += snprintf(buf + len, sizeof(buf) - len, " %p",
+                    sp->stack[i]);
+        }
+        buf[len++] = '\n';
+    }
+    if( write_all(fd, buf, len) < 0 ||
+        write_all(fd, "\nMAPPED_LIBRARIES:\n", 19) < 0 )
+        return -1;
+
+    if((mfd = open("/proc/self/maps", O_RDONLY)) < 0 )
+        return -1;
+    while( (n = read(mfd, buf, sizeof(buf))) > 0 ) {
+        if( write_all(fd, buf, n) < 0 )
+            break;
+    }
+    close(mfd);
+    return n == 0 ? 0 : -1;
+}
+#endif
+
+#if defined(HEAP_PROFILE) || defined(TRACE_RECORD)
+/*
+ * write_all - write len bytes of buf to fd, return -1 on error
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while( len > 0 ) {
+        if((n = write(fd, buf, len)) < 0 ) {
+            if( errno == EINTR )
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+#endif
+
+#ifdef TRACE_RECORD
+/*
+ * trace_malloc, trace_memalign, trace_realloc - make the call untraced,
+ *                and record what it did. An aligned block is recorded as
+ *                a plain malloc, the trace format has no alignment.
+ */
+static void *trace_malloc(size_t size) {
+    void *bp;
+
+    TRACE_SETUP();
+    ++tbuf.depth;
+    bp = malloc(size);
+    --tbuf.depth;
+    if( bp != NULL && trace_on > 0 )
+        trace_record('a', bp, NULL, size);
+    return bp;
+}
+
+static void *trace_memalign(size_t alignment, size_t size) {
+    void *bp;
+
+    TRACE_SETUP();
+    ++tbuf.depth;
+    bp = memalign(alignment, size);
+    --tbuf.depth;
+    if( bp != NULL && trace_on > 0 )
+        trace_record('a', bp, NULL, size);
+    return bp;
+}
+
+static void *trace_realloc(void *bp, size_t size) {
+    void *newptr;
+
+    TRACE_SETUP();
+    if( size == 0 && bp != NULL && trace_on > 0 )
+        trace_record('f', bp, NULL, 0);
+    ++tbuf.depth;
+    newptr = realloc(bp, size);
+    --tbuf.depth;
+    if( newptr != NULL && trace_on > 0 )
+        trace_record(bp == NULL ? 'a' : 'r', newptr, bp, size);
+    return newptr;
+}
+
+/*
+ * trace_record - add an operation to this thread's buffer, and its size
+ *                to this thread's histogram
+ *                A free is recorded before the block is freed, a malloc
+ *                after the block is taken, so a block's seqs are in order
+ *                across threads. A realloc that moves a block is one
+ *                record: another thread could get the old block and
+ *                record it first.
+ */
+static void trace_record(char op, void *ptr, void *old, size_t size) {
+    trace_rec_t *rp;
+    size_t bin;
+
+    if( tbuf.n == TRACE_BUF )
+        trace_flush();
+    rp = &tbuf.recs[tbuf.n++];
+    rp->seq = ATOMIC_ADD(&trace_seq, 1);
+    rp->ptr = ptr;
+    rp->old = old;
+    rp->size = size;
+    rp->op = op;
+    if( op != 'f' ) {
+        bin = hist_bin(size);
+        ++tbuf.hist[bin];
+        tbuf.hist_bytes[bin] += size;
+    }
+}
+
+/*
+ * trace_flush - append this thread's records to the raw log, one write,
+ *               and add its histogram to the shared one
+ */
+static void trace_flush(void) {
+    size_t i;
+
+    if( tbuf.n > 0 )
+        write_all(trace_fd, (char *)tbuf.recs, tbuf.n * sizeof(trace_rec_t));
+    tbuf.n = 0;
+    for( i = 0; i < HIST_BINS; ++i ) {
+        if( tbuf.hist[i] == 0 )
+            continue;
+        ATOMIC_ADD(&trace_hist[i], tbuf.hist[i]);
+        ATOMIC_ADD(&trace_hist_bytes[i], tbuf.hist_bytes[i]);
+        tbuf.hist[i] = 0;
+        tbuf.hist_bytes[i] = 0;
+    }
+}
+
+/*
+ * trace_setup - with MM_TRACE=<prefix>, start recording to
+ *               <prefix>.<pid>.raw, once per process
+ */
+static void trace_setup(void) {
+    char path[PATH_MAX];
+    int on = 0;
+
+    if( trace_on >= 0 )
+        return;
+    if((trace_path = getenv("MM_TRACE")) != NULL ) {
+        snprintf(path, sizeof(path), "%s.%d.raw",
+            trace_path, (int)getpid());
+        trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+            O_CLOEXEC, 0644);
+        on = (trace_fd >= 0);
+#ifdef THREAD_SAFE
+        //The log is the parent's, its records are the parent's to write
+        if( on )
+            pthread_atfork(NULL, NULL, trace_stop);
+#endif
+    }
+    trace_on = on;
+}
+
+#ifdef THREAD_SAFE
+/*
+ * trace_stop - stop recording in a forked child, what is buffered is
+ *              left out
+ */
+static void trace_stop(void) {
+    trace_on = 0;
+    tbuf.n = 0;
+}
+#endif
+
+/*
+ * trace_finish - at exit, turn the raw log into <prefix>.<pid>.rep for
+ *                mdriver and write the size histogram to .hist
+ *                Only the buffers of exited threads and of this one are
+ *                in the log, threads still running lose their last few
+ *                records.
+ */
+static void trace_finish(void) {
+    char path[PATH_MAX];
+    FILE *fp;
+    size_t i, lo, hi;
+
+    if( trace_on <= 0 || tbuf.depth != 0 )
+        return;
+    trace_flush();
+    trace_on = 0;
+
+    if( trace_convert() < 0 )
+        fprintf(stderr, "mm: could not write the trace of %s\n", trace_path);
+
+    snprintf(path, sizeof(path), "%s.%d.hist", trace_path, (int)getpid());
+    if((fp = fopen(path, "w")) == NULL )
+        return;
+    fprintf(fp, "# min max count bytes, of the sizes asked for\n");
+    for( i = 0; i < HIST_BINS; ++i ) {
+        if( trace_hist[i] == 0 )
+            continue;
+        if( i < HIST_FINE ) {
+            lo = i * 8 + 1;
+            hi = i * 8 + 8;
+        } else {
+            lo = ((4 + (i - HIST_FINE) % 4) << ((i - HIST_FINE) / 4 + 7)) + 1;
+            hi = (5 + (i - HIST_FINE) % 4) << ((i - HIST_FINE) / 4 + 7);
+        }
+        fprintf(fp, "%lu %lu %lu %lu\n", (unsigned long)lo,
+            (unsigned long)hi, trace_hist[i], trace_hist_bytes[i]);
+    }
+    fclose(fp);
+}
+
+/*
+ * trace_convert - sort the raw log by seq, give every block an id and
+ *                 write the trace in the format read_trace reads
+ *                 A block freed or reallocated with no malloc in the log
+ *                 was taken before recording began: its free is left
+ *                 out, its realloc becomes a malloc.
+ *
+ *	return -1 on error
+ *	return 0 on success
+ */
+static int trace_convert(void) {
+    char path[PATH_MAX];
+    trace_rec_t *recs;
+    struct stat st;
+    void **keys;
+    int *ids;
+    size_t n, i, k, cap, ops = 0;
+    int fd, next_id = 0;
+    ssize_t got;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s.%d.raw", trace_path, (int)getpid());
+    if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0 )
+        return -1;
+    n = st.st_size / sizeof(trace_rec_t);
+    if((recs = malloc(n * sizeof(trace_rec_t) + 1)) == NULL ) { //Not 0
+        close(fd);
+        return -1;
+    }
+    for( i = 0, k = n * sizeof(trace_rec_t); i < k; i += got ) {
+        if((got = read(fd, (char *)recs + i, k - i)) <= 0 )
+            break;
+    }
+    close(fd);
+    n = i / sizeof(trace_rec_t);
+    qsort(recs, n, sizeof(trace_rec_t), trace_cmp);
+
+    //Live blocks by address, open addressing with more than n slots
+    for( cap = 16; cap <= 2 * n; cap <<= 1 )
+        ;
+    keys = calloc(cap, sizeof(void *));
+    ids = malloc(cap * sizeof(int));
+    if( keys == NULL || ids == NULL ) {
+        free(recs);
+        free(keys);
+        free(ids);
+        return -1;
+    }
+
+    //Number the blocks, an id is kept in seq from here on
+    for( i = 0; i < n; ++i ) {
+        if( recs[i].op != 'a' ) {
+            k = trace_slot(keys, cap, recs[i].op == 'f' ?
+                recs[i].ptr : recs[i].old);
+            if( keys[k] == NULL ) {
+                if( recs[i].op == 'f' ) {
+                    recs[i].op = 0;
+                    continue;
+                }
+                recs[i].op = 'a';
+            } else {
+                recs[i].seq = ids[k];
+                keys[k] = (void *)-1;       //Deleted, the probe goes on
+                if( recs[i].op == 'f' ) {
+                    ++ops;
+                    continue;
+                }
+            }
+        }
+        if( recs[i].op == 'a' )
+            recs[i].seq = next_id++;
+        k = trace_slot(keys, cap, recs[i].ptr);
+        keys[k] = recs[i].ptr;
+        ids[k] = recs[i].seq;
+        ++ops;
+    }
+    free(keys);
+    free(ids);
+
+    snprintf(path, sizeof(path), "%s.%d.rep", trace_path, (int)getpid());
+    if((fp = fopen(path, "w")) == NULL ) {
+        free(recs);
+        return -1;
+    }
+    fprintf(fp, "1\n%d\n%lu\n0\n", next_id, (unsigned long)ops);
+    for( i = 0; i < n; ++i ) {
+        if( recs[i].op == 'f' )
+            fprintf(fp, "f %lu\n", recs[i].seq);
+        else if( recs[i].op != 0 )
+            fprintf(fp, "%c %lu %lu\n", recs[i].op, recs[i].seq,
+                (unsigned long)recs[i].size);
+    }
+    fclose(fp);
+    free(recs);
+    snprintf(path, sizeof(path), "%s.%d.raw", trace_path, (int)getpid());
+    unlink(path);
+    return 0;
+}
+
+static int trace_cmp(const void *a, const void *b) {
+    unsigned long x = ((const trace_rec_t *)a)->seq;
+    unsigned long y = ((const trace_rec_t *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * trace_slot - the slot of ptr in keys, cap slots, or the empty slot its
+ *              probe ends at
+ */
+static size_t trace_slot(void **keys, size_t cap, void *ptr) {
+    size_t i = ((size_t)ptr * 0x9e3779b97f4a7c15ULL >> 20) & (cap - 1);
+
+    while( keys[i] != NULL && keys[i] != ptr )
+        i = (i + 1) & (cap - 1);
+    return i;
+}
+
+/*
+ * hist_bin - the histogram bin of size bytes: 8 bytes wide up to 512,
+ *            then 4 per power of 2
+ */
+static inline size_t hist_bin(size_t size) {
+    size_t log;
+
+    if( size <= 8 * HIST_FINE )
+        return (size - 1) >> 3;
+    log = 8 * sizeof(size_t) - 1 - __builtin_clzl(size - 1);
+    return HIST_FINE + ((log - 9) << 2) + (((size - 1) >> (log - 2)) & 3);
+}
+#endif
+
+/*
+ * heap_free - return a block to the seglists of ap
+ *             The caller holds the arena lock.
+ */
+static void heap_free(arena_t *ap, void *bp) {
+    size_t size = GET_SIZE(bp);
+    char *lo = bp, *hi = (char *)bp + size;
+
+    //Set the flag bits
+    PUTW(HDRP(bp),PACK(size, GET_PREALLOC(bp), 0)); //Set header
+    PUTW(FTRP(bp),GETW(HDRP(bp)));                  //Set footer
+    RESET_NBLK_PREALLOC(bp);          //Reset the pa/pf bit in the next block
+
+    //A free neighbour this large has given its pages back already
+    if( !GET_PREALLOC(bp) && GET_SIZE(PREV_BLKP(bp)) < release_min )
+        lo = PREV_BLKP(bp);
+    if( !GET_ALLOC(NEXT_BLKP(bp)) && GET_SIZE(NEXT_BLKP(bp)) < release_min )
+        hi = NEXT_BLKP(bp) + GET_SIZE(NEXT_BLKP(bp));
+    bp = coalesce(ap, bp);
+    if( GET_SIZE(bp) >= release_min )
+        release(ap, bp, lo, hi);
+    dbg_printf("Exit free()\n");
+}
+
+/*
+ * release - give the pages of the large free block bp back to the OS
+ *           Trim the heap if bp ends it, down to CHUNKSIZE or the end
+ *           of the last mm_reserve. Otherwise the pages of [lo, hi),
+ *           the part of bp that was not released yet, go, as far as
+ *           they are between its tree links and its footer.
+ *           The caller holds the arena lock.
+ */
+static void release(arena_t *ap, char *bp, char *lo, char *hi) {
+    size_t pagesize = mem_pagesize();
+
+#ifndef THREAD_SAFE
+    size_t size = GET_SIZE(bp), keep;
+
+    //Arena segments are not trimmed in the thread-safe build
+    if( NEXT_BLKP(bp) == (char *)LASTBP ) {
+        //Down to CHUNKSIZE, or to the end of the reservation
+        keep = reserve_brk > bp + CHUNKSIZE ? reserve_brk - bp : CHUNKSIZE;
+        if( keep >= size )
+            return;
+        delete(ap, bp);
+        trim_brk = (char *)LASTBP;
+        heap_peak = MAX(heap_peak, mem_heapsize());
+        mem_sbrk(-(intptr_t)(size - keep));
+        PUTW(HDRP(bp), PACK(keep, GET_PREALLOC(bp), 0));
+        PUTW(FTRP(bp), GETW(HDRP(bp)));
+        PUTW(HDRP(NEXT_BLKP(bp)), PACK(0, 0, ALLOC));
+        seg_insert(ap, bp, keep);
+        ap->grow = CHUNKSIZE;
+        return;
+    }
+#else
+    (void)ap;
+#endif
+    //Whole pages, a page lo or hi cuts was kept by the last release
+    lo = MAX((char *)((size_t)lo & ~(pagesize - 1)), PARENTP(bp) + WSIZE);
+    hi = MIN((char *)(((size_t)hi + pagesize - 1) & ~(pagesize - 1)),
+             FTRP(bp));
+    if( lo < hi )
+        mem_release(lo, hi - lo);
+}
+
+/*
+ * realloc - reference: csapp:mm.c
+ */
+void *realloc(void *bp, size_t size) {
+	size_t oldsize;
+	void *newptr;
+
+    dbg_printf("Enter realloc(bp = %p, size = %lu)\n", bp, size);
+
+#ifdef TRACE_RECORD
+    if( TRACING() )
+        return trace_realloc(bp, size);
+#endif
+
+	if( size == 0 ) {
+		free(bp);
+        dbg_printf("Exit realloc()\n");
+		return 0;
+	}
+
+	if( bp == NULL ) {
+		newptr = malloc(size);
+        dbg_printf("Exit realloc()\n");
+        return newptr;
+	}
+
+    //Too large for a header, or not ours, bp is left as it is
+#ifdef DRIVER
+    if( size > MAX_PAYLOAD ) {
+#else
+    if( size > MAX_PAYLOAD || !in_heap(bp) ) {
+#endif
+        if( size > MAX_PAYLOAD )
+            errno = ENOMEM;
+        dbg_printf("Exit realloc() with error\n");
+        return 0;
+    }
+#ifdef HARDENED
+    check_free(bp);
+#endif
+#ifdef HEAP_PROFILE
+    //Resized or copied as a plain block
+    if( IS_SAMPLED(bp) )
+        profile_free(bp);
+#endif
+
+    //Shrink, or grow into the next block or the heap end, in place
+    if( resize(bp, size) ) {
+        dbg_printf("Exit realloc() in place\n");
+        return bp;
+    }
+
+	if((newptr = malloc(size)) == NULL ) {
+        dbg_printf("Exit realloc() with error in malloc()\n");
+		return 0;
+	}
+
+	oldsize = GET_SIZE(bp);
+#ifndef THREAD_SAFE
+    if( is_slab(MAIN_ARENA, bp) )
+        oldsize = RUN_OBJSIZE(RUN_OF(bp));
+#endif
+	if( size < oldsize ) {
+		oldsize = size;
+	}
+
+    //Copy and free
+	memcpy(newptr, bp, oldsize);
+    free(bp);
+    dbg_printf("Exit realloc()\n");
+    return newptr;
+}
+
+/*
+ * resize - resize the allocated block bp to hold size bytes in place
+ *          Absorb the next block if it is free, and grow the heap first
+ *          if that block ends it. A tail of at least MINBLOCK is freed.
+ *          A slab object keeps its place only within its size class.
+ *
+ *	return 0 if bp can't grow in place
+ */
+static int resize(void *bp, size_t size) {
+    size_t asize = adjust_size(size), avail, extendsize;
+    char *next, *end;
+    arena_t *ap;
+
+#ifdef THREAD_SAFE
+    ap = ARENA_OF(bp);
+#else
+    ap = MAIN_ARENA;
+    if( is_slab(ap, bp) )
+        return size <= RUN_OBJSIZE(RUN_OF(bp)) &&
+            size > RUN_OBJSIZE(RUN_OF(bp)) - ALIGNMENT;
+#endif
+    size = GET_SIZE(bp);
+
+    LOCK_ARENA(ap);
+    if( size < asize ) {
+        next = NEXT_BLKP(bp);
+        avail = size;
+        end = next;
+        if( !GET_ALLOC(next) ) {
+            avail += GET_SIZE(next);
+            end = NEXT_BLKP(next);
+        }
+
+        //Only the last segment of the heap can grow under bp
+        if( avail < asize && end == (char *)LASTBP ) {
+#ifdef THREAD_SAFE
+            //arena_sbrk counts the free block before the epilogue itself
+            extendsize = asize - size;
+#else
+            extendsize = asize - avail;
+#endif
+            if( extend_heap(ap, grow_size(ap, asize, extendsize)) == NULL ) {
+                UNLOCK_ARENA(ap);
+                return 0;
+            }
+            next = NEXT_BLKP(bp);
+            avail = size + (GET_ALLOC(next) ? 0 : GET_SIZE(next));
+        }
+
+        if( avail < asize ) {
+            UNLOCK_ARENA(ap);
+            return 0;
+        }
+        delete(ap, next);
+        PUTW(HDRP(bp), PACK(avail, GET_PREALLOC(bp), ALLOC));
+        SET_NBLK_PREALLOC(bp);
+    }
+
+    split(ap, bp, asize);
+    UNLOCK_ARENA(ap);
+    return 1;
+}
+
+/*
+ * split - free the tail of the allocated block bp past asize bytes,
+ *         if it is at least MINBLOCK
+ *         The caller holds the arena lock.
+ */
+static void split(arena_t *ap, void *bp, size_t asize) {
+    size_t size = GET_SIZE(bp);
+    char *next;
+
+    if( size - asize < MINBLOCK ) {
+        SET_CANARY(bp);
+        return;
+    }
+    PUTW(HDRP(bp), PACK(asize, GET_PREALLOC(bp), ALLOC));
+    SET_CANARY(bp);
+    next = NEXT_BLKP(bp);
+    PUTW(HDRP(next), PACK(size - asize, PREALLOC, ALLOC));
+    heap_free(ap, next);
+}
+
+/*
+ * heap_malloc_aligned - allocate a block of asize bytes from ap whose
+ *                       block pointer is a multiple of align, a power of
+ *                       2. The space around it goes back to the seglists.
+ *                       The caller holds the arena lock.
+ */
+static void *heap_malloc_aligned(arena_t *ap, size_t asize, size_t align) {
+    char *bp, *abp;
+
+#ifdef DEFER_COALESCE
+    if((bp = aligned_fit(ap, asize, align)) == NULL && quick_flush(ap) )
+        bp = aligned_fit(ap, asize, align);
+    if( bp == NULL ) {
+#else
+    if((bp = aligned_fit(ap, asize, align)) == NULL ) {
+#endif
+#ifdef THREAD_SAFE
+        //A new segment may not follow the last block, leave room to align
+        if((bp = extend_heap(ap, asize + align + MINBLOCK)) == NULL )
+            return NULL;
+#else
+        //Extend the heap just enough to end with the aligned block
+        bp = (char *)LASTBP;
+        if( !GET_PREALLOC(LASTBP) )
+            bp = PREV_BLKP(LASTBP);
+        abp = ALIGN_UP(bp, align);
+        if((bp = extend_heap(ap,
+                MAX(abp + asize - (char *)LASTBP, MINBLOCK))) == NULL )
+            return NULL;
+#endif
+    }
+    place(ap, bp, GET_SIZE(bp));
+
+    abp = ALIGN_UP(bp, align);
+
+    if( abp != bp ) {
+        PUTW(HDRP(abp), PACK(GET_SIZE(bp) - (abp - bp), 0, ALLOC));
+        PUTW(HDRP(bp), PACK(abp - bp, GET_PREALLOC(bp), ALLOC));
+        heap_free(ap, bp);
+    }
+    split(ap, abp, asize);
+    return abp;
+}
+
+/*
+ * calloc - you may want to look at mm-naive.c
+ * This function is not tested by mdriver, but it is
+ * needed to run the traces.
+ */
+void *calloc (size_t nmemb, size_t size) {
+	size_t bytes = nmemb * size;
+
+    dbg_printf("Enter calloc(nmemb = %lu, size = %lu)", nmemb, size);
+
+    if( size != 0 && bytes / size != nmemb ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *newptr = malloc(bytes);
+    if( newptr == NULL )
+    	return NULL;
+    memset( newptr, 0, bytes );
+    dbg_printf("Exit calloc()\n");
+    return newptr;
+}
+
+/*
+ * memalign - allocate size bytes at a multiple of alignment, a power of 2
+ *            The padding in front of the block and the tail behind it go
+ *            back to the seglists.
+ */
+void *memalign(size_t alignment, size_t size) {
+    size_t asize;
+    arena_t *ap;
+    void *bp;
+
+    dbg_printf("Enter memalign(alignment = %lu, size = %lu)\n",
+        alignment, size);
+
+#ifdef TRACE_RECORD
+    if( TRACING() )
+        return trace_memalign(alignment, size);
+#endif
+
+    if( alignment <= ALIGNMENT )
+        return malloc(size);
+    if( (alignment & (alignment - 1)) != 0 ) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if( alignment > MAX_PAYLOAD ) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if( size == 0 || size > MAX_PAYLOAD ) {
+#ifndef DRIVER
+        if( size == 0 )
+            return memalign(alignment, 1);
+#endif
+        if( size != 0 )
+            errno = ENOMEM;
+        return NULL;
+    }
+
+    asize = adjust_size(size);
+#ifdef THREAD_SAFE
+    if((ap = my_arena()) == NULL )
+        return NULL;
+#else
+    if( heap_listp == NULL ){
+    	init_heap();
+    }
+    ap = MAIN_ARENA;
+#endif
+
+    LOCK_ARENA(ap);
+    bp = heap_malloc_aligned(ap, asize, alignment);
+    UNLOCK_ARENA(ap);
+    dbg_printf("Exit memalign()\n");
+    return bp;
+}
+
+/*
+ * posix_memalign - memalign, alignment must also be a multiple of
+ *                  sizeof(void *)
+ *
+ *	return EINVAL or ENOMEM on error, *memptr is left as it is
+ *	return 0 on success
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    void *bp;
+
+    if( alignment == 0 || alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0 )
+        return EINVAL;
+    if( size == 0 ) {
+        *memptr = NULL;
+        return 0;
+    }
+    if((bp = memalign(alignment, size)) == NULL )
+        return ENOMEM;
+    *memptr = bp;
+    return 0;
+}
+
+/*
+ * aligned_alloc - C11 memalign
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+/*
+ * malloc_usable_size - bytes of bp that may be written, at least the
+ *                      size it was asked for
+ */
+size_t malloc_usable_size(void *bp) {
+    if( bp == NULL )
+        return 0;
+#ifndef DRIVER
+    if( !in_heap(bp) )
+        return 0;
+#endif
+#ifndef THREAD_SAFE
+    if( is_slab(MAIN_ARENA, bp) )
+        return RUN_OBJSIZE(RUN_OF(bp));
+#endif
+#ifdef HEAP_PROFILE
+    if( GETW(HDRP(bp)) & SAMPLED )
+        return (char *)SAMPLE_OF(bp) - (char *)bp;
+#endif
+    return GET_SIZE(bp) - OVERHEAD;
+}
+
+/*
+ * mm_reserve - extend the heap so that size more bytes can be allocated
+ *              from it without growing it again. In the thread-safe
+ *              build, the space goes to the arena of this thread.
+ *
+ *	return -1 if the heap can't grow that much
+ *	return 0 on success
+ */
+int mm_reserve(size_t size) {
+    arena_t *ap;
+    size_t avail = 0;
+
+    if( size > MAX_PAYLOAD )
+        return -1;
+    //A malloc of size bytes takes a block this large
+    size = adjust_size(size);
+#ifdef THREAD_SAFE
+    if((ap = my_arena()) == NULL )
+        return -1;
+    LOCK_ARENA(ap);
+    //Only the free block at the end of the arena's last segment grows
+    if( !GET_PREALLOC(ap->end) )
+        avail = GET_SIZE(PREV_BLKP(ap->end));
+    //arena_sbrk takes that block into account itself
+    if( avail < size && extend_heap(ap, size) == NULL ) {
+        UNLOCK_ARENA(ap);
+        return -1;
+    }
+#else
+    if( heap_listp == NULL && init_heap() < 0 )
+        return -1;
+    ap = MAIN_ARENA;
+    //Only the free block at the end of the heap can take the space
+    if( !GET_PREALLOC(LASTBP) )
+        avail = GET_SIZE(PREV_BLKP(LASTBP));
+    if( avail < size && extend_heap(ap, size - avail) == NULL )
+        return -1;
+#endif
+#ifndef THREAD_SAFE
+    reserve_brk = (char *)LASTBP;
+#endif
+    UNLOCK_ARENA(ap);
+    return 0;
+}
+
+/*
+ * mm_halloc - allocate a movable block of size bytes
+ *             It comes from the seglists, never from a slab run, a cache
+ *             or the heap profiler, one word larger for its handle.
+ *
+ *	return the handle of the block, 0 if the heap is out of memory
+ */
+mm_handle_t mm_halloc(size_t size) {
+    arena_t *ap;
+    mm_handle_t h;
+    char *bp;
+
+    dbg_printf("Enter mm_halloc(size = %lu)\n", size);
+
+    if( size == 0 || size > MAX_PAYLOAD - WSIZE )
+        return 0;
+#ifdef THREAD_SAFE
+    if((ap = my_arena()) == NULL )
+        return 0;
+#else
+    if( heap_listp == NULL && init_heap() < 0 )
+        return 0;
+    ap = MAIN_ARENA;
+#endif
+
+    LOCK_ARENA(ap);
+    bp = heap_malloc(ap, adjust_size(size + WSIZE));
+    UNLOCK_ARENA(ap);
+    if( bp == NULL )
+        return 0;
+
+    LOCK_HANDLES();
+    h = handle_new(ap, bp);
+    UNLOCK_HANDLES();
+    if( h == 0 ) {
+#ifdef THREAD_SAFE
+        arena_free(bp);
+#else
+        heap_free(ap, bp);
+#endif
+    }
+    dbg_printf("Exit mm_halloc(), handle %u at %p\n", h, bp);
+    return h;
+}
+
+/*
+ * mm_hfree - free the block of handle h, 0 is ignored
+ */
+void mm_hfree(mm_handle_t h) {
+    char *bp;
+
+    dbg_printf("Enter mm_hfree(h = %u)\n", h);
+
+    if( h == 0 )
+        return;
+    LOCK_HANDLES();
+    if( !HANDLE_LIVE(h) ) {
+        UNLOCK_HANDLES();
+#ifdef HARDENED
+        corrupt("free of a bad handle", NULL);
+#else
+        return;
+#endif
+    }
+    bp = GETPT(HANDLE(h));
+    PUTW(HANDLE(h), ((word_t)handle_free << 1) | 1);
+    handle_free = h;
+    UNLOCK_HANDLES();
+
+#ifdef HARDENED
+    check_free(bp);
+#endif
+#ifdef THREAD_SAFE
+    arena_free(bp);
+#else
+    heap_free(MAIN_ARENA, bp);
+#endif
+}
+
+/*
+ * mm_hptr - the payload of the block of handle h
+ *           It is good until the next mm_compact, or mm_hfree of h.
+ *
+ *	return NULL if h is not a live handle
+ */
+void *mm_hptr(mm_handle_t h) {
+    void *bp = NULL;
+
+    LOCK_HANDLES();
+    if( HANDLE_LIVE(h) )
+        bp = GETPT(HANDLE(h));
+    UNLOCK_HANDLES();
+    return bp;
+}
+
+/*
+ * mm_compact - slide the movable blocks down into the free blocks before
+ *              them, and trim the free block this leaves at the end of
+ *              the heap, down to CHUNKSIZE or the end of the reservation.
+ *              A free block stops at the first block that can't move
+ *              and is coalesced with what is past it.
+ *              Nothing moves in the thread-safe build, where arena
+ *              segments are not trimmed.
+ *
+ *	return the bytes the heap shrank by
+ */
+size_t mm_compact(void) {
+#ifndef THREAD_SAFE
+    arena_t *ap = MAIN_ARENA;
+    size_t before, fsize, msize;
+    unsigned int h;
+    char *bp, *mp;
+
+    dbg_printf("Enter mm_compact()\n");
+
+    if( heap_listp == NULL )
+        return 0;
+#ifdef DEFER_COALESCE
+    //Blocks on the quick lists are free, the holes they leave count
+    quick_flush(ap);
+#endif
+    before = mem_heapsize();
+
+    for( bp = heap_listp; GET_SIZE(bp) > 0; bp = NEXT_BLKP(bp) ) {
+        if( GET_ALLOC(bp) )
+            continue;
+        //Swap bp with the movable blocks after it, one at a time
+        while( (h = movable(mp = NEXT_BLKP(bp))) != 0 ) {
+            fsize = GET_SIZE(bp);
+            msize = GET_SIZE(mp);
+            delete(ap, bp);
+            memmove(bp, mp, msize - WSIZE);
+            PUTW(HDRP(bp), PACK(msize, GET_PREALLOC(bp), ALLOC));
+            SET_CANARY(bp);
+            if( mp == handles )
+                handles = bp;
+            else
+                PUTW(HANDLE(h), GETOFFSET(bp));
+
+            //The free block is what is left after it
+            bp += msize;
+            PUTW(HDRP(bp), PACK(fsize, PREALLOC, 0));
+            PUTW(FTRP(bp), GETW(HDRP(bp)));
+            RESET_NBLK_PREALLOC(bp);
+            bp = coalesce(ap, bp);
+        }
+    }
+
+    if( !GET_PREALLOC(LASTBP) )
+        release(ap, PREV_BLKP(LASTBP), PREV_BLKP(LASTBP), (char *)LASTBP);
+    dbg_printf("Exit mm_compact(), %lu bytes\n",
+        (unsigned long)(before - mem_heapsize()));
+    return before - mem_heapsize();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * handle_new - the handle of a new movable block bp of arena ap, the
+ *              table doubles when it is full. The caller holds
+ *              handle_lock.
+ *
+ *	return 0 if the table can't grow
+ */
+static mm_handle_t handle_new(arena_t *ap, char *bp) {
+    unsigned int cap, i;
+    mm_handle_t h;
+    char *tp;
+
+    if( handle_free == 0 ) {
+        cap = handle_cap ? 2 * handle_cap : HANDLE_MIN;
+        if( cap < handle_cap || (size_t)cap * WSIZE > MAX_PAYLOAD )
+            return 0;
+        LOCK_ARENA(ap);
+        tp = heap_malloc(ap, adjust_size((size_t)cap * WSIZE));
+        UNLOCK_ARENA(ap);
+        if( tp == NULL )
+            return 0;
+
+        //Entry 0 is no handle, the new entries go on the free list
+        PUTW(tp, 1);
+        if( handles != NULL ) {
+            memcpy(tp, handles, (size_t)handle_cap * WSIZE);
+#ifdef THREAD_SAFE
+            arena_free(handles);
+#else
+            heap_free(ap, handles);
+#endif
+        }
+        for( i = MAX(handle_cap, 1); i < cap; ++i )
+            PUTW(tp + (size_t)i * WSIZE,
+                 ((word_t)(i + 1 < cap ? i + 1 : 0) << 1) | 1);
+        handle_free = MAX(handle_cap, 1);
+        handle_cap = cap;
+        handles = tp;
+    }
+
+    h = handle_free;
+    handle_free = GETW(HANDLE(h)) >> 1;
+    PUTW(HANDLE(h), GETOFFSET(bp));
+    PUTW(HANDLEP(bp), h);
+    return h;
+}
+
+#ifndef THREAD_SAFE
+/*
+ * movable - the handle of block bp if mm_compact may move it, 0 if not
+ *           The handle table moves too, it returns -1 for it. A block
+ *           whose last payload word happens to look like a handle is
+ *           not the block of that handle's entry.
+ */
+static unsigned int movable(char *bp) {
+    unsigned int h;
+
+    if( GET_SIZE(bp) == 0 || !GET_ALLOC(bp) )
+        return 0;
+    if( bp == handles )
+        return -1;
+    h = GETW(HANDLEP(bp));
+    if( !HANDLE_LIVE(h) || GETPT(HANDLE(h)) != bp )
+        return 0;
+    return h;
+}
+#endif
+
+/*
+ * mm_stats - fill st with the heap statistics, from the counters of each
+ *            arena. Only the largest free block is searched for: the
+ *            right-most path of the tree, or the largest non-empty list.
+ */
+void mm_stats(mm_stats_t *st) {
+    arena_t *ap;
+    size_t i, j, largest;
+
+    memset(st, 0, sizeof(*st));
+    st->nclasses = NLISTS;
+    for( i = 0; i < NLISTS - 1; ++i )
+        st->class_min[i] = (size_t)((1 << LOGSUBCLASS) +
+            (i & ((1 << LOGSUBCLASS) - 1))) <<
+            ((i >> LOGSUBCLASS) + LOGMINSB - LOGSUBCLASS);
+    st->class_min[i] = TREE_MIN;
+
+    if( free_listp == NULL )
+        return;
+    for( j = 0; j < NARENAS; ++j ) {
+        if((ap = ARENA(j)) == NULL )
+            continue;
+        LOCK_ARENA(ap);
+        for( i = 0; i < NLISTS; ++i ) {
+            st->class_free[i] += ap->free_bytes[i];
+            st->free_bytes += ap->free_bytes[i];
+        }
+        largest = largest_free(ap);
+        UNLOCK_ARENA(ap);
+        st->largest_free = MAX(st->largest_free, largest);
+    }
+
+    st->heap = mem_heapsize();
+    st->peak = MAX(heap_peak, st->heap);
+    st->held = st->heap - st->free_bytes;
+    if( st->free_bytes > 0 )
+        st->frag = 1.0 - (double)st->largest_free / st->free_bytes;
+}
+
+/*
+ * mm_profile_dump - write the live heap samples to fd, as a pprof heap
+ *                   profile
+ *
+ *	return -1 on error, or if mm.c was built without -DHEAP_PROFILE
+ *	return 0 on success
+ */
+int mm_profile_dump(int fd) {
+#ifdef HEAP_PROFILE
+    int res;
+
+    PROFILE_LOCK();
+    res = profile_write(fd);
+    profile_unlock();
+    return res;
+#else
+    (void)fd;
+    return -1;
+#endif
+}
+
+/*
+ * mm_checkheap
+ */
+void mm_checkheap(int lineno) {
+    int res = 0, count = 0, n = 0;
+    arena_t *ap;
+    int i;
+    dbg_printf("CHECK START\n");
+
+    LOCK_ALL();
+    //check heap structure consistency
+    if( (res = checkheap(VERBOSE)) < 0 ) {
+        printf("\tError occur at line %d\n", lineno);
+        UNLOCK_ALL();
+        return;
+    }   
+
+    //check free list structure consistency, arena by arena
+    for( i = 0; i < NARENAS && n >= 0; ++i ) {
+        if((ap = ARENA(i)) == NULL )
+            continue;
+        if( (n = checkfreelist(ap, VERBOSE, res - count)) < 0 ) {
+            printf("\tError occur at line %d in free list test\n", lineno);
+        }
+        count += n;
+    }
+    if( n >= 0 && count != res ) {
+        printf("Error: %d free blocks are not in any free list\n", res - count);
+        printf("\tError occur at line %d in free list test\n", lineno);
+    }
+#ifndef THREAD_SAFE
+    if( checkslabs(MAIN_ARENA, VERBOSE) < 0 ) {
+        printf("\tError occur at line %d in slab test\n", lineno);
+    }
+#endif
+#ifdef DEFER_COALESCE
+    if( checkquick(MAIN_ARENA, VERBOSE) < 0 ) {
+        printf("\tError occur at line %d in quick list test\n", lineno);
+    }
+#endif
+    if( checkhandles(VERBOSE) < 0 ) {
+        printf("\tError occur at line %d in handle test\n", lineno);
+    }
+    UNLOCK_ALL();
+
+    dbg_printf("CHECK END\n");
+    return;
+}
+
+/*
+ * 
+ * The remaining routines are internal helper routines 
+ */
+
+/*
+ * adjust_size - the block size serving a payload of size bytes
+ */
+static inline size_t adjust_size(size_t size) {
+    if( size <= MINBLOCK - OVERHEAD )
+    	return MINBLOCK;
+    return ALIGN(size+OVERHEAD);
+}
+
+/* 
+ * extend_heap - Extend heap with free block and return its block pointer
+ */
+static void *extend_heap(arena_t *ap, size_t size) {
+    char *bp;
+
+#ifdef THREAD_SAFE
+    if ((bp = arena_sbrk(ap, &size)) == NULL)
+		return NULL;
+#else
+    if ((bp = mem_sbrk(size)) == (void*)-1)  
+		return NULL;                                      
+
+    //Growing back over the last trim: it was wasted, trim less often
+    if( trim_brk != 0 && (char *)LASTBP >= trim_brk ) {
+        trim_brk = 0;
+        if( release_min < RELEASE_MAX )
+            release_min <<= 1;
+    }
+#endif
+
+    /* Initialize free block header/footer and the epilogue header */
+    PUTW(HDRP(bp), PACK(size, GET_PREALLOC(bp), 0)); /* Free block header */
+    PUTW(FTRP(bp), GETW(HDRP(bp)));                  /* Free block footer */  
+    PUTW(HDRP(NEXT_BLKP(bp)), PACK(0, 0, ALLOC));    /* New epilogue header */
+
+    /* Coalesce if the previous block was free */
+    return coalesce(ap, bp);                                          
+}
+
+/*
+ * grow_size - the bytes to extend the heap of ap by, for a request of
+ *             asize bytes of which need bytes are not free at its end
+ *             The chunk doubles with every extension, bounded by the
+ *             heap size and the average request. The caller holds the
+ *             arena lock.
+ */
+static size_t grow_size(arena_t *ap, size_t asize, size_t need) {
+    size_t size = MAX(need, ap->grow), cap;
+
+    ap->req_avg = asize / 4 + ap->req_avg - ap->req_avg / 4;
+    cap = MIN(GROW_MAX, (size_t)ap->req_avg * GROW_REQS);
+#ifndef THREAD_SAFE
+    //Arenas grow by whole segments, it is only a waste here
+    cap = MIN(cap, (mem_heapsize() + size) >> GROW_SHIFT);
+#endif
+    ap->grow = ALIGN(MAX(CHUNKSIZE, MIN((size_t)ap->grow * 2, cap)));
+    return size;
+}
+
+/*
+ * coalesce - Boundary tag coalescing. Return ptr to coalesced block
+ */
+static void *coalesce(arena_t *ap, void *bp)  {
+    unsigned int prev_alloc = GET_PREALLOC(bp);
+    unsigned int next_alloc = GET_ALLOC(NEXT_BLKP(bp));
+    size_t size = GET_SIZE(bp);
+
+    if (prev_alloc && next_alloc) {            /* Case 1 */
+    	seg_insert(ap, bp, size);
+		return bp;
+    }
+
+    else if (prev_alloc && !next_alloc) {      /* Case 2 */
+		size += GET_SIZE(NEXT_BLKP(bp));
+        delete(ap, NEXT_BLKP(bp));
+		PUTW(HDRP(bp), PACK(size, PREALLOC, 0));
+		PUTW(FTRP(bp), GETW(HDRP(bp)));
+		seg_insert(ap, bp, size);
+    }
+
+    else if (!prev_alloc && next_alloc) {      /* Case 3 */
+    	size += GET_SIZE(PREV_BLKP(bp));
+        delete(ap, PREV_BLKP(bp));
+    	PUTW(FTRP(bp), PACK(size, GET_PREALLOC(PREV_BLKP(bp)), 0));
+    	PUTW(HDRP(PREV_BLKP(bp)), GETW(FTRP(bp)));
+    	bp = PREV_BLKP(bp);
+    	seg_insert(ap, bp, size);
+    }
+
+    else {                                     /* Case 4 */
+    	size += GET_SIZE(PREV_BLKP(bp)) + 
+    	    GET_SIZE(NEXT_BLKP(bp));
+        delete(ap, PREV_BLKP(bp));
+        delete(ap, NEXT_BLKP(bp));
+    	PUTW(HDRP(PREV_BLKP(bp)), PACK(size, GET_PREALLOC(PREV_BLKP(bp)), 0));
+    	PUTW(FTRP(NEXT_BLKP(bp)), GETW(HDRP(PREV_BLKP(bp))));
+    	bp = PREV_BLKP(bp);
+    	seg_insert(ap, bp, size);
+    }
+
+    return bp;
+}
+
+/* $end mmextendheap */
+
+/* 
+ * place - Place block of asize bytes at start of free block bp 
+ *         and split if remainder would be at least minimum block size.
+ *		   Also responsible for setting the a/f and pa/pf bits as well as
+ *         managing the freelist.
+ */
+static void place(arena_t *ap, void *bp, size_t asize) {
+    size_t csize = GET_SIZE(bp);
+    delete(ap, bp);   
+
+    if ((csize - asize) >= MINBLOCK) { 
+	   PUTW(HDRP(bp), PACK(asize, GET_PREALLOC(bp), 1));
+	   SET_CANARY(bp);
+	   bp = NEXT_BLKP(bp);
+	   PUTW(HDRP(bp), PACK(csize-asize, PREALLOC, 0));
+	   PUTW(FTRP(bp), GETW(HDRP(bp)));
+       //Next block's PREALLOC bit is still correct
+
+	   seg_insert(ap, bp, csize - asize);
+    }
+    else { 
+	   PUTW(HDRP(bp), PACK(csize, GET_PREALLOC(bp), 1));
+	   SET_CANARY(bp);
+	   SET_NBLK_PREALLOC(bp);
+    }
+}
+
+/*
+ * class_hit - the fast path of malloc: take the block list_fit would
+ *             look at first in the class of asize, if it fits without
+ *             a split. NULL sends malloc on to find_fit.
+ *             The caller holds the arena lock.
+ */
+static inline void *class_hit(arena_t *ap, size_t asize) {
+    size_t index = get_seg_index(asize), size;
+    char *bp;
+
+    if( !(ap->nonempty & (1ULL << index)) || index == NLISTS - 1 )
+        return NULL;
+    bp = GET_PREVFBP(SEGLIST(ap, index));
+    size = GET_SIZE(bp);
+    if( size < asize || size - asize >= MINBLOCK )
+        return NULL;
+
+    delete(ap, bp);
+    PUTW(HDRP(bp), PACK(size, GET_PREALLOC(bp), ALLOC));
+    SET_CANARY(bp);
+    SET_NBLK_PREALLOC(bp);
+    return bp;
+}
+
+/* 
+ * find_fit - Find a fit for a block with asize bytes
+ *            If not found, return NULL
+ */
+static void *find_fit(arena_t *ap, size_t asize) {
+    size_t index = get_seg_index(asize);
+    unsigned long long lists;
+    void *bp;
+
+    if( index == NLISTS - 1 )
+        return tree_find(ap, asize);
+
+    //The class of asize may hold smaller blocks too
+    if((bp = list_fit(SEGLIST(ap, index), asize)) != NULL )
+        return bp;
+
+    //Any block of a larger class fits, take the first non-empty one
+    if((lists = ap->nonempty & (~0ULL << (index + 1))) == 0 )
+        return NULL;
+    index = __builtin_ctzll(lists);
+    if( index == NLISTS - 1 )
+        return tree_find(ap, asize);
+    return list_fit(SEGLIST(ap, index), asize);
+}
+
+/*
+ * aligned_fit - First fit for a block of asize bytes at a multiple of
+ *               align, with room for a free block in front of it
+ *               If not found, return NULL
+ */
+static void *aligned_fit(arena_t *ap, size_t asize, size_t align) {
+    unsigned long long lists;
+    size_t index;
+    char *fp, *bp;
+
+    for( lists = ap->nonempty & (~0ULL << get_seg_index(asize)); lists != 0;
+         lists &= lists - 1 ) {
+        index = __builtin_ctzll(lists);
+        if( index == NLISTS - 1 )
+            return tree_find(ap, asize + align + MINBLOCK);
+
+        fp = SEGLIST(ap, index);
+        for( bp = GET_NEXTFBP(fp); bp != fp; bp = GET_NEXTFBP(bp) ) {
+            if( ALIGN_UP(bp, align) + asize <= bp + GET_SIZE(bp) )
+                return bp;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * list_fit - Nearly best fit search within the seglist at fp
+ *            If not found, return NULL
+ */
+static void *list_fit(char *fp, size_t asize) {
+    char *bp, *res = NULL;
+    size_t gap = ~(size_t)0, size;
+
+    for( bp = GET_PREVFBP(fp); bp != fp; bp = GET_PREVFBP(bp) ) {
+        size = GET_SIZE(bp);
+        if(size < asize )
+            continue;
+        if(size - asize < MINBLOCK)
+            /* Early return if block size is bigger than asize by at most
+               MINBLOCK */
+            return (void *)bp;
+        if(size - asize < gap){
+            res = bp;
+            gap = size - asize;
+        }
+    }
+    return (void *)res;
+}
+
+static void printblock(void *bp) {
+    size_t size, alloc, palloc;
+
+    size = GET_SIZE(bp);
+    alloc = GET_ALLOC(bp);
+    palloc = GET_PREALLOC(bp);
+
+    printf("Block %p:\n",bp);
+
+    if (size == 0) {
+	   printf("\t EOL\n");
+	   return;
+    }
+
+    printf("\theader: [%lu:%s:%c] ", 
+            size, (palloc ? "pa" : "pf" ), (alloc ? 'a' : 'f'));
+    
+    //Only free block has footers and offsets
+    if( !alloc ) {
+        size = (GETW(FTRP(bp))& ~(ALIGNMENT-1));
+        alloc = (GETW(FTRP(bp)) & ALLOC);
+        palloc = (GETW(FTRP(bp)) & PREALLOC);
+        printf("footer: [%lu:%s:%c]\n", 
+               size, (palloc ? "pa" : "pf" ), (alloc ? 'a' : 'f'));
+        printf("\tprev:%p, next:%p", GET_PREVFBP(bp), GET_NEXTFBP(bp));
+    }
+
+    printf("\n");
+    return;
+}
+
+static int checkblock(void *bp) {
+	int res = 0;
+
+    //Check block pointers range
+    if( !in_heap(bp) ){
+        printf("Error: %p is not in heap\n", bp);
+        return -1;
+    }
+    if( (char*)bp < heap_listp ) {
+        printf("Error: %p is not a block pointer\n", bp);
+        return -1;
+    }
+
+    //Check alignment
+    if ((size_t)bp % ALIGNMENT){
+		res = -1;
+		printf("Error: %p is not %dB aligned\n", bp, ALIGNMENT);
+	}
+    //Check header-footer consistency
+    if (!GET_ALLOC(bp) && GET_SIZE(bp) != (GETW(FTRP(bp))& ~(ALIGNMENT-1)) ) {
+		res = -1;
+		printf("Error: header does not match footer at %p\n", bp);
+	}
+    //Check a/f bit - pa/pf bit consistenct
+	if ( GET_ALLOC(bp) != (GET_PREALLOC(NEXT_BLKP(bp)) >> 1 )) {
+		res = -1;
+		printf("Error: inconsistency alloc bit and  prealloc bit at %p\n", bp);
+	}
+    //Check no adjacent free blocks
+	if ( !GET_ALLOC(bp) && (!GET_ALLOC(NEXT_BLKP(bp)) || !GET_PREALLOC(bp))) {
+		res = -1;
+		printf("Error: consecutive free blocks\n");
+	}
+#ifdef HARDENED
+    //Check the canary
+    if ( GET_ALLOC(bp) && GETW(FTRP(bp)) != CANARY(bp) ) {
+        res = -1;
+        printf("Error: canary overwritten at %p\n", bp);
+    }
+#endif
 
-    /* Coalesce if the previous block was free */
-    return coalesce(bp);                                          
+    return res;
+}
+
+
+
+/* 
+ * checkheap - Minimal check of the heap for consistency 
+ *             return the number of free blocks or -1 if error
+ */
+int checkheap(int verbose) {
+    char *bp = heap_listp;
+    int freeCount = 0;
+    int res = 0;
+
+    dbg_printf("HEAP CHECK START\n");
+
+    //Walk every segment, from its padding to its epilogue
+    for (bp = heap_listp; bp != NULL; ) {
+        if( GETW(bp - DSIZE) != 0 ){
+            printf("Bad padding before first block\n");
+            res = -1;
+        }
+
+        for (; GET_SIZE(bp) > 0; bp = NEXT_BLKP(bp)) {
+            if( checkblock(bp) < 0 ){
+                printblock(bp);
+                res = -1;
+            }
+            else if( verbose ){
+                printblock(bp);
+            }
+
+            if( !GET_ALLOC(bp) ){
+                ++freeCount;
+            }
+        }
+
+        //Check the epilogue header
+        if ((GET_SIZE(bp) != 0) || !(GET_ALLOC(bp)))
+            printf("Bad epilogue header\n");
+        else if( verbose )
+            printblock(bp);
+
+#ifdef THREAD_SAFE
+        bp = next_segment(bp);
+#else
+        bp = NULL;
+#endif
+    }
+
+    dbg_printf("HEAP CHECK END\n");
+    return (res < 0) ? res : freeCount;
 }
 
 /*
- * coalesce - Boundary tag coalescing. Return ptr to coalesced block
+ * checkfreelist - check the seglists of arena ap
+ *                 return the number of free blocks in them or -1 if error
  */
-static void *coalesce(void *bp)  {
-    unsigned int prev_alloc = GET_PREALLOC(bp);
-    unsigned int next_alloc = GET_ALLOC(NEXT_BLKP(bp));
-    unsigned int size = GET_SIZE(bp);
+int checkfreelist(arena_t *ap, int verbose, int freeCount){
+    char *fp, *bp, *prevbp, *nextbp;
+    int res = 0, i = 0;
+    size_t size, bytes;
+    int count = 0;
 
-    if (prev_alloc && next_alloc) {            /* Case 1 */
-    	seg_insert(bp, size);
-		return bp;
+    dbg_printf("FREELIST CHECK START, #fb = %d\n", freeCount);
+
+    if( free_listp != mem_heap_lo() ){
+        printf("Error: Bad free list sentry node (%p)\n", free_listp);
+        dbg_printf("Exit checkfreelist with error\n");
+        return -1;
     }
 
-    else if (prev_alloc && !next_alloc) {      /* Case 2 */
-		size += GET_SIZE(NEXT_BLKP(bp));
-        delete((void*)(NEXT_BLKP(bp)));
-		PUTW(HDRP(bp), PACK(size, PREALLOC, 0));
-		PUTW(FTRP(bp), GETW(HDRP(bp)));
-		seg_insert(bp,size);
+    for( fp = SEGLIST(ap, 0); fp != TREE_ROOT(ap); fp += DSIZE, ++i ) {
+        if(verbose) {
+            printf("Seg(%p): class %d\n", fp, i);
+        }
+
+        //Check the non-empty bitmap
+        if( (GET_NEXTFBP(fp) != fp) != ((ap->nonempty >> i) & 1) ) {
+            printf("Error: Bad non-empty bit of seglist %d\n", i);
+            res = -1;
+        }
+
+        bytes = 0;
+        for(bp = GET_NEXTFBP(fp); bp != fp; bp = GET_NEXTFBP(bp)) {
+            prevbp = GET_PREVFBP(bp);
+            nextbp = GET_NEXTFBP(bp);
+            size = GET_SIZE(bp);
+            bytes += size;
+
+            //Check if block is unallocated
+            if( GET_ALLOC(bp) ){
+                printf("Error: Allocated block in free list (%p)\n", bp);
+                checkblock(bp);
+                res = -1;
+            }
+            
+            //Check if freeblock count matches
+            if(++count > freeCount){
+                printf("Error: Too many free blocks in the free list\n");
+                res = -1;
+            }
+            
+            //Check if the pointer's value is valid
+            if( !in_heap((void*)prevbp) || !in_heap((void*)nextbp)) {
+                printf("Error: Free list pointer out of range\n");
+                res = -1;
+            }
+
+            //Check the consistency of the double linked list
+            if( GET_NEXTFBP(prevbp) != (char *)bp  ){
+                printf("Error: Inconsistency prev/next pointers\n");
+                res = -1;
+            }
+
+            //Check the block size consistency in the seglist
+            if( get_seg_index(size) != (size_t)i ) {
+                printf("Error: Free block size does not fit the seglist\n");
+                res = -1;
+            }
+
+            if( res == -1 || verbose ) {
+                printblock(bp);
+            }
+        }
+
+        if( bytes != ap->free_bytes[i] ) {
+            printf("Error: Bad free byte count of seglist %d\n", i);
+            res = -1;
+        }
     }
 
-    else if (!prev_alloc && next_alloc) {      /* Case 3 */
-    	size += GET_SIZE(PREV_BLKP(bp));
-        delete((void*)(PREV_BLKP(bp)));
-    	PUTW(FTRP(bp), PACK(size, GET_PREALLOC(PREV_BLKP(bp)), 0));
-    	PUTW(HDRP(PREV_BLKP(bp)), GETW(FTRP(bp)));
-    	bp = PREV_BLKP(bp);
-    	seg_insert(bp, size);
+    //The large blocks
+    if( verbose ) {
+        printf("Tree(%p): %d byte\n", fp, TREE_MIN);
+    }
+    if( HAS_TREEP(fp) != ((ap->nonempty >> i) & 1) ) {
+        printf("Error: Bad non-empty bit of the tree\n");
+        res = -1;
+    }
+    bytes = 0;
+    if( (bp = GET_TREEP(fp)) != NULL ) {
+        if( GET_TREEP(PARENTP(bp)) != fp ) {
+            printf("Error: Bad parent of the tree root (%p)\n", bp);
+            res = -1;
+        }
+        if( checktree(bp, verbose, &count, &bytes) < 0 )
+            res = -1;
+    }
+    if( bytes != ap->free_bytes[i] ) {
+        printf("Error: Bad free byte count of the tree\n");
+        res = -1;
+    }
+    if( count > freeCount ){
+        printf("Error: Too many free blocks in the free list\n");
+        res = -1;
     }
 
-    else {                                     /* Case 4 */
-    	size += GET_SIZE(PREV_BLKP(bp)) + 
-    	    GET_SIZE(NEXT_BLKP(bp));
-        delete(PREV_BLKP(bp));
-        delete(NEXT_BLKP(bp));
-    	PUTW(HDRP(PREV_BLKP(bp)), PACK(size, GET_PREALLOC(PREV_BLKP(bp)), 0));
-    	PUTW(FTRP(NEXT_BLKP(bp)), GETW(HDRP(PREV_BLKP(bp))));
-    	bp = PREV_BLKP(bp);
-    	seg_insert(bp, size);
+    dbg_printf("FREELIST CHECK END\n");
+    return (res < 0) ? res : count;
+}
+
+#ifndef THREAD_SAFE
+/*
+ * checkslabs - check the runs with free slots of every slab class
+ *              Return -1 if error
+ */
+static int checkslabs(arena_t *ap, int verbose) {
+    char *fp, *rp;
+    size_t i, size;
+    int res = 0;
+
+    if( slab_block == 0 )
+        return 0;
+    for( i = 0; i < SLAB_CLASSES; ++i ) {
+        fp = SLABLIST(ap, i);
+        size = (i + 1) * ALIGNMENT;
+        for( rp = GET_NEXTFBP(fp); rp != fp; rp = GET_NEXTFBP(rp) ) {
+            if( verbose ) {
+                printf("Run(%p): %lu byte, bitmap %llx\n", rp, size,
+                    RUN_BITMAP(rp));
+            }
+            if( !in_heap(rp) || RUN_OF(rp) != rp || !is_slab(ap, rp) ) {
+                printf("Error: Bad run (%p) of slab class %lu\n", rp, i);
+                return -1;
+            }
+            if( RUN_OBJSIZE(rp) != size ) {
+                printf("Error: Run (%p) in the wrong slab class\n", rp);
+                res = -1;
+            }
+            if( RUN_BITMAP(rp) == ~0ULL ||
+                (RUN_BITMAP(rp) & RUN_EMPTY(size)) != RUN_EMPTY(size) ) {
+                printf("Error: Bad bitmap of run (%p)\n", rp);
+                res = -1;
+            }
+            if( GET_NEXTFBP(GET_PREVFBP(rp)) != rp ) {
+                printf("Error: Inconsistency prev/next pointers\n");
+                res = -1;
+            }
+        }
+    }
+    return res;
+}
+#endif
+
+/*
+ * checktree - check the subtree at node bp and the rings of its nodes,
+ *             add the blocks to *count and their sizes to *bytes.
+ *             Return -1 if error
+ */
+static int checktree(char *bp, int verbose, int *count, size_t *bytes) {
+    char *rp, *cp;
+    int i, res = 0;
+
+    for( rp = bp; ; ) {
+        ++*count;
+        *bytes += GET_SIZE(rp);
+        if( GET_ALLOC(rp) || GET_SIZE(rp) != GET_SIZE(bp) ) {
+            printf("Error: Bad block in the ring of tree node %p\n", bp);
+            res = -1;
+        }
+        if( !in_heap(GET_NEXTFBP(rp)) ||
+            GET_PREVFBP(GET_NEXTFBP(rp)) != rp ) {
+            printf("Error: Inconsistency prev/next pointers\n");
+            res = -1;
+            break;
+        }
+        if( rp != bp && HAS_TREEP(PARENTP(rp)) ) {
+            printf("Error: Tree node %p in the ring of %p\n", rp, bp);
+            res = -1;
+        }
+        if( res == -1 || verbose ) {
+            printblock(rp);
+        }
+        if((rp = GET_NEXTFBP(rp)) == bp )
+            break;
+    }
+
+    if( GET_SIZE(bp) < TREE_MIN ) {
+        printf("Error: Free block size does not fit the tree\n");
+        res = -1;
+    }
+
+    for( i = 0; i < 2; ++i ) {
+        if((cp = GET_TREEP(CHILDP(bp, i))) == NULL )
+            continue;
+        if( !in_heap(cp) || GET_TREEP(PARENTP(cp)) != bp ) {
+            printf("Error: Bad child %d of tree node %p\n", i, bp);
+            res = -1;
+            continue;
+        }
+        if( checktree(cp, verbose, count, bytes) < 0 )
+            res = -1;
+    }
+    return res;
+}
+
+/*
+ * Return whether the pointer is in the heap.
+ * May be useful for debugging.
+ */
+static inline int in_heap(const void *p) {
+    //No heap before the first malloc of a preloaded library
+    return (char *)p >= (char *)mem_heap_lo() &&
+        (char *)p < (char *)mem_heap_lo() + mem_heapsize();
+}
+
+/*
+ * Insert a free block via a seglist flavor, use LIFO approach
+ */
+static void seg_insert(arena_t *ap, void *bp, size_t size) {
+    size_t index = get_seg_index(size);
+    char *fp = SEGLIST(ap, index);
+
+    SET_NONEMPTY(ap, index);
+    ap->free_bytes[index] += size;
+    if( fp == TREE_ROOT(ap) ) {
+        tree_insert(ap, bp, size);
+        return;
+    }
+#ifdef HARDENED
+    //Head or tail at random, the block the next fit takes is not known
+    ap->rand ^= ap->rand << 13;
+    ap->rand ^= ap->rand >> 17;
+    ap->rand ^= ap->rand << 5;
+    if( ap->rand & 0x100 )
+        fp = GET_PREVFBP(fp);
+#endif
+    ring_insert(fp, bp);
+}
+
+/*
+ * Delete a free block from the list
+ */
+static inline void delete(arena_t *ap, void *bp) {
+    char *fp;
+
+    ap->free_bytes[get_seg_index(GET_SIZE(bp))] -= GET_SIZE(bp);
+    if( GET_SIZE(bp) >= TREE_MIN ) {
+        tree_delete(ap, bp);
+        return;
+    }
+    ring_remove(bp);
+
+    //Only the seglist header is left in the ring
+    fp = GET_PREVFBP(bp);
+    if( GET_NEXTFBP(fp) == fp )
+        CLEAR_NONEMPTY(ap, get_seg_index(GET_SIZE(bp)));
+}
+
+/*
+ * ring_insert - insert bp after fp in a ring of prev/next offsets
+ */
+static inline void ring_insert(char *fp, char *bp) {
+	char *t = GET_NEXTFBP(fp);
+
+    PUT_NEXTFBP(fp, bp);
+    PUT_NEXTFBP(bp, t);
+    PUT_PREVFBP(t, bp);
+    PUT_PREVFBP(bp, fp);
+}
+
+/*
+ * ring_remove - unlink bp from its ring, its own offsets are kept
+ */
+static inline void ring_remove(char *bp) {
+#ifdef HARDENED
+    char *prev = GET_PREVFBP(bp), *next = GET_NEXTFBP(bp);
+
+    if( !in_heap(prev) || !in_heap(next) ||
+        GET_NEXTFBP(prev) != bp || GET_PREVFBP(next) != bp )
+        corrupt("corrupted free list", bp);
+#endif
+	PUTW(NEXT_FPP(GET_PREVFBP(bp)), GETW(NEXT_FPP(bp)));
+	PUTW(PREV_FPP(GET_NEXTFBP(bp)), GETW(PREV_FPP(bp)));
+}
+
+/*
+ * tree_insert - insert a free block into the size trie of ap
+ *               At depth d a node branches on bit (WBITS-1 - d) of the size.
+ *               Blocks of a size already in the tree join the ring of
+ *               prev/next offsets of that node, off the tree.
+ */
+static void tree_insert(arena_t *ap, char *bp, size_t size) {
+    char *t, *cp, *f;
+    word_t key = size;
+
+    PUT_TREEP(CHILDP(bp, 0), NULL);
+    PUT_TREEP(CHILDP(bp, 1), NULL);
+    PUT_PREVFBP(bp, bp);
+    PUT_NEXTFBP(bp, bp);
+
+    if( !HAS_TREEP(TREE_ROOT(ap)) ) {
+        PUT_TREEP(TREE_ROOT(ap), bp);
+        PUT_TREEP(PARENTP(bp), TREE_ROOT(ap));
+        return;
+    }
+
+    for( t = GET_TREEP(TREE_ROOT(ap)); GET_SIZE(t) != size;
+         t = GET_TREEP(cp) ) {
+        cp = CHILDP(t, key >> (WBITS - 1));
+        key <<= 1;
+        if( !HAS_TREEP(cp) ) {
+            PUT_TREEP(cp, bp);
+            PUT_TREEP(PARENTP(bp), t);
+            return;
+        }
+    }
+
+    f = GET_NEXTFBP(t);
+    PUT_NEXTFBP(t, bp);
+    PUT_PREVFBP(f, bp);
+    PUT_NEXTFBP(bp, f);
+    PUT_PREVFBP(bp, t);
+    PUT_TREEP(PARENTP(bp), NULL);
+}
+
+/*
+ * tree_delete - remove a free block from the size trie of ap
+ *               A block of the same size, or else a leaf below the node,
+ *               takes the place of a removed tree node.
+ */
+static void tree_delete(arena_t *ap, char *bp) {
+    char *xp = GET_TREEP(PARENTP(bp));
+    char *r = NULL, *rp;
+    int i;
+
+#ifdef HARDENED
+    //A tree node is unlinked only if its parent points back at it, a
+    //block off the tree is in the ring of a node
+    if( xp == NULL ? GET_NEXTFBP(bp) == bp :
+        xp == TREE_ROOT(ap) ? GET_TREEP(xp) != bp :
+        !in_heap(xp) || (GET_TREEP(CHILDP(xp, 0)) != bp &&
+                         GET_TREEP(CHILDP(xp, 1)) != bp) )
+        corrupt("corrupted free tree", bp);
+#endif
+    if( GET_NEXTFBP(bp) != bp ) {
+        r = GET_PREVFBP(bp);
+        ring_remove(bp);
+    }
+    else if( HAS_TREEP(rp = CHILDP(bp, 1)) ||
+             HAS_TREEP(rp = CHILDP(bp, 0)) ) {
+        //Take the last leaf on the right-most path
+        for( r = GET_TREEP(rp); ; r = GET_TREEP(rp) ) {
+            if( HAS_TREEP(CHILDP(r, 1)) )
+                rp = CHILDP(r, 1);
+            else if( HAS_TREEP(CHILDP(r, 0)) )
+                rp = CHILDP(r, 0);
+            else
+                break;
+        }
+        PUT_TREEP(rp, NULL);
+    }
+
+    //In a ring only, the tree is unchanged
+    if( xp == NULL )
+        return;
+
+    if( xp == TREE_ROOT(ap) ) {
+        PUT_TREEP(xp, r);
+        if( r == NULL )
+            CLEAR_NONEMPTY(ap, NLISTS - 1);
+    }
+    else if( GET_TREEP(CHILDP(xp, 0)) == bp )
+        PUT_TREEP(CHILDP(xp, 0), r);
+    else
+        PUT_TREEP(CHILDP(xp, 1), r);
+
+    //The links are copied as they are, they share the key
+    if( r != NULL ) {
+        PUTW(PARENTP(r), GETW(PARENTP(bp)));
+        for( i = 0; i < 2; ++i ) {
+            PUTW(CHILDP(r, i), GETW(CHILDP(bp, i)));
+            if( HAS_TREEP(CHILDP(r, i)) )
+                PUT_TREEP(PARENTP(GET_TREEP(CHILDP(r, i))), r);
+        }
+    }
+}
+
+/*
+ * tree_find - find the smallest block of at least asize bytes in the tree
+ *             Follow the bits of asize, remember the deepest right subtree
+ *             not taken, then walk down the left edge of that subtree.
+ *             If not found, return NULL
+ */
+static void *tree_find(arena_t *ap, size_t asize) {
+    char *t, *rt, *rst = NULL, *res = NULL;
+    word_t key = asize, gap = -(word_t)asize, rem;
+
+    for( t = GET_TREEP(TREE_ROOT(ap)); t != NULL; key <<= 1 ) {
+        //Wraps around for blocks smaller than asize
+        rem = GET_SIZE(t) - asize;
+        if( rem < gap ) {
+            res = t;
+            if((gap = rem) == 0 )
+                return res;
+        }
+        rt = GET_TREEP(CHILDP(t, 1));
+        t = GET_TREEP(CHILDP(t, key >> (WBITS - 1)));
+        if( rt != NULL && rt != t )
+            rst = rt;
+        if( t == NULL ) {
+            t = rst;
+            break;
+        }
+    }
+
+    for( ; t != NULL; t = HAS_TREEP(CHILDP(t, 0)) ? GET_TREEP(CHILDP(t, 0))
+                                               : GET_TREEP(CHILDP(t, 1)) ) {
+        rem = GET_SIZE(t) - asize;
+        if( rem < gap ) {
+            res = t;
+            gap = rem;
+        }
+    }
+    return res;
+}
+
+/*
+ * largest_free - the size of the largest free block of ap, 0 if none
+ *                In the tree, every size under child 1 is larger than
+ *                any size under child 0.
+ */
+static size_t largest_free(arena_t *ap) {
+    size_t index, res = 0;
+    char *t, *fp, *bp;
+
+    if( ap->nonempty == 0 )
+        return 0;
+    index = 63 - __builtin_clzll(ap->nonempty);
+    if( index == NLISTS - 1 ) {
+        for( t = GET_TREEP(TREE_ROOT(ap)); t != NULL;
+             t = HAS_TREEP(CHILDP(t, 1)) ? GET_TREEP(CHILDP(t, 1))
+                                         : GET_TREEP(CHILDP(t, 0)) )
+            res = MAX(res, GET_SIZE(t));
+        return res;
+    }
+
+    fp = SEGLIST(ap, index);
+    for( bp = GET_NEXTFBP(fp); bp != fp; bp = GET_NEXTFBP(bp) )
+        res = MAX(res, GET_SIZE(bp));
+    return res;
+}
+
+/*
+ * Get the seglist index of a block of certain size
+ */
+static inline size_t get_seg_index(size_t size) {
+    //The power of 2, then the next LOGSUBCLASS bits pick the class
+    size_t log = 63 - __builtin_clzl(size);
+    size_t index = ((log - LOGMINSB) << LOGSUBCLASS) +
+        ((size >> (log - LOGSUBCLASS)) & ((1 << LOGSUBCLASS) - 1));
+    return MIN(index, NLISTS - 1);
+}
+
+#ifndef THREAD_SAFE
+/*
+ * slab_malloc - take a slot for size bytes from the first run of its
+ *               class that has one, start a new run if there is none
+ */
+static void *slab_malloc(arena_t *ap, size_t size) {
+    size_t index = (size - 1) / ALIGNMENT, slot;
+    char *rp = NULL;
+
+    //The ring headers come with the first run
+    if( slab_block != 0 )
+        rp = GET_NEXTFBP(SLABLIST(ap, index));
+    if( (rp == NULL || rp == SLABLIST(ap, index)) &&
+        (rp = slab_run(ap, index)) == NULL ){
+        dbg_printf("Exit malloc() with error in slab_run()\n");
+        return NULL;
     }
 
-    return bp;
-}
+    slot = __builtin_ctzll(~RUN_BITMAP(rp));
+    RUN_BITMAP(rp) |= 1ULL << slot;
+    //A full run leaves the ring until one of its objects is freed
+    if( RUN_BITMAP(rp) == ~0ULL )
+        ring_remove(rp);
 
-/* $end mmextendheap */
+    dbg_printf("Exit malloc()\n");
+    return rp + RUN_HDR + slot * RUN_OBJSIZE(rp);
+}
 
-/* 
- * place - Place block of asize bytes at start of free block bp 
- *         and split if remainder would be at least minimum block size.
- *		   Also responsible for setting the a/f and pa/pf bits as well as
- *         managing the freelist.
+/*
+ * slab_free - give the slot of bp back to its run
+ *             A run that becomes empty goes back to the seglists, unless
+ *             it is the only run of its class with free slots.
  */
-static void place(void *bp, size_t asize) {
-    size_t csize = GET_SIZE(bp);
-    delete(bp);   
+static void slab_free(arena_t *ap, void *bp) {
+    char *rp = RUN_OF(bp), *fp;
+    size_t size = RUN_OBJSIZE(rp);
+
+    fp = SLABLIST(ap, (size - 1) / ALIGNMENT);
+    if( RUN_BITMAP(rp) == ~0ULL )
+        ring_insert(fp, rp);
+    RUN_BITMAP(rp) &= ~(1ULL << (((char *)bp - rp - RUN_HDR) / size));
+
+    if( RUN_BITMAP(rp) == RUN_EMPTY(size) &&
+        (GET_NEXTFBP(rp) != fp || GET_PREVFBP(rp) != fp) ) {
+        ring_remove(rp);
+        slabmap_set(ap, rp, 0);
+        heap_free(ap, rp);
+    }
+    dbg_printf("Exit free()\n");
+}
 
-    if ((csize - asize) >= MINBLOCK) { 
-	   PUTW(HDRP(bp), PACK(asize, GET_PREALLOC(bp), 1));
-	   bp = NEXT_BLKP(bp);
-	   PUTW(HDRP(bp), PACK(csize-asize, PREALLOC, 0));
-	   PUTW(FTRP(bp), GETW(HDRP(bp)));
-       //Next block's PREALLOC bit is still correct
+/*
+ * slab_run - start a run for slab class index in a block aligned to
+ *            RUN_SIZE, and put it in the ring of the class
+ *
+ *	return NULL on error
+ */
+static char *slab_run(arena_t *ap, size_t index) {
+    size_t size = (index + 1) * ALIGNMENT;
+    char *rp;
 
-	   seg_insert(bp, csize - asize);
-    }
-    else { 
-	   PUTW(HDRP(bp), PACK(csize, GET_PREALLOC(bp), 1));
-	   SET_NBLK_PREALLOC(bp);
+    //The run ends at the header of the next block, so runs can be adjacent
+    if((rp = heap_malloc_aligned(ap, RUN_SIZE, RUN_SIZE)) == NULL )
+        return NULL;
+    if( slabmap_set(ap, rp, 1) < 0 ) {
+        heap_free(ap, rp);
+        return NULL;
     }
+
+    RUN_BITMAP(rp) = RUN_EMPTY(size);
+    RUN_OBJSIZE(rp) = size;
+    ring_insert(SLABLIST(ap, index), rp);
+    return rp;
 }
 
-/* 
- * find_fit - Find a fit for a block with asize bytes
- *            If not found, return NULL
+/*
+ * slabmap_set - mark the RUN_SIZE of the heap at rp as a run or not
+ *               The ring headers and the bitmap are moved to a larger
+ *               block when the heap has outgrown it, the first run
+ *               allocates them.
+ *
+ *	return -1 on error
  */
-static void *find_fit(size_t asize) {
-    /* Nearly best fit search within the seglist */
-    char *bp, *res = NULL;
-    char *fp = free_listp + (get_seg_index(asize) * DSIZE);
-    unsigned int gap, size;
-
-    for(; fp != seglist_end; fp += DSIZE ) {
-        gap = UIMAX;
-        for( bp = GET_PREVFBP(fp); bp != fp; bp = GET_PREVFBP(bp) ) {
-            size = GET_SIZE(bp);
-            if(size < asize )
+static int slabmap_set(arena_t *ap, char *rp, int used) {
+    size_t i = GETOFFSET(rp) >> RUN_SHIFT, j, len;
+    char *old = slab_block ? free_listp + slab_block : NULL, *bp, *fp;
+    unsigned char *map;
+
+    if( (i >> 3) >= slabmap_len ) {
+        if( !used )
+            return 0;
+        len = ALIGN(MAX(2 * slabmap_len, (i >> 3) + 1));
+        if((bp = heap_malloc(ap, adjust_size(SLAB_HDR + len))) == NULL )
+            return -1;
+        memset(bp + SLAB_HDR, 0, len);
+        if( old != NULL )
+            memcpy(bp + SLAB_HDR, old + SLAB_HDR, slabmap_len);
+
+        //Each new ring header takes the place of the old one
+        for( j = 0; j < SLAB_CLASSES; ++j ) {
+            fp = bp + j * DSIZE;
+            if( old == NULL ) {
+                PUT_PREVFBP(fp, fp);
+                PUT_NEXTFBP(fp, fp);
                 continue;
-            if(size - asize < MINBLOCK)
-                /* Early return if block size is bigger than asize by at most
-                   MINBLOCK */
-                return (void *)bp;
-            if(size - asize < gap){
-                res = bp;
-                gap = size - asize;
             }
+            ring_insert(old + j * DSIZE, fp);
+            ring_remove(old + j * DSIZE);
         }
-        if( res != NULL )
-            // return the best fit block in current seglist
-            return (void*) res;
+
+        slab_block = GETOFFSET(bp);
+        slabmap_len = len;
+        if( old != NULL )
+            heap_free(ap, old);
     }
 
-    return NULL; //no fit
+    map = SLABMAP(ap);
+    if( used )
+        map[i >> 3] |= 1 << (i & 7);
+    else
+        map[i >> 3] &= ~(1 << (i & 7));
+    return 0;
 }
 
-static void printblock(void *bp) {
-    size_t size, alloc, palloc;
+/*
+ * is_slab - check if bp is an object in a slab run
+ */
+static inline int is_slab(arena_t *ap, void *bp) {
+    size_t i = GETOFFSET(bp) >> RUN_SHIFT;
 
-    size = GET_SIZE(bp);
-    alloc = GET_ALLOC(bp);
-    palloc = GET_PREALLOC(bp);
+    (void)ap;
+    return (i >> 3) < slabmap_len && (SLABMAP(ap)[i >> 3] >> (i & 7)) & 1;
+}
+#endif /* ndef THREAD_SAFE */
 
-    printf("Block %p:\n",bp);
+#ifdef DEFER_COALESCE
+/*
+ * quick_free - put the block bp of size bytes on its quick list, the
+ *              lists are coalesced first if that one is full
+ */
+static void quick_free(arena_t *ap, void *bp, size_t size) {
+    size_t index = QUICK_INDEX(size);
+
+    if( ap->quick_count[index] == QUICK_COUNT )
+        quick_flush(ap);
+    SET_CACHED(bp);
+    PUTW(bp, ap->quick[index]);
+    ap->quick[index] = GETOFFSET(bp);
+    ++ap->quick_count[index];
+    dbg_printf("Exit free()\n");
+}
 
-    if (size == 0) {
-	   printf("\t EOL\n");
-	   return;
-    }
+/*
+ * quick_flush - free and coalesce the blocks of every quick list
+ *
+ *	return the number of blocks flushed
+ */
+static int quick_flush(arena_t *ap) {
+    int i, n = 0;
+    char *bp;
 
-    printf("\theader: [%lu:%s:%c] ", 
-            size, (palloc ? "pa" : "pf" ), (alloc ? 'a' : 'f'));
-    
-    //Only free block has footers and offsets
-    if( !alloc ) {
-        size = (GETW(FTRP(bp))& ~(ALIGNMENT-1));
-        alloc = (GETW(FTRP(bp)) & ALLOC);
-        palloc = (GETW(FTRP(bp)) & PREALLOC);
-        printf("footer: [%lu:%s:%c]\n", 
-               size, (palloc ? "pa" : "pf" ), (alloc ? 'a' : 'f'));
-        printf("\tprev:%p, next:%p", GET_PREVFBP(bp), GET_NEXTFBP(bp));
+    for( i = 0; i < QUICK_LISTS; ++i ) {
+        while( ap->quick[i] != 0 ) {
+            bp = GETPT(&ap->quick[i]);
+            ap->quick[i] = GETW(bp);
+            heap_free(ap, bp);
+            ++n;
+        }
+        ap->quick_count[i] = 0;
     }
+    return n;
+}
 
-    printf("\n");
-    return;
+/*
+ * checkquick - check the blocks of every quick list
+ *              Return -1 if error
+ */
+static int checkquick(arena_t *ap, int verbose) {
+    unsigned int n;
+    char *bp;
+    int i, res = 0;
+
+    for( i = 0; i < QUICK_LISTS; ++i ) {
+        n = 0;
+        for( bp = GETNODE(&ap->quick[i]); bp != NULL; bp = GETNODE(bp) ) {
+            if( verbose )
+                printblock(bp);
+            if( !in_heap(bp) || !GET_ALLOC(bp) ||
+                GET_SIZE(bp) < MINBLOCK + (size_t)i * ALIGNMENT ||
+                GET_SIZE(bp) >= 2 * MINBLOCK + (size_t)i * ALIGNMENT ) {
+                printf("Error: Bad block (%p) in quick list %d\n", bp, i);
+                return -1;
+            }
+            if( ++n > ap->quick_count[i] ) {
+                printf("Error: Quick list %d longer than its count\n", i);
+                return -1;
+            }
+        }
+        if( n != ap->quick_count[i] ) {
+            printf("Error: Bad count of quick list %d\n", i);
+            res = -1;
+        }
+    }
+    return res;
 }
+#endif /* def DEFER_COALESCE */
 
-static int checkblock(void *bp) {
-	int res = 0;
+/*
+ * checkhandles - check that every live handle names an allocated block
+ *                that carries it, and that the rest are on the free list
+ *                Return -1 if error
+ */
+static int checkhandles(int verbose) {
+    unsigned int h, live = 0, n = 0;
+    char *bp;
 
-    //Check block pointers range
-    if( !in_heap(bp) ){
-        printf("Error: %p is not in heap\n", bp);
-        return -1;
+    if( handles == NULL )
+        return 0;
+    for( h = 1; h < handle_cap; ++h ) {
+        if( !HANDLE_LIVE(h) )
+            continue;
+        ++live;
+        bp = GETPT(HANDLE(h));
+        if( verbose )
+            printblock(bp);
+        if( !in_heap(bp) || !GET_ALLOC(bp) || GETW(HANDLEP(bp)) != h ) {
+            printf("Error: Bad block (%p) of handle %u\n", bp, h);
+            return -1;
+        }
     }
-    if( (char*)bp < heap_listp ) {
-        printf("Error: %p is not a block pointer\n", bp);
+    for( h = handle_free; h != 0; h = GETW(HANDLE(h)) >> 1 ) {
+        if( h >= handle_cap || HANDLE_LIVE(h) || ++n > handle_cap ) {
+            printf("Error: Bad free handle %u\n", h);
+            return -1;
+        }
+    }
+    if( live + n != handle_cap - 1 ) {
+        printf("Error: %u handles are neither live nor free\n",
+               handle_cap - 1 - live - n);
         return -1;
     }
-
-    //Check alignment
-    if ((size_t)bp % 8){
-		res = -1;
-		printf("Error: %p is not doubleword aligned\n", bp);
-	}
-    //Check header-footer consistency
-    if (!GET_ALLOC(bp) && GET_SIZE(bp) != (GETW(FTRP(bp))& ~(ALIGNMENT-1)) ) {
-		res = -1;
-		printf("Error: header does not match footer at %p\n", bp);
-	}
-    //Check a/f bit - pa/pf bit consistenct
-	if ( GET_ALLOC(bp) != (GET_PREALLOC(NEXT_BLKP(bp)) >> 1 )) {
-		res = -1;
-		printf("Error: inconsistency alloc bit and  prealloc bit at %p\n", bp);
-	}
-    //Check no adjacent free blocks
-	if ( !GET_ALLOC(bp) && (!GET_ALLOC(NEXT_BLKP(bp)) || !GET_PREALLOC(bp))) {
-		res = -1;
-		printf("Error: consecutive free blocks\n");
-	}
-
-    return res;
+    return 0;
 }
 
+#ifdef THREAD_SAFE
+/*
+ * create_arena - set up arena id in a new segment, its first block
+ *                takes the rest of the segment
+ *                The caller holds sbrk_lock.
+ */
+static arena_t *create_arena(unsigned int id) {
+    arena_t *ap;
+    char *p, *bp;
+
+    if((p = mem_sbrk(ARENA_SEG)) == (void *)-1 )
+        return NULL;
 
+    ap = init_arena(p);
+    ap->end = p + ARENA_SEG;
+    ap->remote = NULL;
+    pthread_mutex_init(&ap->lock, NULL);
+    arena_map[GETOFFSET(p) >> ARENA_SHIFT] = id + 1;
 
-/* 
- * checkheap - Minimal check of the heap for consistency 
- *             return the number of free blocks or -1 if error
- */
-int checkheap(int verbose) {
-    char *bp = heap_listp;
-    int freeCount = 0;
-    int res = 0;
+    bp = p + ARENA_SIZE;
+    PUTW(HDRP(bp), PACK(ARENA_SEG - ARENA_SIZE, PREALLOC, 0));
+    PUTW(FTRP(bp), GETW(HDRP(bp)));
+    PUTW(HDRP(NEXT_BLKP(bp)), PACK(0, 0, ALLOC));
+    seg_insert(ap, bp, GET_SIZE(bp));
 
-    dbg_printf("HEAP CHECK START\n");
+    arenas[id] = ap;
+    return ap;
+}
 
-    if( GETW(heap_listp - DSIZE) != 0 ){
-        printf("Bad padding before first block\n");
-        res = -1;
-    }
+/*
+ * my_arena - the arena of this thread, NULL if the heap is out of memory
+ */
+static arena_t *my_arena(void) {
+    if( tcache.epoch != heap_epoch )
+        tcache_reset();
+    return tcache.arena;
+}
 
-    for (bp = heap_listp; GET_SIZE(bp) > 0; bp = NEXT_BLKP(bp)) {
-        if( checkblock(bp) < 0 ){
-            printblock(bp);
-            res = -1;
-        }
-        else if( verbose ){
-            printblock(bp);
+/*
+ * arena_sbrk - get new blocks of at least *sizep bytes for arena ap
+ *              Grow the last segment of ap in place if it ends at brk,
+ *              start a new segment otherwise. The caller holds the lock
+ *              of ap.
+ *
+ *	return the block pointer of the new area, its size in *sizep
+ *	return NULL on error
+ */
+static void *arena_sbrk(arena_t *ap, size_t *sizep) {
+    size_t size = *sizep, offset;
+    char *p, *bp;
+
+    pthread_mutex_lock(&sbrk_lock);
+    if( ap->end == (char *)LASTBP ) {
+        //The new area merges with the last block if it is free
+        if( !GET_PREALLOC(LASTBP) )
+            size -= MIN(size - MINBLOCK, GET_SIZE(PREV_BLKP(LASTBP)));
+        size = (size + ARENA_SEG - 1) & ~(ARENA_SEG - 1);
+        if((p = mem_sbrk(size)) == (void *)-1 ) {
+            pthread_mutex_unlock(&sbrk_lock);
+            return NULL;
         }
-
-        if( !GET_ALLOC(bp) ){
-            ++freeCount;
+        bp = p;
+        *sizep = size;
+    }
+    else {
+        size = (size + SEG_HDR + ARENA_SEG - 1) & ~(ARENA_SEG - 1);
+        if((p = mem_sbrk(size)) == (void *)-1 ) {
+            pthread_mutex_unlock(&sbrk_lock);
+            return NULL;
         }
+        //A new segment: padding and a header with the pa bit set
+        bp = p + SEG_HDR;
+        PUTW(bp - DSIZE, 0);
+        PUTW(HDRP(bp), PACK(0, PREALLOC, ALLOC));
+        *sizep = size - SEG_HDR;
     }
 
-    //Check the epilogue header
-    if ((GET_SIZE(bp) != 0) || !(GET_ALLOC(bp)))
-	    printf("Bad epilogue header\n");
-    else if( verbose )
-        printblock(bp);
+    for( offset = GETOFFSET(p); offset < GETOFFSET(p + size);
+         offset += ARENA_SEG )
+        arena_map[offset >> ARENA_SHIFT] =
+            arena_map[GETOFFSET(ap) >> ARENA_SHIFT];
+    ap->end = p + size;
+    pthread_mutex_unlock(&sbrk_lock);
+    return bp;
+}
 
-    dbg_printf("HEAP CHECK END\n");
-    return (res < 0) ? res : freeCount;
+/*
+ * arena_free - free a block to its arena, or onto the arena's remote
+ *              list if it is not the arena of this thread
+ */
+static void arena_free(void *bp) {
+    arena_t *ap = ARENA_OF(bp);
+
+    if( ap != my_arena() ) {
+        remote_free(ap, bp);
+        return;
+    }
+    LOCK_ARENA(ap);
+    heap_free(ap, bp);
+    UNLOCK_ARENA(ap);
 }
 
-int checkfreelist(int verbose, int freeCount){
-    char *fp, *bp, *prevbp, *nextbp;
-    int res = 0, lows = 8, size;
-    int count = 0;
+/*
+ * remote_free - push a block onto the remote list of ap, lock-free
+ *               The owner takes the whole list at once, so there is
+ *               no ABA problem.
+ */
+static void remote_free(arena_t *ap, void *bp) {
+    SET_CACHED(bp);
+    LINK(bp) = __atomic_load_n(&ap->remote, __ATOMIC_RELAXED);
+    while( !__atomic_compare_exchange_n(&ap->remote, &LINK(bp), bp, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED) )
+        ;
+}
 
-    dbg_printf("FREELIST CHECK START, #fb = %d\n", freeCount);
+/*
+ * arena_drain - free the blocks on the remote list of ap
+ *               The caller holds the lock of ap.
+ */
+static void arena_drain(arena_t *ap) {
+    void *bp, *next;
 
-    if( free_listp != mem_heap_lo() ){
-        printf("Error: Bad free list sentry node (%p)\n", free_listp);
-        dbg_printf("Exit checkfreelist with error\n");
-        return -1;
+    bp = __atomic_exchange_n(&ap->remote, NULL, __ATOMIC_ACQUIRE);
+    for( ; bp != NULL; bp = next ) {
+        next = LINK(bp);
+        heap_free(ap, bp);
     }
+}
 
-    for( fp = free_listp; fp != seglist_end; fp += DSIZE ) {
-        lows <<= 1;
-        if(verbose) {
-            printf("Seg(%p): %d byte\n", fp, lows);
+/*
+ * next_segment - given the epilogue of a segment, return the first block
+ *                of the next segment, NULL at the end of the heap
+ */
+static char *next_segment(char *bp) {
+    if( bp == (char *)LASTBP )
+        return NULL;
+    if( (char *)ARENA_OF(bp) == bp )
+        return bp + ARENA_SIZE;
+    return bp + SEG_HDR;
+}
+
+/*
+ * lock_all - take every arena lock, then sbrk_lock (and the profile lock)
+ *            Only mm_checkheap and fork hold more than one arena lock.
+ *            An arena made while we wait for sbrk_lock is left alone,
+ *            locked_arenas tells unlock_all which ones to let go.
+ */
+static void lock_all(void) {
+    unsigned int i, held = 0;
+
+    //A handle table grows under handle_lock, with an arena lock taken
+    pthread_mutex_lock(&handle_lock);
+    for( i = 0; i < NARENAS; ++i ) {
+        if( arenas[i] != NULL ) {
+            LOCK_ARENA(arenas[i]);
+            held |= 1u << i;
         }
+    }
+    pthread_mutex_lock(&sbrk_lock);
+#ifdef HEAP_PROFILE
+    PROFILE_LOCK();
+#endif
+    locked_arenas = held;
+}
 
-        for(bp = GET_NEXTFBP(fp); bp != fp; bp = GET_NEXTFBP(bp)) {
-            prevbp = GET_PREVFBP(bp);
-            nextbp = GET_NEXTFBP(bp);
-            size = GET_SIZE(bp);
+static void unlock_all(void) {
+    unsigned int i, held = locked_arenas;
 
-            //Check if block is unallocated
-            if( GET_ALLOC(bp) ){
-                printf("Error: Allocated block in free list (%p)\n", bp);
-                checkblock(bp);
-                res = -1;
-            }
-            
-            //Check if freeblock count matches
-            if(++count > freeCount){
-                printf("Error: Too many free blocks in the free list\n");
-                res = -1;
-            }
-            
-            //Check if the pointer's value is valid
-            if( !in_heap((void*)prevbp) || !in_heap((void*)nextbp)) {
-                printf("Error: Free list pointer out of range\n");
-                res = -1;
-            }
+#ifdef HEAP_PROFILE
+    PROFILE_UNLOCK();
+#endif
+    pthread_mutex_unlock(&sbrk_lock);
+    for( i = 0; i < NARENAS; ++i ) {
+        if( held & (1u << i) )
+            UNLOCK_ARENA(arenas[i]);
+    }
+    pthread_mutex_unlock(&handle_lock);
+}
 
-            //Check the consistency of the double linked list
-            if( GET_NEXTFBP(prevbp) != (char *)bp  ){
-                printf("Error: Inconsistency prev/next pointers\n");
-                res = -1;
-            }
+/*
+ * tcache_malloc - pop a block of asize bytes from this thread's cache,
+ *                 refill the bin from the arena if it is empty
+ */
+static void *tcache_malloc(size_t asize) {
+    size_t index = TCACHE_INDEX(asize);
+    arena_t *ap;
+    unsigned int n;
+    void *bp;
 
-            //Check the block size consistency in the seglist
-            if( (size < lows) || 
-                ( (lows != (1<<LOGMAXSB)) && (size > (lows << 1)) ) ) {
-                printf("Error: Free block size does not fit the seglist\n");
-                res = -1;
-            }
+    if((ap = my_arena()) == NULL )
+        return NULL;
 
-            if( res == -1 || verbose ) {
-                printblock(bp);
-            }
+    if( tcache.bins[index] == NULL ) {
+        LOCK_ARENA(ap);
+        for( n = 0; n < TCACHE_BATCH; ++n ) {
+            if((bp = heap_malloc(ap, asize)) == NULL )
+                break;
+            LINK(bp) = tcache.bins[index];
+            tcache.bins[index] = bp;
         }
+        UNLOCK_ARENA(ap);
+        tcache.count[index] = n;
+        if( n == 0 )
+            return NULL;
     }
 
-    dbg_printf("FREELIST CHECK END\n");
-    return res;
+    bp = tcache.bins[index];
+    tcache.bins[index] = LINK(bp);
+    --tcache.count[index];
+    CLEAR_CACHED(bp);
+    return bp;
 }
 
 /*
- * Return whether the pointer is in the heap.
- * May be useful for debugging.
+ * tcache_free - push a block of asize bytes to this thread's cache,
+ *               flush part of the bin if it is full
  */
-static inline int in_heap(const void *p) {
-    return p <= mem_heap_hi() && p >= mem_heap_lo();
+static void tcache_free(void *bp, size_t asize) {
+    size_t index = TCACHE_INDEX(asize);
+
+    if( my_arena() == NULL ) {
+        remote_free(ARENA_OF(bp), bp);
+        return;
+    }
+
+    if( tcache.count[index] >= TCACHE_COUNT )
+        tcache_flush(index, TCACHE_BATCH);
+
+    SET_CACHED(bp);
+    LINK(bp) = tcache.bins[index];
+    tcache.bins[index] = bp;
+    ++tcache.count[index];
 }
 
 /*
- * Insert a free block via a seglist flavor, use LIFO approach
+ * tcache_reset - drop the blocks of an old heap, join the current epoch
+ *                and pick an arena for this thread
  */
-static void seg_insert(void *bp, size_t size) {
-	char *t;
-    char *fp = free_listp + (get_seg_index(size) * DSIZE);
-
-    t = GET_NEXTFBP(fp);
-    PUTW(NEXT_FPP(fp), GETOFFSET(bp));
-    PUTW(NEXT_FPP(bp), GETOFFSET(t));
-    PUTW(PREV_FPP(t), GETOFFSET(bp));
-    PUTW(PREV_FPP(bp), GETOFFSET(fp));
+static void tcache_reset(void) {
+    unsigned int id;
+
+    memset(tcache.bins, 0, sizeof(tcache.bins));
+    memset(tcache.count, 0, sizeof(tcache.count));
+
+    pthread_mutex_lock(&sbrk_lock);
+    if( heap_listp == NULL )
+        init_heap();
+    id = next_arena++ % NARENAS;
+    if( arenas[id] == NULL && create_arena(id) == NULL )
+        id = 0;
+    tcache.arena = arenas[id];
+    tcache.epoch = heap_epoch;
+    pthread_mutex_unlock(&sbrk_lock);
+
+    if( !tcache.registered ) {
+        pthread_once(&setup_once, process_setup);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+    }
 }
 
 /*
- * Delete a free block from the list
+ * tcache_flush - free n blocks of a bin, to this thread's arena or to
+ *                the remote lists of their arenas
  */
-static inline void delete(void *bp) {
-	PUTW(NEXT_FPP(GET_PREVFBP(bp)), GETW(NEXT_FPP(bp)));
-	PUTW(PREV_FPP(GET_NEXTFBP(bp)), GETW(PREV_FPP(bp)));
+static void tcache_flush(size_t index, unsigned int n) {
+    arena_t *ap = tcache.arena, *owner;
+    void *bp;
+
+    LOCK_ARENA(ap);
+    while( n-- > 0 && (bp = tcache.bins[index]) != NULL ) {
+        tcache.bins[index] = LINK(bp);
+        --tcache.count[index];
+        if((owner = ARENA_OF(bp)) == ap )
+            heap_free(ap, bp);
+        else
+            remote_free(owner, bp);
+    }
+    UNLOCK_ARENA(ap);
 }
 
+/*
+ * tcache_release - give the cache of an exiting thread back to the heap,
+ *                  and its trace buffer to the log
+ */
+static void tcache_release(void *arg) {
+    size_t i;
+
+    (void)arg;
+#ifdef TRACE_RECORD
+    if( trace_on > 0 )
+        trace_flush();
+#endif
+    if( tcache.epoch != heap_epoch || tcache.arena == NULL )
+        return;
+    for( i = 0; i < TCACHE_BINS; ++i )
+        tcache_flush(i, TCACHE_COUNT);
+}
 
 /*
- * Get the seglist index of a block of certain size
+ * process_setup - once per process: the key that flushes a tcache on
+ *                 thread exit, and the handlers that keep the heap
+ *                 consistent across fork. The child gets the locks back
+ *                 unheld, with the heap as the forking thread saw it.
  */
-static inline size_t get_seg_index(size_t size) {
-    //Leveraging the float's exp part
-    union{ float f; unsigned int ui; } fcast;
-    fcast.f = (float)size;
-    return MIN(((fcast.ui >> 23) & 0xff) - 127, LOGMAXSB) - LOGMINSB;
+static void process_setup(void) {
+    pthread_key_create(&tcache_key, tcache_release);
+    pthread_atfork(lock_all, unlock_all, unlock_all);
 }
+#endif /* def THREAD_SAFE */
@@ -5,20 +5,71 @@
 /* declare functions for driver tests */
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 
 #else
 
 /* declare functions for interpositioning */
 extern void *malloc (size_t size);
 extern void free (void *ptr);
+extern void free_sized(void *ptr, size_t size);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif
 
 extern int mm_init(void);
 
+/* Heap statistics, kept up to date as the heap changes */
+#define MM_MAX_CLASSES 64
+
+typedef struct {
+    size_t heap;            /* heap size in bytes */
+    size_t peak;            /* largest heap size since mm_init */
+    size_t held;            /* heap - free_bytes: live blocks with their
+                               headers, the prologue, epilogue and arena
+                               headers, and the blocks slab runs, quick
+                               lists and tcaches keep, used or not */
+    size_t free_bytes;      /* bytes in free blocks */
+    size_t largest_free;    /* largest free block */
+    double frag;            /* 1 - largest_free / free_bytes, 0 if none */
+    int nclasses;           /* seglist classes, the last has no bound */
+    size_t class_min[MM_MAX_CLASSES];   /* smallest block of each class */
+    size_t class_free[MM_MAX_CLASSES];  /* free bytes in each class */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *st);
+
+/* Allocate n blocks of one size into ptrs, free n blocks at once */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Grow the heap ahead of time, size bytes can then be allocated from it */
+extern int mm_reserve(size_t size);
+
+/* Movable blocks, named by a handle, 0 is none. mm_compact may move them,
+ * a pointer from mm_hptr is only good until then. mm_compact returns the
+ * bytes the heap shrank by; built with -DTHREAD_SAFE it moves nothing
+ * and returns 0. */
+typedef unsigned int mm_handle_t;
+
+extern mm_handle_t mm_halloc(size_t size);
+extern void mm_hfree(mm_handle_t h);
+extern void *mm_hptr(mm_handle_t h);
+extern size_t mm_compact(void);
+
+/* Live heap samples as a pprof heap profile, built with -DHEAP_PROFILE */
+extern int mm_profile_dump(int fd);
+
 /* This is largely for debugging. */
 extern void mm_checkheap(int lineno);
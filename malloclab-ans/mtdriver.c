@@ -0,0 +1,529 @@
+/*
+ * mtdriver.c - Multi-threaded trace driver for the thread-safe mm.c
+ *
+ * Every thread replays its own copy of a trace file on the shared heap,
+ * with its own block ids. The driver first checks that no block is
+ * clobbered by another thread, then times each trace with 1, 2, ..., N
+ * threads and reports the throughput and the speedup over one thread.
+ * With -x, every block is freed by the next thread instead of its own,
+ * like buffers passed from a producer to a consumer.
+ * Before the traces, it checks that a malloc of the size just passed to
+ * mm_reserve does not grow the heap.
+ *
+ * Build mm.c with -DTHREAD_SAFE for this driver (see Makefile).
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "ftimer.h"
+#include "config.h"
+
+/* Misc */
+#define MAXLINE     1024 /* max string size */
+#define MAXTHREADS    64 /* max threads per run */
+#define MAXMAIL      256 /* max blocks waiting to be freed by a thread */
+#define DEFAULT_THREADS 4
+#define DEFAULT_RUNS    3
+
+static char *default_tracefiles[] = {
+    "amptjp.rep",
+    "binary2-bal.rep",
+    "cccp.rep",
+    "coalescing-bal.rep",
+    "cp-decl.rep",
+    "random.rep",
+    NULL
+};
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    int index;                        /* index for free() to use later */
+    size_t size;                      /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* Holds the information for one trace file */
+typedef struct {
+    char filename[MAXLINE];
+    int num_ids;         /* number of alloc/realloc ids */
+    int num_ops;         /* number of distinct requests */
+    traceop_t *ops;      /* array of requests */
+} trace_t;
+
+/* The allocator under test */
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} allocator_t;
+
+/* Blocks handed to a thread to be freed there */
+typedef struct {
+    pthread_mutex_t lock;
+    void **blocks;
+    int count;
+    int done;            /* the thread has finished, free blocks locally */
+} mailbox_t;
+
+/* One replaying thread */
+typedef struct {
+    const trace_t *trace;
+    const allocator_t *alloc;
+    int id;              /* thread number, tags the payloads */
+    int check;           /* fill and check payloads */
+    char **blocks;       /* this thread's blocks, by trace index */
+    size_t *sizes;       /* ... and their payload sizes */
+    mailbox_t *inbox;    /* blocks to free here, NULL unless -x */
+    mailbox_t *outbox;   /* where this thread's blocks go to be freed */
+    int errors;
+} worker_t;
+
+/* Parameters of one timed run, passed through ftimer_gettod */
+typedef struct {
+    const trace_t *trace;
+    const allocator_t *alloc;
+    int nthreads;
+    int check;
+    int cross;           /* free blocks in the next thread */
+    int errors;
+} run_t;
+
+static const allocator_t mm_allocator =
+    { "mm", mm_malloc, mm_free, mm_realloc };
+static const allocator_t libc_allocator =
+    { "libc", malloc, free, realloc };
+
+static trace_t *read_trace(const char *tracedir, const char *filename);
+static void free_trace(trace_t *trace);
+static void *replay(void *arg);
+static void run_threads(void *arg);
+static int check_block(const worker_t *wp, int index, size_t size);
+static void post_block(worker_t *wp, int index);
+static void free_mail(mailbox_t *mp, const allocator_t *alloc);
+static int check_reserve(void);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    char **tracefiles = default_tracefiles;
+    char *single[2] = { NULL, NULL };
+    char tracedir[MAXLINE] = TRACEDIR;
+    const allocator_t *alloc = &mm_allocator;
+    int max_threads = DEFAULT_THREADS, runs = DEFAULT_RUNS, cross = 0;
+    int i, t, c, errors = 0;
+    double secs, base = 0;
+    trace_t *trace;
+    run_t run;
+
+    while ((c = getopt(argc, argv, "f:t:n:lxh")) != EOF) {
+        switch (c) {
+        case 'f': /* Use one specific trace file only (relative to curr dir) */
+            single[0] = optarg;
+            tracefiles = single;
+            strcpy(tracedir, "./");
+            break;
+        case 't': /* Max number of threads */
+            max_threads = atoi(optarg);
+            break;
+        case 'n': /* Timed runs per thread count */
+            runs = atoi(optarg);
+            break;
+        case 'l': /* Run libc malloc instead */
+            alloc = &libc_allocator;
+            break;
+        case 'x': /* Free every block in the next thread */
+            cross = 1;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (max_threads < 1 || max_threads > MAXTHREADS || runs < 1) {
+        usage();
+        exit(1);
+    }
+
+    mem_init();
+    if (alloc == &mm_allocator && check_reserve() < 0)
+        errors++;
+    printf("Results for %s malloc, %ld CPUs online%s:\n", alloc->name,
+           sysconf(_SC_NPROCESSORS_ONLN),
+           cross ? ", blocks freed by the next thread" : "");
+    printf("%-28s %7s %10s %10s %8s\n",
+           "trace", "threads", "secs", "Kops", "speedup");
+
+    for (i = 0; tracefiles[i] != NULL; i++) {
+        trace = read_trace(tracedir, tracefiles[i]);
+        run.trace = trace;
+        run.alloc = alloc;
+        run.cross = cross;
+
+        for (t = 1; t <= max_threads; t++) {
+            run.nthreads = t;
+
+            /* Correctness first: no thread may see its payloads change */
+            run.check = 1;
+            run.errors = 0;
+            run_threads(&run);
+            if (run.errors) {
+                printf("%-28s %7d %10s\n", trace->filename, t, "ERROR");
+                errors++;
+                break;
+            }
+
+            run.check = 0;
+            secs = ftimer_gettod(run_threads, &run, runs);
+            if (t == 1)
+                base = secs;
+            printf("%-28s %7d %10.6f %10.0f %8.2f\n", trace->filename, t,
+                   secs, (double)t * trace->num_ops / secs / 1e3,
+                   base * t / secs);
+        }
+        free_trace(trace);
+    }
+
+    mem_deinit();
+    return errors ? 1 : 0;
+}
+
+/*
+ * run_threads - replay the trace in nthreads threads on a fresh heap
+ */
+static void run_threads(void *arg)
+{
+    run_t *rp = (run_t *)arg;
+    pthread_t tids[MAXTHREADS];
+    worker_t workers[MAXTHREADS];
+    mailbox_t mail[MAXTHREADS];
+    int i;
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+
+    for (i = 0; i < rp->nthreads; i++) {
+        workers[i].trace = rp->trace;
+        workers[i].alloc = rp->alloc;
+        workers[i].id = i;
+        workers[i].check = rp->check;
+        workers[i].errors = 0;
+        workers[i].blocks = calloc(rp->trace->num_ids, sizeof(char *));
+        workers[i].sizes = calloc(rp->trace->num_ids, sizeof(size_t));
+        if (workers[i].blocks == NULL || workers[i].sizes == NULL) {
+            fprintf(stderr, "calloc failed in run_threads\n");
+            exit(1);
+        }
+        workers[i].inbox = workers[i].outbox = NULL;
+        if (rp->cross) {
+            pthread_mutex_init(&mail[i].lock, NULL);
+            mail[i].count = mail[i].done = 0;
+            if ((mail[i].blocks =
+                 calloc(rp->trace->num_ids, sizeof(void *))) == NULL) {
+                fprintf(stderr, "calloc failed in run_threads\n");
+                exit(1);
+            }
+            workers[i].inbox = &mail[i];
+            workers[i].outbox = &mail[(i + 1) % rp->nthreads];
+        }
+    }
+
+    for (i = 0; i < rp->nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, replay, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < rp->nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        rp->errors += workers[i].errors;
+        free(workers[i].blocks);
+        free(workers[i].sizes);
+    }
+
+    /* Blocks posted after their thread had finished */
+    if (rp->cross) {
+        for (i = 0; i < rp->nthreads; i++) {
+            free_mail(&mail[i], rp->alloc);
+            free(mail[i].blocks);
+            pthread_mutex_destroy(&mail[i].lock);
+        }
+    }
+}
+
+/*
+ * replay - the thread routine, run every request of the trace
+ *     With check set, every payload is filled with a byte tagged by
+ *     thread and block id, and checked before realloc and free.
+ */
+static void *replay(void *arg)
+{
+    worker_t *wp = (worker_t *)arg;
+    const trace_t *trace = wp->trace;
+    const allocator_t *alloc = wp->alloc;
+    int i, index;
+    size_t size;
+    char *p;
+
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC:
+            if ((p = alloc->malloc(size)) == NULL) {
+                wp->errors++;
+                return NULL;
+            }
+            break;
+
+        case REALLOC:
+            if (wp->check && check_block(wp, index,
+                    size < wp->sizes[index] ? size : wp->sizes[index]) < 0)
+                return NULL;
+            if ((p = alloc->realloc(wp->blocks[index], size)) == NULL
+                && size != 0) {
+                wp->errors++;
+                return NULL;
+            }
+            break;
+
+        case FREE:
+            if (index < 0) {
+                alloc->free(NULL);
+                continue;
+            }
+            if (wp->check && check_block(wp, index, wp->sizes[index]) < 0)
+                return NULL;
+            if (wp->outbox != NULL)
+                post_block(wp, index);
+            else
+                alloc->free(wp->blocks[index]);
+            wp->blocks[index] = NULL;
+            wp->sizes[index] = 0;
+            continue;
+
+        default:
+            wp->errors++;
+            return NULL;
+        }
+
+        wp->blocks[index] = p;
+        wp->sizes[index] = size;
+        if (wp->check && p != NULL)
+            memset(p, (wp->id * 31 + index) & 0xff, size);
+
+        if (wp->inbox != NULL && wp->inbox->count > 0)
+            free_mail(wp->inbox, alloc);
+    }
+
+    /* Hand everything back so the heap can be reused */
+    for (i = 0; i < trace->num_ids; i++)
+        if (wp->blocks[i] != NULL)
+            alloc->free(wp->blocks[i]);
+    if (wp->inbox != NULL) {
+        pthread_mutex_lock(&wp->inbox->lock);
+        wp->inbox->done = 1;
+        pthread_mutex_unlock(&wp->inbox->lock);
+        free_mail(wp->inbox, alloc);
+    }
+    return NULL;
+}
+
+/*
+ * check_block - check the first size bytes of a payload still carry
+ *     the tag of this thread and block. Return -1 if not.
+ */
+static int check_block(const worker_t *wp, int index, size_t size)
+{
+    unsigned char tag = (wp->id * 31 + index) & 0xff;
+    unsigned char *p = (unsigned char *)wp->blocks[index];
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        if (p[i] != tag) {
+            fprintf(stderr, "%s: thread %d, block %d (%p) garbled at byte "
+                    "%zu\n", wp->trace->filename, wp->id, index, p, i);
+            ((worker_t *)wp)->errors++;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * post_block - hand a block to the next thread, which frees it
+ *     Wait while MAXMAIL blocks are pending there, so that a producer
+ *     cannot run away from its consumer.
+ */
+static void post_block(worker_t *wp, int index)
+{
+    mailbox_t *mp = wp->outbox;
+
+    pthread_mutex_lock(&mp->lock);
+    while (mp->count >= MAXMAIL && !mp->done) {
+        pthread_mutex_unlock(&mp->lock);
+        free_mail(wp->inbox, wp->alloc);
+        sched_yield();
+        pthread_mutex_lock(&mp->lock);
+    }
+    if (mp->done) {
+        pthread_mutex_unlock(&mp->lock);
+        wp->alloc->free(wp->blocks[index]);
+        return;
+    }
+    mp->blocks[mp->count++] = wp->blocks[index];
+    pthread_mutex_unlock(&mp->lock);
+}
+
+/*
+ * free_mail - free the blocks other threads handed to this one
+ */
+static void free_mail(mailbox_t *mp, const allocator_t *alloc)
+{
+    int i;
+
+    pthread_mutex_lock(&mp->lock);
+    for (i = 0; i < mp->count; i++)
+        alloc->free(mp->blocks[i]);
+    mp->count = 0;
+    pthread_mutex_unlock(&mp->lock);
+}
+
+/*
+ * check_reserve - after mm_reserve(size), malloc(size) must not grow the
+ *     heap, with a free block that can't take it left in the arena
+ *     before the end of its segment. Return -1 if it does.
+ */
+static int check_reserve(void)
+{
+    static const size_t sizes[] = { 4096, 100000, 1 << 20 };
+    size_t i, sbrks;
+    void *hole, *pin, *p;
+    int res = 0;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        mem_reset_brk();
+        if (mm_init() < 0) {
+            fprintf(stderr, "mm_init failed\n");
+            exit(1);
+        }
+        hole = mm_malloc(sizes[i] / 2);
+        pin = mm_malloc(16);
+        mm_free(hole);
+        if (mm_reserve(sizes[i]) < 0) {
+            fprintf(stderr, "mm_reserve(%zu) failed\n", sizes[i]);
+            return -1;
+        }
+        sbrks = mem_sbrkcount();
+        if ((p = mm_malloc(sizes[i])) == NULL ||
+            mem_sbrkcount() != sbrks) {
+            fprintf(stderr, "malloc(%zu) grew the heap after "
+                    "mm_reserve(%zu)\n", sizes[i], sizes[i]);
+            res = -1;
+        }
+        mm_free(p);
+        mm_free(pin);
+    }
+    return res;
+}
+
+/*
+ * read_trace - read a trace file in the mdriver format
+ */
+static trace_t *read_trace(const char *tracedir, const char *filename)
+{
+    FILE *tracefile;
+    trace_t *trace;
+    char type[MAXLINE];
+    int weight, ignore_ranges, index, size, op_index = 0;
+
+    if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL) {
+        fprintf(stderr, "malloc failed in read_trace\n");
+        exit(1);
+    }
+
+    strcpy(trace->filename, tracedir);
+    strcat(trace->filename, filename);
+    if ((tracefile = fopen(trace->filename, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s in read_trace\n", trace->filename);
+        exit(1);
+    }
+    if (fscanf(tracefile, "%d %d %d %d", &weight, &trace->num_ids,
+               &trace->num_ops, &ignore_ranges) != 4) {
+        fprintf(stderr, "%s: bad trace header\n", trace->filename);
+        exit(1);
+    }
+
+    if ((trace->ops =
+         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL) {
+        fprintf(stderr, "malloc failed in read_trace\n");
+        exit(1);
+    }
+
+    while (op_index < trace->num_ops && fscanf(tracefile, "%s", type) != EOF) {
+        index = size = 0;
+        switch (type[0]) {
+        case 'a':
+            assert(fscanf(tracefile, "%d %d", &index, &size) == 2);
+            trace->ops[op_index].type = ALLOC;
+            break;
+        case 'r':
+            assert(fscanf(tracefile, "%d %d", &index, &size) == 2);
+            trace->ops[op_index].type = REALLOC;
+            break;
+        case 'f':
+            assert(fscanf(tracefile, "%d", &index) == 1);
+            trace->ops[op_index].type = FREE;
+            break;
+        default:
+            fprintf(stderr, "Bogus type character (%c) in tracefile %s\n",
+                    type[0], trace->filename);
+            exit(1);
+        }
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = size;
+        op_index++;
+    }
+    fclose(tracefile);
+    trace->num_ops = op_index;
+    return trace;
+}
+
+static void free_trace(trace_t *trace)
+{
+    free(trace->ops);
+    free(trace);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mtdriver [-hlx] [-t <n>] [-n <runs>] [-f <file>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-l         Run libc malloc instead.\n");
+    fprintf(stderr, "\t-n <runs>  Average over <runs> timed runs (default %d).\n",
+            DEFAULT_RUNS);
+    fprintf(stderr, "\t-t <n>     Scale from 1 to <n> threads (default %d).\n",
+            DEFAULT_THREADS);
+    fprintf(stderr, "\t-x         Free every block in the next thread.\n");
+}
@@ -6,6 +6,10 @@
  *	   and evict the head nodes
  *	 - Use two sets of semophores:
  *		- rw lock to achieve exclusive writers and mutual readers
+ *	 - Serve byte ranges of cached entities with 206 responses
+ *	 - Keep 206 responses as sparse entities made of byte segments
+ *	 - Keys carry the content-coding variant of Vary: Accept-Encoding
+ *	   responses; entities gzipped by the proxy are gunzipped on demand
  *
  * AndrewID: jiexil
  * Name: Jiexi Lin
@@ -17,6 +21,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "cache.h"
+#include "range.h"
+#include "encoding.h"
 #include <assert.h>
 
 //#define DEBUG 
@@ -34,13 +40,22 @@
 static int init_list(blist_t *lp);
 static int init_block(block_t *bp, 
 	cid_t *cid, const char *content, size_t size);
+static int send_gunzipped(block_t *bp, int clientfd, const char *range);
 static void destroy_list(blist_t *lp);
 static void destroy_block(block_t *bp);
+static void parse_head(block_t *bp);
+static void remove_block(cache_t *cp, block_t *bp);
+static block_t *find_block(cache_t *cp, cid_t *cid);
+static long merge_segment(block_t *bp, long first, const char *data, long len);
+static int send_block(block_t *bp, int clientfd, const char *range, 
+	int accept_gzip);
 static unsigned hash_index(char *id);
 static void evict_to_fit( cache_t *cp, int size );
 static void push_back(block_t *head, block_t *bp);
 static void promote_lru(block_t *lp, block_t *bp);
 static block_t *search_lru(cache_t *cp, cid_t *cid );
+static void reader_lock(cache_t *cp);
+static void reader_unlock(cache_t *cp);
 static void checklist(cache_t *cp);
 
 /*
@@ -112,12 +127,42 @@ int init_block(block_t *bp,
 		bp->size = 0;
 	}
 
+	bp->segs = NULL;
+	bp->gzipped = 0;
+	parse_head(bp);
 	bp->prev = NULL;
 	bp->next = NULL;
 	dbg_exit();
 	return 0;
 }
 
+/*
+ * parse_head - locate the entity of a cached response
+ *	 - set the status, the head size and the entity length
+ *	 - head_size is -1 if the response has no complete head
+ */
+void parse_head(block_t *bp) {
+	int i;
+
+	bp->status = 0;
+	bp->head_size = -1;
+	bp->total = 0;
+
+	if( bp->content == NULL )
+		return;
+
+	for( i = 3; i < bp->size; ++i ){
+		if( bp->content[i] == '\n' && bp->content[i-1] == '\r'
+			&& bp->content[i-2] == '\n' && bp->content[i-3] == '\r' ){
+			bp->head_size = i + 1;
+			bp->total = bp->size - bp->head_size;
+			break;
+		}
+	}
+	if( bp->head_size > 0 )
+		sscanf(bp->content, "%*s %d", &bp->status);
+}
+
 /*
  * destroy_cache - destroy the whole cache
  */
@@ -151,8 +196,15 @@ void destroy_list( blist_t *lp) {
 void destroy_block( block_t *bp) {
 	dbg_enter();
 
+	seg_t *sp;
+
 	if(bp->id != NULL) Free(bp->id);
 	if(bp->content != NULL) Free(bp->content);
+	while((sp = bp->segs) != NULL ){
+		bp->segs = sp->next;
+		Free(sp->data);
+		Free(sp);
+	}
 	bp->next = NULL;
 	bp->prev = NULL;
 	Free(bp);
@@ -176,9 +228,11 @@ unsigned int hash_index(char *str)
 
 /*
  * gen_cid - generate the key of the cache block from uri
+ *	 - variant is the content-coding class for responses that
+ *	   Vary on Accept-Encoding, NULL for the plain key
  */
-void gen_cid(cid_t *cid, 
-	const char *host, const char *port, const char *path){
+void gen_cid(cid_t *cid, const char *host, const char *port, 
+	const char *path, const char *variant){
 	//copy host in a case insensitive way
 	const char *p = host;
 	char *q = cid->id;
@@ -190,6 +244,11 @@ void gen_cid(cid_t *cid,
 	strcat(cid->id,":");
 	strcat(cid->id,port);
 	strcat(cid->id,path);
+	//A request target never contains a space
+	if( variant != NULL ){
+		strcat(cid->id," ");
+		strcat(cid->id,variant);
+	}
 
 	cid->index = hash_index(cid->id);
 }
@@ -236,52 +295,184 @@ block_t *search_lru( cache_t *cp, cid_t *cid ){
 
 /*
  * try_from_cache - try to read from cache via a key
+ *	 - range is the value of the Range request header, or NULL
+ *	 - a sparse entity is a hit only if it covers every range
+ *	 - accept_gzip tells if the client takes Content-Encoding: gzip
  *
  *	return 0 on cache miss
  * 	return 1 on cache hit
  *	return -1 on error
  */
-int try_from_cache( cache_t *cp, int clientfd, cid_t *cid) {
+int try_from_cache( cache_t *cp, int clientfd, cid_t *cid, 
+	const char *range, int accept_gzip) {
 
 	block_t *bp;
 	int rc;
 	dbg_enter();
 
-	//First reader grap the write lock
+	reader_lock(cp);
+
+	if((bp = search_lru(cp, cid)) != NULL )
+		rc = send_block(bp, clientfd, range, accept_gzip);
+	else
+		rc = 0;
+
+	reader_unlock(cp);
+
+	dbg_exit();
+	return rc;
+}
+
+/*
+ * send_block - transfer a cached block to client, the read lock is held
+ *	 - without range, send the whole response
+ *	 - with range, send the ranges of a complete 200 response or
+ *	   a sparse entity with a 206 response
+ *
+ *	return 0 if the block cannot serve the request
+ * 	return 1 on success
+ *	return -1 on error
+ */
+int send_block(block_t *bp, int clientfd, const char *range, 
+	int accept_gzip) {
+	range_t ranges[MAX_RANGES];
+	seg_t *sp;
+	int i, n;
+
+	//Ranges always refer to the entity the origin sent
+	if( bp->gzipped && (range != NULL || !accept_gzip) )
+		return send_gunzipped(bp, clientfd, range);
+
+	if( bp->segs == NULL ){
+		//Whole response cached
+		n = 0;
+		if( range != NULL && bp->status == 200 && bp->head_size > 0 )
+			n = parse_range(range, bp->total, ranges);
+
+		if( n == 0 )
+			return (Rio_writen(clientfd, bp->content, bp->size) < 0) ? -1 : 1;
+		if( n < 0 )
+			return (send_unsatisfiable(clientfd, bp->total) < 0) ? -1 : 1;
+
+		for( i = 0; i < n; ++i )
+			ranges[i].data = bp->content + bp->head_size + ranges[i].first;
+	}
+	else {
+		//Sparse entity, every range must lie within one segment
+		if( range == NULL )
+			return 0;
+		if((n = parse_range(range, bp->total, ranges)) <= 0 )
+			return 0;
+
+		for( i = 0; i < n; ++i ){
+			for( sp = bp->segs; sp != NULL; sp = sp->next )
+				if( sp->start <= ranges[i].first 
+					&& ranges[i].last < sp->start + sp->len )
+					break;
+			if( sp == NULL )
+				return 0;
+			ranges[i].data = sp->data + (ranges[i].first - sp->start);
+		}
+	}
+
+	if( send_ranges(clientfd, bp->content, bp->head_size, 
+			bp->total, ranges, n) < 0 )
+		return -1;
+	return 1;
+}
+
+/*
+ * send_gunzipped - send a block gzipped by the proxy in its original form
+ *
+ *	return -1 on error
+ * 	return 1 on success
+ */
+int send_gunzipped(block_t *bp, int clientfd, const char *range) {
+	block_t tmp;
+	int rc, size;
+
+	memset(&tmp, 0, sizeof(block_t));
+	if( gunzip_response(bp->content, bp->head_size, bp->size,
+			&tmp.content, &size) < 0 )
+		return -1;
+	tmp.size = size;
+	parse_head(&tmp);
+
+	rc = send_block(&tmp, clientfd, range, 0);
+	free(tmp.content);
+	return rc;
+}
+
+/*
+ * copy_from_cache - copy a cached object out via a key
+ *	 - the copy is malloc'ed, the caller frees it
+ *	 - gzipped entities are a miss for clients without gzip
+ *	 - for asynchronous writers that must not hold the read lock
+ *
+ *	return 0 on cache miss
+ *	return the object size on cache hit
+ *	return -1 on error
+ */
+int copy_from_cache( cache_t *cp, cid_t *cid, char **contentp, 
+	int accept_gzip ) {
+
+	block_t *bp;
+	int rc = 0;
+	dbg_enter();
+
+	*contentp = NULL;
+	reader_lock(cp);
+
+	if((bp = search_lru(cp, cid)) != NULL && bp->segs == NULL 
+		&& bp->size > 0 && (!bp->gzipped || accept_gzip) ){
+		if((*contentp = (char*)malloc(bp->size)) == NULL )
+			rc = -1;
+		else{
+			memcpy(*contentp, bp->content, bp->size);
+			rc = bp->size;
+		}
+	}
+
+	reader_unlock(cp);
+
+	dbg_exit();
+	return rc;
+}
+
+/*
+ * reader_lock - enter the cache as a reader
+ *	 - first reader grap the write lock
+ */
+void reader_lock( cache_t *cp ) {
 	P(&(cp->rcnt_mutex));
 	(cp->readcnt)++;
 	if( cp->readcnt == 1 )
 		P(&(cp->write_sem));
 	V(&(cp->rcnt_mutex));
+}
 
-	if((bp = search_lru(cp, cid)) != NULL ){
-		//cache hit, transfer to client
-		if( Rio_writen(clientfd, bp->content, bp->size) < 0 )
-				rc = -1;
-		else
-			rc = 1;
-	}
-	else
-		rc = 0;
-
+/*
+ * reader_unlock - leave the cache as a reader
+ *	 - last reader return the write lock
+ */
+void reader_unlock( cache_t *cp ) {
 	P(&(cp->rcnt_mutex));
 	(cp->readcnt)--;
 	if( cp->readcnt == 0 )
 		V(&(cp->write_sem));
 	V(&(cp->rcnt_mutex));
-
-	dbg_exit();
-	return rc;
 }
 
 /*
  * update_cache - insert a new block into cache, evict if neccessary
+ *	 - replace the blocks with the same key, sparse or not
+ *	 - gzipped marks a response compressed by gzip_response()
  *	
  *	return -1 on error
  * 	return 0 on success
  */
 int update_cache( cache_t *cp, cid_t *cid, 
-	const char *content, size_t size ) { 
+	const char *content, size_t size, int gzipped ) { 
 	dbg_enter();
 
 	block_t *bp;
@@ -289,6 +480,9 @@ int update_cache( cache_t *cp, cid_t *cid,
 	//Grap write lock
 	P(&(cp->write_sem));
 	checklist(cp);
+
+	while((bp = find_block(cp, cid)) != NULL )
+		remove_block(cp, bp);
 	
 	if( cp->total_size + size > MAX_CACHE_SIZE )
 		evict_to_fit( cp, size );
@@ -297,8 +491,10 @@ int update_cache( cache_t *cp, cid_t *cid,
 		|| init_block(bp, cid, content, size) < 0){
 		rc = -1;
 	}
-	else
+	else{
+		bp->gzipped = gzipped;
 		push_back(cp->lists[cid->index].head, bp);
+	}
 
 	cp->total_size += size;
 	//Return write lock
@@ -309,6 +505,147 @@ int update_cache( cache_t *cp, cid_t *cid,
 	return rc;
 }
 
+/*
+ * update_cache_range - cache the entity bytes of a 206 response
+ *	 - head is the head of the 206 response, kept for later 206s
+ *	 - merge into the sparse block of the same key and entity length
+ *	 - a complete block of the same key makes this a no-op
+ *	
+ *	return -1 on error
+ * 	return 0 on success
+ */
+int update_cache_range( cache_t *cp, cid_t *cid, 
+	const char *head, size_t head_size,
+	long first, const char *data, size_t len, long total) {
+	dbg_enter();
+
+	block_t *bp;
+	long added;
+	int rc = 0;
+	//Grap write lock
+	P(&(cp->write_sem));
+	checklist(cp);
+
+	if((bp = find_block(cp, cid)) != NULL 
+		&& bp->segs != NULL && bp->total != total ){
+		//The entity changed, forget the old segments
+		remove_block(cp, bp);
+		bp = NULL;
+	}
+
+	if( bp == NULL ){
+		if((bp = (block_t*)malloc(sizeof(block_t))) == NULL
+			|| init_block(bp, cid, head, head_size) < 0){
+			rc = -1;
+			goto out;
+		}
+		bp->head_size = head_size;
+		bp->total = total;
+		if((added = merge_segment(bp, first, data, len)) < 0 ){
+			destroy_block(bp);
+			rc = -1;
+			goto out;
+		}
+		bp->size += added;
+		cp->total_size += bp->size;
+		push_back(cp->lists[cid->index].head, bp);
+	}
+	else if( bp->segs != NULL ){
+		if( bp->size + (long)len > MAX_OBJECT_SIZE )
+			goto out;
+		if((added = merge_segment(bp, first, data, len)) < 0 ){
+			rc = -1;
+			goto out;
+		}
+		bp->size += added;
+		cp->total_size += added;
+	}
+
+	//May evict the block just updated, which is fine
+	if( cp->total_size > MAX_CACHE_SIZE )
+		evict_to_fit( cp, 0 );
+
+out:
+	//Return write lock
+	V(&cp->write_sem);
+
+	checklist(cp);
+	dbg_exit();
+	return rc;
+}
+
+/*
+ * merge_segment - add the bytes [first, first+len) to a sparse block
+ *	 - the overlapping and adjacent segments are merged into one
+ *
+ *	return -1 on error
+ *	return the number of newly cached bytes on success
+ */
+long merge_segment(block_t *bp, long first, const char *data, long len) {
+	seg_t **pp = &bp->segs, *sp, *next, *ns;
+	long start = first, end = first + len, old = 0;
+
+	//Skip the segments ending before the new one
+	while( *pp != NULL && (*pp)->start + (*pp)->len < first )
+		pp = &(*pp)->next;
+
+	//Grow [start, end) over all touching segments
+	for( sp = *pp; sp != NULL && sp->start <= end; sp = sp->next ){
+		if( sp->start < start )
+			start = sp->start;
+		if( sp->start + sp->len > end )
+			end = sp->start + sp->len;
+	}
+
+	if((ns = (seg_t*)malloc(sizeof(seg_t))) == NULL )
+		return -1;
+	if((ns->data = (char*)malloc(end - start)) == NULL ){
+		free(ns);
+		return -1;
+	}
+	ns->start = start;
+	ns->len = end - start;
+
+	//Move the old bytes over, then the new ones on top
+	for( sp = *pp; sp != NULL && sp->start <= end; sp = next ){
+		next = sp->next;
+		memcpy(ns->data + (sp->start - start), sp->data, sp->len);
+		old += sp->len;
+		Free(sp->data);
+		Free(sp);
+	}
+	memcpy(ns->data + (first - start), data, len);
+
+	ns->next = sp;
+	*pp = ns;
+	return ns->len - old;
+}
+
+/*
+ * find_block - find a block by key without touching the LRU order
+ *	 - the write lock must be held
+ */
+block_t *find_block( cache_t *cp, cid_t *cid ){
+	block_t *head = cp->lists[cid->index].head;
+	block_t *bp;
+
+	for( bp = head->next; bp != head; bp = bp->next )
+		if( strcmp(bp->id, cid->id) == 0 )
+			return bp;
+	return NULL;
+}
+
+/*
+ * remove_block - unlink and destroy a block
+ *	 - the write lock must be held
+ */
+void remove_block( cache_t *cp, block_t *bp ){
+	bp->prev->next = bp->next;
+	bp->next->prev = bp->prev;
+	cp->total_size -= bp->size;
+	destroy_block(bp);
+}
+
 /*
  * evict_to_fit - evict in an LRU manner to spare mem for a new block
  *	 - always evict the head of a list
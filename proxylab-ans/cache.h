@@ -19,11 +19,24 @@ typedef struct {
 	unsigned int index;
 } cid_t;
 
+//byte segment of a partially cached entity, sorted and never adjacent
+typedef struct seg_t{
+	long start;
+	long len;
+	char *data;
+	struct seg_t *next;
+} seg_t;
+
 //cache block, double linked list
 typedef struct block_t{
     char *id;
-    char *content;
-    int size;
+    char *content;		//whole response, or only the head if sparse
+    int size;			//bytes charged to the cache
+    int head_size;		//status line and headers in content, -1 unknown
+    int status;			//response status code
+    long total;			//entity length
+    seg_t *segs;		//cached segments of a sparse (206) entity
+    int gzipped;		//entity gzipped by the proxy, not by the origin
   	struct block_t *prev;
     struct block_t *next;
 } block_t;
@@ -46,10 +59,16 @@ typedef struct {
 
 int init_cache(cache_t *cp);
 void destroy_cache(cache_t *cp);
-void gen_cid(cid_t *cid, 
-	const char *host, const char *port, const char *path);
+void gen_cid(cid_t *cid, const char *host, const char *port, 
+	const char *path, const char *variant);
 
-int try_from_cache(cache_t *cp, int clientfd, cid_t *cid);
+int try_from_cache(cache_t *cp, int clientfd, cid_t *cid, 
+	const char *range, int accept_gzip);
+int copy_from_cache(cache_t *cp, cid_t *cid, char **contentp, 
+	int accept_gzip);
 int update_cache( cache_t *cp, cid_t *cid, 
-	const char *content, size_t size);
+	const char *content, size_t size, int gzipped);
+int update_cache_range( cache_t *cp, cid_t *cid, 
+	const char *head, size_t head_size,
+	long first, const char *data, size_t len, long total);
 
@@ -4,6 +4,8 @@
  * Modified 8/2015 jiexil:
  *   - modify error handling functions. No exit in most error functions
  *   - modify Rio_writen function. Add return value.   
+ *   - per-thread timeouts and deadline for the Rio functions and
+ *     open_clientfd. A call that runs out fails with ETIMEDOUT.
  *
  * Updated 8/2014 droh: 
  *   - New versions of open_clientfd and open_listenfd are reentrant and
@@ -21,6 +23,7 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#include <poll.h>
 
 /************************** 
  * Error-handling functions
@@ -737,6 +740,113 @@ void V(sem_t *sem)
  * The Rio package - Robust I/O functions
  ****************************************/
 
+/* Timeouts of the calling thread, no limit when 0 */
+static __thread struct timespec rio_deadline;
+static __thread int rio_timeout;
+static __thread int rio_expired;
+
+/*
+ * rio_set_deadline - fail every Rio call of this thread ms from now.
+ *     0 removes the deadline and clears rio_timedout().
+ */
+void rio_set_deadline(int ms)
+{
+    rio_expired = 0;
+    if (ms <= 0) {
+        rio_clear_deadline();
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &rio_deadline);
+    rio_deadline.tv_sec += ms / 1000;
+    rio_deadline.tv_nsec += (ms % 1000) * 1000000L;
+    if (rio_deadline.tv_nsec >= 1000000000L) {
+        rio_deadline.tv_sec++;
+        rio_deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * rio_clear_deadline - remove the deadline of this thread, but keep
+ *     rio_timedout(), so that an error can still be written after it
+ *     passed.
+ */
+void rio_clear_deadline(void)
+{
+    rio_deadline.tv_sec = 0;
+    rio_deadline.tv_nsec = 0;
+}
+
+/*
+ * rio_set_timeout - fail a Rio call of this thread that waits more than
+ *     ms for its descriptor. 0 for no limit.
+ */
+void rio_set_timeout(int ms)
+{
+    rio_timeout = (ms > 0) ? ms : 0;
+}
+
+/*
+ * rio_timedout - why the first call of this thread that timed out did,
+ *     0 if none did since rio_set_deadline.
+ */
+int rio_timedout(void)
+{
+    return rio_expired;
+}
+
+/*
+ * rio_time_left - ms left before the deadline of this thread, -1 if none
+ */
+int rio_time_left(void)
+{
+    struct timespec now;
+    long left;
+
+    if (rio_deadline.tv_sec == 0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = (rio_deadline.tv_sec - now.tv_sec) * 1000
+        + (rio_deadline.tv_nsec - now.tv_nsec) / 1000000;
+    return (left > 0) ? left : 0;
+}
+
+/*
+ * rio_wait - wait until fd is ready for events, within the timeout and
+ *     the deadline. Returns -1 with errno ETIMEDOUT when they run out.
+ */
+static int rio_wait(int fd, short events)
+{
+    struct pollfd pfd;
+    int ms, rc, why, left;
+
+    if (rio_timeout == 0 && rio_deadline.tv_sec == 0)
+        return 0;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do {
+        ms = rio_timeout;
+        why = RIO_TIMEOUT_WAIT;
+        if ((left = rio_time_left()) >= 0) {
+            if (ms == 0 || left <= ms) {
+                ms = left;
+                why = RIO_TIMEOUT_DEADLINE;
+            }
+        }
+        rc = (ms > 0) ? poll(&pfd, 1, ms) : 0;
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0)
+        return -1;
+    if (rc == 0) {
+        if (rio_expired == 0)
+            rio_expired = why;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
  */
@@ -748,6 +858,8 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
+	if (rio_wait(fd, POLLIN) < 0)
+	    return -1;
 	if ((nread = read(fd, bufp, nleft)) < 0) {
 	    if (errno == EINTR) /* Interrupted by sig handler return */
 		nread = 0;      /* and call read() again */
@@ -774,6 +886,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
+	if (rio_wait(fd, POLLOUT) < 0)
+	    return -1;
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* Interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
@@ -802,6 +916,8 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	if (rio_wait(rp->rio_fd, POLLIN) < 0)
+	    return -1;
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
@@ -934,6 +1050,33 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /******************************** 
  * Client/server helper functions
  ********************************/
+/*
+ * connect_timed - connect within the Rio timeout and deadline, if any
+ */
+static int connect_timed(int fd, const SA *addr, socklen_t len)
+{
+    int flags, err;
+    socklen_t errlen = sizeof(err);
+
+    if (rio_timeout == 0 && rio_deadline.tv_sec == 0)
+        return connect(fd, addr, len);
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0
+        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    if (connect(fd, addr, len) < 0) {
+        if (errno != EINPROGRESS || rio_wait(fd, POLLOUT) < 0)
+            return -1;
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+            return -1;
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+    }
+    return fcntl(fd, F_SETFL, flags);
+}
+
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
@@ -960,7 +1103,7 @@ int open_clientfd(char *hostname, char *port) {
             continue; /* Socket failed, try the next */
 
         /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
+        if (connect_timed(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
             break; /* Success */
         Close(clientfd); /* Connect failed, try another */  //line:netp:openclientfd:closefd
     } 
@@ -179,6 +179,15 @@ void rio_readinitb(rio_t *rp, int fd);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
+/* Per-thread timeouts for the Rio package and open_clientfd, in ms */
+#define RIO_TIMEOUT_WAIT     1  /* one wait for the descriptor took too long */
+#define RIO_TIMEOUT_DEADLINE 2  /* the deadline of the whole job passed */
+void rio_set_deadline(int ms);
+void rio_clear_deadline(void);
+void rio_set_timeout(int ms);
+int rio_timedout(void);
+int rio_time_left(void);
+
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t Rio_writen(int fd, void *usrbuf, size_t n);
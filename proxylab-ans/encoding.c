@@ -0,0 +1,276 @@
+/*
+ * encoding.c
+ *	 - map Accept-Encoding onto the variant classes the cache keys on
+ *	 - classify Vary headers
+ *	 - gzip a cached response once, and gunzip it for clients that
+ *	   cannot take gzip
+ *
+ * AndrewID: jiexil
+ * Name: Jiexi Lin
+ * Nickname: railgun
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "csapp.h"
+#include "range.h"
+#include "encoding.h"
+
+#define GZIP_WINDOW (15 + 16)   // zlib window bits with a gzip wrapper
+#define GZIP_LEVEL 6
+
+static int next_token(const char **pp, char *token, double *qp);
+static int copy_head(char *dst, const char *head, int head_size,
+	const char *skip1, const char *skip2);
+
+/*
+ * accept_class - reduce an Accept-Encoding value to one variant class
+ *	 - prefer gzip, then deflate
+ *
+ *	return "gzip", "deflate" or "identity"
+ */
+const char *accept_class(const char *value) {
+	if( value == NULL )
+		return "identity";
+	if( accepts_coding(value, "gzip") )
+		return "gzip";
+	if( accepts_coding(value, "deflate") )
+		return "deflate";
+	return "identity";
+}
+
+/*
+ * accepts_coding - check if an Accept-Encoding value allows a coding
+ *	 - "x-gzip" counts as "gzip", "*" counts as anything
+ *	 - a coding with q=0 is refused even if "*" allows it
+ */
+int accepts_coding(const char *value, const char *coding) {
+	char token[MAXLINE];
+	double q;
+	int star = 0, found = 0;
+
+	while( next_token(&value, token, &q) ) {
+		if( strcasecmp(token, coding) == 0
+			|| (strcasecmp(coding, "gzip") == 0
+				&& strcasecmp(token, "x-gzip") == 0) ) {
+			if( q <= 0 )
+				return 0;
+			found = 1;
+		}
+		else if( strcmp(token, "*") == 0 && q > 0 )
+			star = 1;
+	}
+	return found || star;
+}
+
+/*
+ * vary_class - classify the value of a Vary response header
+ */
+int vary_class(const char *value) {
+	char token[MAXLINE];
+	double q;
+	int class = VARY_NONE;
+
+	if( value == NULL )
+		return VARY_NONE;
+
+	while( next_token(&value, token, &q) ) {
+		if( strcasecmp(token, "Accept-Encoding") == 0 )
+			class = VARY_ENCODING;
+		else
+			return VARY_OTHER;
+	}
+	return class;
+}
+
+/*
+ * is_compressible - check if a Content-Type is worth compressing
+ */
+int is_compressible(const char *type) {
+	if( strncasecmp(type, "text/", strlen("text/")) == 0 )
+		return 1;
+	if( strncasecmp(type, "application/json", strlen("application/json")) == 0
+		|| strncasecmp(type, "application/javascript",
+			strlen("application/javascript")) == 0
+		|| strncasecmp(type, "application/xml", strlen("application/xml")) == 0
+		|| strncasecmp(type, "image/svg+xml", strlen("image/svg+xml")) == 0 )
+		return 1;
+	return 0;
+}
+
+/*
+ * gzip_response - compress the entity of a response
+ *	 - the new head drops Content-Length and adds Content-Encoding,
+ *	   Vary and the compressed Content-Length
+ *	 - *outp is malloc'ed, the caller frees it
+ *
+ *	return -1 on error
+ *	return 0 if compression does not make the response smaller
+ *	return 1 on success
+ */
+int gzip_response(const char *content, int head_size, int size,
+	char **outp, int *outlenp) {
+
+	z_stream zs;
+	char *out, *bp;
+	uLong bound;
+	int body_len = size - head_size, hlen;
+
+	memset(&zs, 0, sizeof(zs));
+	if( deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW,
+			8, Z_DEFAULT_STRATEGY) != Z_OK )
+		return -1;
+
+	bound = deflateBound(&zs, body_len);
+	if((out = (char*)malloc(head_size + MAXLINE + bound)) == NULL ){
+		deflateEnd(&zs);
+		return -1;
+	}
+
+	//Compress straight behind the room reserved for the new head
+	bp = out + head_size + MAXLINE;
+	zs.next_in = (Bytef *)(content + head_size);
+	zs.avail_in = body_len;
+	zs.next_out = (Bytef *)bp;
+	zs.avail_out = bound;
+	if( deflate(&zs, Z_FINISH) != Z_STREAM_END ){
+		deflateEnd(&zs);
+		free(out);
+		return -1;
+	}
+	deflateEnd(&zs);
+
+	if( (int)zs.total_out >= body_len ){
+		free(out);
+		return 0;
+	}
+
+	hlen = copy_head(out, content, head_size, "Content-Length", "Vary");
+	hlen += sprintf(out + hlen, "Content-Encoding: gzip\r\n"
+		"Vary: Accept-Encoding\r\n"
+		"Content-Length: %lu\r\n\r\n", zs.total_out);
+	memmove(out + hlen, bp, zs.total_out);
+
+	*outp = out;
+	*outlenp = hlen + zs.total_out;
+	return 1;
+}
+
+/*
+ * gunzip_response - undo gzip_response for a client without gzip
+ *	 - *outp is malloc'ed, the caller frees it
+ *
+ *	return -1 on error
+ *	return 0 on success
+ */
+int gunzip_response(const char *content, int head_size, int size,
+	char **outp, int *outlenp) {
+
+	z_stream zs;
+	char *out, *new_out;
+	size_t cap = head_size + MAXLINE + 4 * (size - head_size);
+	int rc, hlen;
+
+	memset(&zs, 0, sizeof(zs));
+	if( inflateInit2(&zs, GZIP_WINDOW) != Z_OK )
+		return -1;
+	if((out = (char*)malloc(cap)) == NULL ){
+		inflateEnd(&zs);
+		return -1;
+	}
+
+	//Inflate behind the room reserved for the new head
+	zs.next_in = (Bytef *)(content + head_size);
+	zs.avail_in = size - head_size;
+	zs.next_out = (Bytef *)(out + head_size + MAXLINE);
+	zs.avail_out = cap - head_size - MAXLINE;
+
+	while((rc = inflate(&zs, Z_NO_FLUSH)) == Z_OK ){
+		if( zs.avail_out > 0 )
+			continue;
+		if((new_out = (char*)realloc(out, cap << 1)) == NULL )
+			break;
+		out = new_out;
+		zs.next_out = (Bytef *)(out + cap);
+		zs.avail_out = cap;
+		cap <<= 1;
+	}
+	inflateEnd(&zs);
+
+	if( rc != Z_STREAM_END ){
+		free(out);
+		return -1;
+	}
+
+	hlen = copy_head(out, content, head_size,
+		"Content-Length", "Content-Encoding");
+	hlen += sprintf(out + hlen, "Content-Length: %lu\r\n\r\n", zs.total_out);
+	memmove(out + hlen, out + head_size + MAXLINE, zs.total_out);
+
+	*outp = out;
+	*outlenp = hlen + zs.total_out;
+	return 0;
+}
+
+/*
+ * next_token - get the next comma separated token and its q value
+ *
+ *	return 0 when there is no more token
+ *	return 1 on success
+ */
+static int next_token(const char **pp, char *token, double *qp) {
+	const char *p = *pp, *q;
+	int len = 0;
+
+	while( *p == ' ' || *p == '\t' || *p == ',' )
+		++p;
+	if( *p == 0 )
+		return 0;
+
+	while( *p && *p != ',' && *p != ';' && *p != ' ' && len < MAXLINE - 1 )
+		token[len++] = *p++;
+	token[len] = 0;
+
+	*qp = 1.0;
+	while( *p && *p != ',' ) {
+		if( *p == ';' ) {
+			q = p + 1;
+			while( *q == ' ' )
+				++q;
+			if( strncasecmp(q, "q=", 2) == 0 )
+				*qp = atof(q + 2);
+		}
+		++p;
+	}
+
+	*pp = p;
+	return 1;
+}
+
+/*
+ * copy_head - copy the status line and headers, without the blank line,
+ *	 skipping two header names
+ *
+ *	return the number of bytes copied
+ */
+static int copy_head(char *dst, const char *head, int head_size,
+	const char *skip1, const char *skip2) {
+	const char *p = head, *eol;
+	char *bp = dst;
+
+	while( p < head + head_size ) {
+		if((eol = memchr(p, '\n', head + head_size - p)) == NULL )
+			break;
+		++eol;
+		if( strncmp(p, "\r\n", 2) != 0
+			&& !header_is(p, skip1) && !header_is(p, skip2) ) {
+			memcpy(bp, p, eol - p);
+			bp += eol - p;
+		}
+		p = eol;
+	}
+	return bp - dst;
+}
@@ -0,0 +1,27 @@
+/*
+ * encoding.h
+ *	 - content-coding negotiation and gzip of cached responses
+ * AndrewID: jiexil
+ * Name: Jiexi Lin
+ * Nickname: railgun
+ *
+ */
+#ifndef __ENCODING_H__
+#define __ENCODING_H__
+
+const char *accept_class(const char *value);
+int accepts_coding(const char *value, const char *coding);
+int vary_class(const char *value);
+int is_compressible(const char *type);
+
+int gzip_response(const char *content, int head_size, int size,
+	char **outp, int *outlenp);
+int gunzip_response(const char *content, int head_size, int size,
+	char **outp, int *outlenp);
+
+//vary_class results
+#define VARY_NONE 0			//no Vary header
+#define VARY_ENCODING 1		//varies on Accept-Encoding only
+#define VARY_OTHER 2		//varies on headers the cache does not key on
+
+#endif /* __ENCODING_H__ */
@@ -0,0 +1,287 @@
+/*
+ * origin.c
+ *	 - admission control for fetches from each origin server
+ *	 - a token bucket limits the rate of new fetches per origin
+ *	 - a cap limits the fetches in flight per origin
+ *	 - a fetch that cannot go now queues until max_wait ms have passed,
+ *	   and fails at once if too many fetches are queued already
+ *	 - an origin nobody uses and whose bucket is full is freed, a new
+ *	   one would be the same, so naming many hosts grows nothing
+ *
+ * AndrewID: jiexil
+ * Name: Jiexi Lin
+ * Nickname: railgun
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "csapp.h"
+#include "origin.h"
+
+static origin_t *find_origin(origin_table_t *tp, const char *key,
+	struct timespec *now);
+static void drop_origin(origin_table_t *tp, origin_t *op);
+static int idle(origin_table_t *tp, origin_t *op, struct timespec *now);
+static void refill(origin_table_t *tp, origin_t *op, struct timespec *now);
+static int ready(origin_table_t *tp, origin_t *op);
+static void add_ms(struct timespec *ts, double ms);
+static int before(struct timespec *a, struct timespec *b);
+static unsigned int hash(const char *s);
+
+//handed out when there are no limits, without a table entry
+static origin_t unlimited;
+
+/*
+ * init_origins - set up the origin table
+ *	 - max_inflight: fetches in flight per origin, 0 for no cap
+ *	 - rate: fetches started per second per origin, 0 for no limit,
+ *	   with bursts of up to one second's worth (at least one)
+ *	 - max_wait: ms a fetch may queue before it fails
+ *
+ *	return -1 on error
+ *	return 0 on success
+ */
+int init_origins(origin_table_t *tp, int max_inflight,
+	double rate, int max_wait) {
+
+	memset(tp->buckets, 0, sizeof(tp->buckets));
+	if( pthread_mutex_init(&tp->mutex, NULL) != 0 )
+		return -1;
+	tp->max_inflight = max_inflight;
+	tp->rate = rate;
+	tp->burst = (rate > 1) ? rate : 1;
+	tp->max_wait = max_wait;
+	tp->rejected = 0;
+	return 0;
+}
+
+/*
+ * origin_acquire - wait for a slot and a token to fetch from host:port
+ *	 - queue for max_wait ms at most, or limit ms if that is sooner
+ *	   (the time left to the caller's deadline, -1 for none)
+ *	 - the returned origin must be passed to origin_release
+ *	 - with no cap and no rate limit, it returns at once without the
+ *	   table lock, and no origin is kept
+ *
+ *	return NULL if the fetch was refused or timed out
+ */
+origin_t *origin_acquire(origin_table_t *tp,
+	const char *host, const char *port, int limit) {
+
+	char key[MAXLINE], *p;
+	origin_t *op;
+	struct timespec now, deadline, wake;
+	int max_wait = tp->max_wait;
+
+	if( tp->max_inflight == 0 && tp->rate == 0 )
+		return &unlimited;
+
+	//Host names are case insensitive, as in the cache ids
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+	for( p = key; *p; ++p )
+		*p = tolower(*p);
+
+	pthread_mutex_lock(&tp->mutex);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if((op = find_origin(tp, key, &now)) == NULL ){
+		pthread_mutex_unlock(&tp->mutex);
+		return NULL;
+	}
+	refill(tp, op, &now);
+
+	//Fast path: nobody queued ahead of us and the origin has room
+	if( op->waiting == 0 && ready(tp, op) )
+		goto admit;
+
+	if( limit >= 0 && limit < max_wait )
+		max_wait = limit;
+
+	//Fail fast instead of piling up behind a stuck origin
+	if( op->waiting >= ORIGIN_MAX_QUEUE || max_wait <= 0 ) {
+		++tp->rejected;
+		pthread_mutex_unlock(&tp->mutex);
+		return NULL;
+	}
+
+	deadline = now;
+	add_ms(&deadline, max_wait);
+	++op->waiting;
+	while( !ready(tp, op) ) {
+		if( !before(&now, &deadline) ) {
+			--op->waiting;
+			++tp->rejected;
+			pthread_mutex_unlock(&tp->mutex);
+			return NULL;
+		}
+
+		//Out of tokens: sleep until the next one, a release can't help
+		wake = deadline;
+		if( tp->rate > 0 && op->tokens < 1 ) {
+			wake = now;
+			add_ms(&wake, (1 - op->tokens) * 1000 / tp->rate);
+			if( before(&deadline, &wake) )
+				wake = deadline;
+		}
+		pthread_cond_timedwait(&op->cond, &tp->mutex, &wake);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		refill(tp, op, &now);
+	}
+	--op->waiting;
+
+admit:
+	if( tp->rate > 0 )
+		op->tokens -= 1;
+	++op->inflight;
+	pthread_mutex_unlock(&tp->mutex);
+	return op;
+}
+
+/*
+ * origin_release - give back the slot taken by origin_acquire
+ *	 - op is freed if that leaves it idle
+ */
+void origin_release(origin_table_t *tp, origin_t *op) {
+	struct timespec now;
+
+	if( op == NULL || op == &unlimited )
+		return;
+	pthread_mutex_lock(&tp->mutex);
+	--op->inflight;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if( op->waiting > 0 )
+		pthread_cond_signal(&op->cond);
+	else if( idle(tp, op, &now) )
+		drop_origin(tp, op);
+	pthread_mutex_unlock(&tp->mutex);
+}
+
+/*
+ * find_origin - find the origin of key, create it on first use
+ *	 - the idle origins passed on the way are freed, one released
+ *	   with tokens to earn back goes the next time its chain is walked
+ *	 - caller holds tp->mutex
+ *
+ *	return NULL on error
+ */
+static origin_t *find_origin(origin_table_t *tp, const char *key,
+	struct timespec *now) {
+
+	unsigned int h = hash(key) % ORIGIN_HASHSIZE;
+	pthread_condattr_t attr;
+	origin_t *op, **pp;
+
+	for( pp = &tp->buckets[h]; (op = *pp) != NULL; ) {
+		if( strcmp(op->key, key) == 0 )
+			return op;
+		//drop_origin leaves the next origin in *pp
+		if( idle(tp, op, now) )
+			drop_origin(tp, op);
+		else
+			pp = &op->next;
+	}
+
+	if((op = (origin_t*)malloc(sizeof(origin_t))) == NULL )
+		return NULL;
+	if((op->key = strdup(key)) == NULL ){
+		free(op);
+		return NULL;
+	}
+
+	//Deadlines are taken from the monotonic clock
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&op->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	op->inflight = 0;
+	op->waiting = 0;
+	op->tokens = tp->burst;
+	op->last = *now;
+	op->next = tp->buckets[h];
+	tp->buckets[h] = op;
+	return op;
+}
+
+/*
+ * drop_origin - unlink op from its chain and free it
+ *	 - caller holds tp->mutex, and nobody else holds op
+ */
+static void drop_origin(origin_table_t *tp, origin_t *op) {
+	origin_t **pp = &tp->buckets[hash(op->key) % ORIGIN_HASHSIZE];
+
+	while( *pp != op )
+		pp = &(*pp)->next;
+	*pp = op->next;
+	pthread_cond_destroy(&op->cond);
+	free(op->key);
+	free(op);
+}
+
+/*
+ * idle - check if op is unused and as good as new: nothing in flight,
+ *	 nobody queued, and a full bucket
+ */
+static int idle(origin_table_t *tp, origin_t *op, struct timespec *now) {
+	if( op->inflight > 0 || op->waiting > 0 )
+		return 0;
+	refill(tp, op, now);
+	return tp->rate <= 0 || op->tokens >= tp->burst;
+}
+
+/*
+ * refill - add the tokens earned since the last refill
+ */
+static void refill(origin_table_t *tp, origin_t *op, struct timespec *now) {
+	double elapsed;
+
+	if( tp->rate <= 0 )
+		return;
+	elapsed = (now->tv_sec - op->last.tv_sec)
+		+ (now->tv_nsec - op->last.tv_nsec) / 1e9;
+	op->tokens += elapsed * tp->rate;
+	if( op->tokens > tp->burst )
+		op->tokens = tp->burst;
+	op->last = *now;
+}
+
+/*
+ * ready - check if a fetch from op may start now
+ */
+static int ready(origin_table_t *tp, origin_t *op) {
+	if( tp->max_inflight > 0 && op->inflight >= tp->max_inflight )
+		return 0;
+	if( tp->rate > 0 && op->tokens < 1 )
+		return 0;
+	return 1;
+}
+
+static void add_ms(struct timespec *ts, double ms) {
+	long ns = (long)(ms * 1000000);
+
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec += ns % 1000000000;
+	if( ts->tv_nsec >= 1000000000 ) {
+		++ts->tv_sec;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int before(struct timespec *a, struct timespec *b) {
+	if( a->tv_sec != b->tv_sec )
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+//djb2
+static unsigned int hash(const char *s) {
+	unsigned int h = 5381;
+
+	while( *s )
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
@@ -0,0 +1,45 @@
+/*
+ * origin.h
+ *	 - per-origin admission control for upstream fetches
+ * AndrewID: jiexil
+ * Name: Jiexi Lin
+ * Nickname: railgun
+ *
+ */
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include "csapp.h"
+
+#define ORIGIN_HASHSIZE 131
+#define ORIGIN_MAX_QUEUE 64		//waiters per origin before failing fast
+
+//one origin server, host:port
+typedef struct origin_t {
+	char *key;
+	int inflight;			//fetches holding a slot
+	int waiting;			//fetches queued for a slot or a token
+	double tokens;			//token bucket
+	struct timespec last;	//last refill of the bucket
+	pthread_cond_t cond;
+	struct origin_t *next;
+} origin_t;
+
+//all the origins, with the limits shared by every origin
+typedef struct {
+	origin_t *buckets[ORIGIN_HASHSIZE];
+	pthread_mutex_t mutex;
+	int max_inflight;		//0: no cap
+	double rate;			//tokens per second, 0: no limit
+	double burst;			//bucket size
+	int max_wait;			//ms a fetch may queue
+	unsigned long rejected;	//fetches refused or timed out
+} origin_table_t;
+
+int init_origins(origin_table_t *tp, int max_inflight,
+	double rate, int max_wait);
+origin_t *origin_acquire(origin_table_t *tp,
+	const char *host, const char *port, int limit);
+void origin_release(origin_table_t *tp, origin_t *op);
+
+#endif /* __ORIGIN_H__ */
@@ -4,6 +4,11 @@
  *	 - Only handles the GET method
  *   - Concurrent threads
  *   - Loose LRU cache
+ *   - Optional io_uring engine (-e uring) for accept and cache hits
+ *   - Vary: Accept-Encoding aware cache, optional gzip of text (-z)
+ *   - Per-origin rate limit (-r) and in-flight cap (-c) for fetches
+ *   - Connect, first byte, idle and total timeouts (-t), counted per
+ *     phase and printed on SIGUSR1
  *
  * AndrewID: jiexil
  * Name: Jiexi Lin
@@ -16,6 +21,10 @@
 #include <string.h>
 #include "csapp.h"
 #include "cache.h"
+#include "range.h"
+#include "encoding.h"
+#include "uring.h"
+#include "origin.h"
 
 //#define DEBUG 
 
@@ -50,131 +59,365 @@ typedef struct {
     size_t capacity;
 } web_object;
 
+typedef struct {
+    web_object raw;         // header lines as received, without the end
+    char range[MAXLINE];    // value of the Range header, "" if none
+    char accept[MAXLINE];   // value of the Accept-Encoding header
+} request_hdrs;
+
+//what the cache needs to know about a response
+typedef struct {
+    int status;
+    int has_entity;
+    int entity_len;
+    char crange[MAXLINE];   // Content-Range
+    char vary[MAXLINE];
+    char encoding[MAXLINE]; // Content-Encoding
+    char type[MAXLINE];     // Content-Type
+} response_info;
+
+//timeouts in ms, 0 for none
+typedef struct {
+    int connect;        // opening the origin connection, sending the request
+    int first_byte;     // waiting for the first byte of the response
+    int idle;           // any other wait on a client or origin socket
+    int total;          // the whole request, from its first byte
+} timeouts_t;
+
+//what a timed out request was waiting for
+#define TO_REQUEST    0
+#define TO_CONNECT    1
+#define TO_FIRST_BYTE 2
+#define TO_IDLE       3
+#define TO_TOTAL      4
+#define TO_NPHASES    5
+
+//an error response may wait this long for the client, past the deadline
+#define ERROR_TIMEOUT 1000
+
+//io_uring engine settings
+#define UR_ENTRIES 256          // submission ring size
+#define UR_NBUFS   64           // registered read buffers, one per connection
+#define UR_CQE_SQES 3           // most sqes one completion queues (accept)
+
+//io_uring request types, kept in the low bits of user_data
+#define UR_ACCEPT 0
+#define UR_READ   1
+#define UR_WRITE  2
+#define UR_CLOSE  3
+#define UR_DATA(cp, op)  ((unsigned long long)(unsigned long)(cp) | (op))
+#define UR_CONN(data)    ((uconn_t *)(unsigned long)((data) & ~3ULL))
+#define UR_OP(data)      ((int)((data) & 3))
+
+//a connection owned by the io_uring engine
+typedef struct {
+    int fd;
+    int slot;           // index of its registered read buffer, -1 if none
+    size_t len;         // request bytes read into the buffer
+    char *resp;         // copy of the cached object being written
+    size_t resp_len;
+    size_t resp_off;
+} uconn_t;
+
+//io_uring engine state
+typedef struct {
+    uring_t ring;
+    char *bufs;                 // UR_NBUFS x RIO_BUFSIZE, registered
+    int free_slots[UR_NBUFS];
+    int nfree;
+    int listenfd;
+    struct __kernel_timespec read_ts;   // idle timeout of request reads
+    int err;                    // errno that stopped the engine, 0 if none
+} uengine_t;
+
 //Function prototype
+static void run_thread_engine(int listenfd);
+static void spawn_client_thread(rio_t *rp);
 static void* thread_job(void *vargp);
+static void handle_client(rio_t *rp);
 static int read_parse_request_line(request_line *rlp, rio_t *rp);
-static int client2server(request_line *rlp, rio_t *rp);
+static int parse_request_line(request_line *rlp, char *buf);
+static int read_request_headers(request_hdrs *hp, rio_t *rp);
+static int client2server(request_line *rlp, request_hdrs *hp);
 static int server2client(int clientfd, int serverfd, 
-    web_object *wbp, cid_t *cid);
+    web_object *wbp, cid_t *cid, cid_t *vcid);
+static int cache_response(web_object *wbp, int head_size, 
+    response_info *ip, cid_t *cid, cid_t *vcid);
 static int handle_request_header(int serverfd, char *buf, int nread);
+static void send_busy(int clientfd);
+static void send_timeout(int clientfd);
+static void send_error(int clientfd, const char *msg);
+static void count_timeout(int phase);
+static void print_timeouts(int sig);
 
 static int init_web_object(web_object *wbp);
 static int update_web_object(web_object *wbp, char *buf, ssize_t l);
 static void destory_web_object(web_object *wbp);
-static int parse_response_line(char *rl, int *e);
-static int parse_response_header(char *buf, int *ep, int *elp);
+static int parse_response_line(char *rl, response_info *ip);
+static int parse_response_header(char *buf, response_info *ip);
+
+static int run_uring_engine(int listenfd);
+static struct io_uring_sqe *uring_sqe(uengine_t *ep);
+static void uring_on_accept(uengine_t *ep, int fd);
+static void uring_submit_read(uengine_t *ep, uconn_t *cp);
+static void uring_on_read(uengine_t *ep, uconn_t *cp, int res);
+static void uring_dispatch(uengine_t *ep, uconn_t *cp);
+static void uring_submit_write(uengine_t *ep, uconn_t *cp);
+static void uring_on_write(uengine_t *ep, uconn_t *cp, int res);
+static void uring_close(uengine_t *ep, uconn_t *cp);
+static void uring_release_slot(uengine_t *ep, uconn_t *cp);
+static void uring_reserve(uengine_t *ep, unsigned n);
+static int has_head_end(const char *buf, size_t len);
 
 //Global variable
 cache_t cache;
+int gzip_text = 0;      // gzip compressible responses before caching
+origin_table_t origins;
+timeouts_t timeouts = { 5000, 30000, 30000, 300000 };
+unsigned long timed_out[TO_NPHASES];    // requests timed out, per phase
+unsigned long requests;                 // requests parsed, on either engine
+
+#define USAGE "usage: %s [-z] [-e thread|uring] [-c conns] [-r rate] " \
+    "[-w ms] [-t connect,first_byte,idle,total] <port>\n"
 
 int main( int argc, char *argv[] ) {
-    int listenfd, *connfdp;
-    socklen_t clientlen;
-    pthread_t tid;
-    struct sockaddr_in clientaddr;
+    int listenfd, c;
+    char *engine = "thread";
+    int max_inflight = 0, max_wait = 2000;
+    double rate = 0;
 
     //ignore SIGPIPE
     Signal(SIGPIPE, SIG_IGN);
+    //SIGUSR1 prints the timeout counters
+    Signal(SIGUSR1, print_timeouts);
 
     //init cache
     if(init_cache(&cache) < 0)
         return 1;
 
     //check arguments
-    if( argc != 2 ){
-    	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while((c = getopt(argc, argv, "e:zc:r:w:t:")) != -1) {
+        switch(c) {
+        case 'e':
+            engine = optarg;
+            break;
+        case 'z':
+            gzip_text = 1;
+            break;
+        case 'c':
+            max_inflight = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'w':
+            max_wait = atoi(optarg);
+            break;
+        case 't':
+            if( sscanf(optarg, "%d,%d,%d,%d", &timeouts.connect,
+                    &timeouts.first_byte, &timeouts.idle,
+                    &timeouts.total) != 4 ) {
+                fprintf(stderr, USAGE, argv[0]);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if( optind != argc - 1 ||
+        (strcmp(engine, "thread") != 0 && strcmp(engine, "uring") != 0) ||
+        max_inflight < 0 || rate < 0 ){
+    	fprintf(stderr, USAGE, argv[0]);
     	exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    //init the per-origin limits
+    if( init_origins(&origins, max_inflight, rate, max_wait) < 0 )
+        return 1;
+
+    listenfd = Open_listenfd(argv[optind]);
     if( listenfd < 0 ) {
-    	fprintf(stderr, "Cannot open the port: %s\n", argv[1]);
+    	fprintf(stderr, "Cannot open the port: %s\n", argv[optind]);
     	exit(1);
     }
 
+    //Only returns if io_uring cannot be used at all
+    if( strcmp(engine, "uring") == 0 && run_uring_engine(listenfd) < 0 )
+        fprintf(stderr, "io_uring unavailable, use blocking threads\n");
+
+    run_thread_engine(listenfd);
+
+    destroy_cache(&cache);
+    return 0;
+}
+
+/*
+ * run_thread_engine - the blocking accept loop, one thread per client
+ */
+static void run_thread_engine(int listenfd) {
+    int connfd;
+    rio_t *rp;
+    socklen_t clientlen;
+    struct sockaddr_in clientaddr;
+
     while(1) {
+        clientlen = sizeof(clientaddr);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        dbg_printf("Accept client on fd %d\n", connfd);
 
-        if((connfdp = (int*)malloc(sizeof(int))) == NULL ){
+        if((rp = (rio_t*)malloc(sizeof(rio_t))) == NULL ){
             fprintf(stderr, "malloc failed, ignore current request\n");
+            Close(connfd);
             continue;
         }
-
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        dbg_printf("Accept client on fd %d\n", *connfdp);
-
-        Pthread_create(&tid, NULL, (void *)thread_job, (void *)connfdp);
+        Rio_readinitb(rp, connfd);
+        spawn_client_thread(rp);
     }
+}
 
-    destroy_cache(&cache);
-    return 0;
+/*
+ * spawn_client_thread - serve a client in its own detached thread
+ *   - the thread owns rp and the descriptor in it
+ *   - rp may already hold request bytes read by the io_uring engine
+ */
+static void spawn_client_thread(rio_t *rp) {
+    pthread_t tid;
+
+    Pthread_create(&tid, NULL, thread_job, (void *)rp);
 }
 
 /*
  * thread_job - the thread routine that handles the http request
+ */
+static void *thread_job( void *vargp ) {
+    dbg_enter();
+
+    rio_t *rp = (rio_t *)vargp;
+
+    Pthread_detach(pthread_self());
+    handle_client(rp);
+
+    Close(rp->rio_fd);
+    Free(rp);
+    dbg_exit();
+    return NULL;
+}
+
+/*
+ * handle_client - handle one http request on the blocking path
  *   - parse the request line
  *   - search the cache and forward the cached content if hit
  *   - if cache miss, get the resource from server and update the cache
+ *   - the caller closes the client descriptor
  */
-static void *thread_job( void *vargp ) {
+static void handle_client( rio_t *rp ) {
     dbg_enter();
 
-    Pthread_detach(pthread_self());
-    int clientfd = *(int *)vargp;
+    int clientfd = rp->rio_fd;
     int serverfd = -1, rc;
     web_object wb;
-    cid_t cid;
-    rio_t rio;
+    cid_t cid, vcid;
     request_line rl;    
-    
-    Free(vargp);
-    Rio_readinitb(&rio, clientfd);
+    request_hdrs hdrs;
+    int accept_gzip;
+    origin_t *op;
+    int phase = TO_REQUEST;
+
+    //Every socket operation below runs within the total deadline
+    rio_set_deadline(timeouts.total);
+    rio_set_timeout(timeouts.idle);
 
     //Parse the request line
-    if(read_parse_request_line(&rl, &rio) < 0 ) {
+    if(read_parse_request_line(&rl, rp) < 0 ) {
         fprintf(stderr, "bad request line\n");
-        Close(clientfd);
         dbg_printf("error and thread exit\n");
-        Pthread_exit(NULL);
+        if( rio_timedout() )
+            count_timeout(TO_REQUEST);
+        return;
     }
+    __sync_fetch_and_add(&requests, 1);
     //non-GET
     if( strcmp("GET", rl.method) != 0 ){
         dbg_printf("non-GET: %s\n", rl.method);
-        Close(clientfd);
-        Pthread_exit(NULL);
+        return;
+    }
+    //The cache needs the Range header, so read the headers first
+    if( init_web_object(&hdrs.raw) < 0 )
+        return;
+    if( read_request_headers(&hdrs, rp) < 0 ) {
+        fprintf(stderr, "bad request headers\n");
+        if( rio_timedout() )
+            count_timeout(TO_REQUEST);
+        destory_web_object(&hdrs.raw);
+        return;
     }
-    //Only handle GET method
-    gen_cid(&cid, rl.host, rl.port, rl.path);
 
-    //Check if cache hit
-    rc = try_from_cache(&cache, clientfd, &cid);
+    //Only handle GET method
+    //The variant key holds responses that Vary on Accept-Encoding
+    gen_cid(&cid, rl.host, rl.port, rl.path, NULL);
+    gen_cid(&vcid, rl.host, rl.port, rl.path, accept_class(hdrs.accept));
+    accept_gzip = accepts_coding(hdrs.accept, "gzip");
+
+    //Check if cache hit, the variant first
+    phase = TO_IDLE;
+    rc = try_from_cache(&cache, clientfd, &vcid,
+        hdrs.range[0] ? hdrs.range : NULL, accept_gzip);
+    if( rc == 0 )
+        rc = try_from_cache(&cache, clientfd, &cid,
+            hdrs.range[0] ? hdrs.range : NULL, accept_gzip);
     if( rc == -1 ) {
         //error
         fprintf(stderr,"error when trying cache\n");
-        Close(clientfd);
-        Pthread_exit(NULL);
     }
     else if( rc == 0 ) {
-        //Cache miss. Send request to the server
-        if((serverfd = client2server(&rl, &rio)) < 0 ) {
+        //Cache miss. Wait for the origin to take one more fetch
+        op = origin_acquire(&origins, rl.host, rl.port, rio_time_left());
+        if( op == NULL ) {
+            fprintf(stderr, "origin %s:%s busy\n", rl.host, rl.port);
+            send_busy(clientfd);
+            destory_web_object(&hdrs.raw);
+            return;
+        }
+
+        //Send request to the server
+        phase = TO_CONNECT;
+        if((serverfd = client2server(&rl, &hdrs)) < 0 ) {
             fprintf(stderr, "error forwarding to server\n");
-            Close(clientfd);
             dbg_printf("error and thread exit\n");
-            Pthread_exit(NULL);
+            origin_release(&origins, op);
+            if( rio_timedout() ) {
+                count_timeout(phase);
+                send_timeout(clientfd);
+            }
+            destory_web_object(&hdrs.raw);
+            return;
         }
 
         //Get resource from server and update the cache
+        phase = TO_FIRST_BYTE;
+        rio_set_timeout(timeouts.first_byte);
         init_web_object(&wb);
-        if(server2client(clientfd, serverfd, &wb, &cid) < 0 )
+        if(server2client(clientfd, serverfd, &wb, &cid, &vcid) < 0 ) {
             fprintf(stderr, "error forwarding to client\n");
+            //Nothing has reached the client if the origin never answered
+            if( wb.length > 0 )
+                phase = TO_IDLE;
+            else if( rio_timedout() )
+                send_timeout(clientfd);
+        }
         destory_web_object(&wb);
         Close(serverfd);
+        origin_release(&origins, op);
     }
 
-    Close(clientfd);
+    if( rio_timedout() )
+        count_timeout(phase);
+    rio_set_deadline(0);
+    rio_set_timeout(0);
+    destory_web_object(&hdrs.raw);
     dbg_exit();
-    Pthread_exit(NULL);
-    
-    return NULL;
 }
 
 /*
@@ -189,21 +432,35 @@ static int read_parse_request_line(request_line *rlp, rio_t *rp){
     dbg_enter();
 
     char buf[MAXLINE] = "";
+    ssize_t len;
+
+    if( (len = Rio_readlineb(rp, buf, MAXLINE)) <= 0 ){
+        fprintf(stderr, "error: bad request line\n");
+        return -1;
+    }
+
+    dbg_exit();
+    return parse_request_line(rlp, buf);
+}
+
+/*
+ * parse_request_line - parse a request line already read into buf
+ *   - shared by the blocking path and the io_uring engine
+ * 
+ * return -1 when fails
+ * return 0 when success
+ */
+static int parse_request_line(request_line *rlp, char *buf){
+    dbg_enter();
+
     char uri[MAXLINE] = "";
     char host_port[MAXLINE] = "";
-    ssize_t len;
 
     rlp->method[0] = 0;
     rlp->host[0] = 0;
     strcpy(rlp->path, "/");
     strcpy(rlp->port, "80");
     rlp->version[0] = 0;
-    
-
-    if( (len = Rio_readlineb(rp, buf, MAXLINE)) <= 0 ){
-        fprintf(stderr, "error: bad request line\n");
-        return -1;
-    }
 
     dbg_printf("Request Line: %s\n", buf);
     if( sscanf(buf, "%[^ ] %[^ ] %s", rlp->method, uri, rlp->version) != 3){
@@ -223,6 +480,40 @@ static int read_parse_request_line(request_line *rlp, rio_t *rp){
     return 0;
 }
 
+/*
+ * read_request_headers - read the request headers from the client
+ *   - keep the raw header lines for forwarding
+ *   - pick out the Range header
+ * 
+ * return -1 on failing
+ * return 0 on succeed
+ */
+static int read_request_headers(request_hdrs *hp, rio_t *rp) {
+    dbg_enter();
+
+    char buf[MAXLINE] = "";
+    ssize_t nread;
+
+    hp->range[0] = 0;
+    hp->accept[0] = 0;
+
+    if((nread = Rio_readlineb(rp, buf, MAXLINE)) <= 0)
+        return -1;
+
+    while(strcmp(buf, "\r\n") != 0 ) {
+        header_value(buf, "Range", hp->range);
+        header_value(buf, "Accept-Encoding", hp->accept);
+        if( update_web_object(&hp->raw, buf, nread) < 0 )
+            return -1;
+
+        if((nread=Rio_readlineb(rp, buf, MAXLINE)) <= 0)
+            return -1;
+    }
+
+    dbg_exit();
+    return 0;
+}
+
 /*
  * client2server - Forward the client http request to the server
  *   - Open the server socket
@@ -234,15 +525,17 @@ static int read_parse_request_line(request_line *rlp, rio_t *rp){
  * return -1 on failing
  * return 0 on succeed
  */
-static int client2server( request_line *rlp, rio_t *rp) {
+static int client2server( request_line *rlp, request_hdrs *hp) {
     dbg_enter();
 
     int serverfd;
     char buf[MAXLINE] = "";
     int have_host = 0, type;
+    char *p, *eol, *end;
     ssize_t nread = 0;
 
     //Open the socket to server. May have unhandled error
+    rio_set_timeout(timeouts.connect);
     serverfd = Open_clientfd(rlp->host, rlp->port);
     if( serverfd < 0 ){
         return -1;
@@ -269,20 +562,21 @@ static int client2server( request_line *rlp, rio_t *rp) {
                 strlen(proxy_connection_hdr)) < 0)
         return -1;
 
+    //Forward the headers read by read_request_headers, line by line
+    end = hp->raw.content + hp->raw.length;
+    for( p = hp->raw.content; p < end; p = eol + 1 ) {
+        if((eol = memchr(p, '\n', end - p)) == NULL )
+            eol = end - 1;
+        nread = eol - p + 1;
+        memcpy(buf, p, nread);
+        buf[nread] = 0;
 
-    if((nread = Rio_readlineb(rp, buf, MAXLINE)) <= 0)
-        return -1;
-
-    while(strcmp(buf, "\r\n") != 0 ) {
         type = handle_request_header(serverfd, buf, nread);
 
         if( type == -1 )
             return -1;
         else if( type == 1 )
             have_host = 1;
-        
-        if((nread=Rio_readlineb(rp, buf, MAXLINE)) <= 0)
-            return -1;
     }
 
     //Print the Host header at the end
@@ -340,6 +634,72 @@ static int handle_request_header(int serverfd, char *buf, int nread) {
     dbg_exit();
 }
 
+/*
+ * send_busy - tell the client the origin will not take its fetch now
+ */
+static void send_busy(int clientfd) {
+    static const char *busy = "HTTP/1.0 503 Service Unavailable\r\n"
+        "Retry-After: 1\r\n"
+        "Content-Length: 0\r\n\r\n";
+
+    send_error(clientfd, busy);
+}
+
+/*
+ * send_timeout - tell the client the origin did not answer in time
+ */
+static void send_timeout(int clientfd) {
+    static const char *timeout = "HTTP/1.0 504 Gateway Timeout\r\n"
+        "Content-Length: 0\r\n\r\n";
+
+    send_error(clientfd, timeout);
+}
+
+/*
+ * send_error - write an error response to the client
+ *   - the deadline may have passed already, so it is lifted and the
+ *     write gets ERROR_TIMEOUT ms of its own
+ *   - rio_timedout() keeps the reason the request timed out
+ */
+static void send_error(int clientfd, const char *msg) {
+    rio_clear_deadline();
+    rio_set_timeout(ERROR_TIMEOUT);
+    Rio_writen(clientfd, (void *)msg, strlen(msg));
+}
+
+/*
+ * count_timeout - account a request that timed out
+ *   - the whole deadline running out is counted as TO_TOTAL
+ */
+static void count_timeout(int phase) {
+    if( rio_timedout() == RIO_TIMEOUT_DEADLINE )
+        phase = TO_TOTAL;
+    __sync_fetch_and_add(&timed_out[phase], 1);
+}
+
+/*
+ * print_timeouts - SIGUSR1 handler, print the timeout counters
+ */
+static void print_timeouts(int sig) {
+    static const char *names[TO_NPHASES] = 
+        { "request", "connect", "first byte", "idle", "total" };
+    int i;
+
+    Sio_puts("requests: ");
+    Sio_putl(requests);
+    Sio_puts("\n");
+    for( i = 0; i < TO_NPHASES; ++i ) {
+        Sio_puts("timed out (");
+        Sio_puts((char *)names[i]);
+        Sio_puts("): ");
+        Sio_putl(timed_out[i]);
+        Sio_puts("\n");
+    }
+    Sio_puts("refused by origin limits: ");
+    Sio_putl(origins.rejected);
+    Sio_puts("\n");
+}
+
 /*
  * server2client - forward the server's response to client
  *   - update the cache
@@ -349,12 +709,13 @@ static int handle_request_header(int serverfd, char *buf, int nread) {
  * return 0 on success
  */
 static int server2client(int clientfd, int serverfd, 
-    web_object *wbp, cid_t *cid) {
+    web_object *wbp, cid_t *cid, cid_t *vcid) {
     dbg_enter();
 
-    ssize_t nread, total_read = 0;
+    ssize_t nread, total_read = 0, head_size;
     char buf[MAXLINE] = "";
-    int has_entity = 1, entity_len = -1, nleft, cache_it = 1;
+    int nleft, cache_it = 1;
+    response_info info;
 
     rio_t rio;
     Rio_readinitb(&rio, serverfd);
@@ -362,8 +723,10 @@ static int server2client(int clientfd, int serverfd,
     //Handling response line and headers
     if( (total_read = Rio_readlineb(&rio, buf, MAXLINE)) < 0 )
         return -1;
+    //The origin has answered, the rest only has to keep moving
+    rio_set_timeout(timeouts.idle);
     //Parse the response line, cache it and send to client
-    if (parse_response_line(buf,&has_entity) < 0 ) 
+    if (parse_response_line(buf, &info) < 0 ) 
         return -1;
     if( total_read > MAX_OBJECT_SIZE ){
         cache_it = 0;
@@ -389,17 +752,18 @@ static int server2client(int clientfd, int serverfd,
             return -1;
         }
 
-        if( parse_response_header(buf, &has_entity, &entity_len) < 0 ){
+        if( parse_response_header(buf, &info) < 0 ){
             return -1;
         }
         if( Rio_writen(clientfd, buf, nread) < 0 )
             return -1;
     }while(strcmp(buf, "\r\n") != 0);
+    head_size = total_read;
 
     //Handle the entity
-    if( has_entity == 1 && entity_len != 0 ) {
-        nleft = entity_len;
-        while( nread > 0 || entity_len == -1 ){
+    if( info.has_entity == 1 && info.entity_len != 0 ) {
+        nleft = info.entity_len;
+        while( nread > 0 || info.entity_len == -1 ){
             nread = Rio_readnb(&rio, buf, MAXLINE);
             if( nread == 0 )
                 break;
@@ -420,20 +784,67 @@ static int server2client(int clientfd, int serverfd,
         }
     }
 
-    if( entity_len > 0 && nleft != 0 ) {
+    if( info.entity_len > 0 && nleft != 0 ) {
         fprintf(stderr, "error: entity length miss matched\n" );
         return -1;
     }
 
-    //Cache the web object
-    if( cache_it ){
-        if(update_cache(&cache, cid, wbp->content, wbp->length) < 0 )
-            return -1;
-    }
+    if( cache_it && cache_response(wbp, head_size, &info, cid, vcid) < 0 )
+        return -1;
     dbg_exit();
     return 0;
 }
 
+/*
+ * cache_response - put a complete response into the cache
+ *   - Vary on other headers than Accept-Encoding: not cached
+ *   - Vary: Accept-Encoding or a Content-Encoding: under the variant key
+ *   - a single part 206: as a segment of the entity
+ *   - a compressible 200 when -z is on: gzipped once, under the plain key
+ *
+ * return -1 on error
+ * return 0 on success
+ */
+static int cache_response(web_object *wbp, int head_size, 
+    response_info *ip, cid_t *cid, cid_t *vcid) {
+    dbg_enter();
+
+    int vary = vary_class(ip->vary[0] ? ip->vary : NULL);
+    cid_t *key = cid;
+    long first, last, total;
+    char *gz;
+    int gz_len, rc;
+
+    if( vary == VARY_OTHER )
+        return 0;
+    if( vary == VARY_ENCODING || ip->encoding[0] )
+        key = vcid;
+
+    if( ip->status == 206 ){
+        if( ip->crange[0] 
+            && parse_content_range(ip->crange, &first, &last, &total) == 0
+            && last - first + 1 == (long)(wbp->length - head_size) )
+            return update_cache_range(&cache, key, wbp->content, head_size,
+                first, wbp->content + head_size, 
+                wbp->length - head_size, total);
+        return 0;
+    }
+
+    if( gzip_text && key == cid && ip->status == 200 
+        && is_compressible(ip->type) ){
+        rc = gzip_response(wbp->content, head_size, wbp->length, 
+            &gz, &gz_len);
+        if( rc == 1 ){
+            rc = update_cache(&cache, cid, gz, gz_len, 1);
+            free(gz);
+            return rc;
+        }
+    }
+
+    dbg_exit();
+    return update_cache(&cache, key, wbp->content, wbp->length, 0);
+}
+
 /*
  * init_web_object - initialize the web object
  *   - init buffer length is MAXLINE
@@ -500,19 +911,27 @@ static void destory_web_object( web_object *wbp ) {
 
 /*
  * parse_response_line - parse the response line stored in rl
+ *   - reset the response info
  *   - check if the response type has entity
- *   - store the check result at *e
+ *   - store the status code
  *
  * return -1 on error
  * return 0 on success
  */
-static int parse_response_line(char *rl, int *e) {
+static int parse_response_line(char *rl, response_info *ip) {
     dbg_enter();
     dbg_printf("Response line: %s\n", rl);
 
     char version[MAXLINE], phrase[MAXLINE];
     char status[MAXLINE] = "";
 
+    ip->has_entity = 1;
+    ip->entity_len = -1;
+    ip->crange[0] = 0;
+    ip->vary[0] = 0;
+    ip->encoding[0] = 0;
+    ip->type[0] = 0;
+
     if( sscanf(rl, "%s %s %s", version, status, phrase) != 3 ){
         return -1;
     }
@@ -520,23 +939,26 @@ static int parse_response_line(char *rl, int *e) {
     if( status[0] == '1' 
         || strcmp(status, "204") == 0 
         || strcmp(status, "304") == 0 )
-        *e = 0;
+        ip->has_entity = 0;
     else
-        *e = 1;
+        ip->has_entity = 1;
+    ip->status = atoi(status);
 
     dbg_exit();
     return 0;
 }
 
 /*
- * parse_response_header - get the content size from headers
- *   - store the content size at *elp
- *   - if the content size is zero, set *ep = 0
+ * parse_response_header - get the content size and cache hints from headers
+ *   - store the content size at ip->entity_len
+ *   - if the content size is zero, set ip->has_entity = 0
+ *   - store the values of Content-Range, Vary, Content-Encoding
+ *     and Content-Type
  * 
  * return -1 on error
  * return 0 on success
  */
-static int parse_response_header(char *buf, int *ep, int *elp){
+static int parse_response_header(char *buf, response_info *ip){
     dbg_enter();
 
     int length = -1;
@@ -551,12 +973,372 @@ static int parse_response_header(char *buf, int *ep, int *elp){
     if( strcasecmp(key, "Content-length") == 0 ) {
         length = atoi(value);
 
-        *elp = length;
+        ip->entity_len = length;
         if( length == 0 )
-            *ep = 0;
+            ip->has_entity = 0;
+    }
+    header_value(buf, "Content-Range", ip->crange);
+    header_value(buf, "Content-Encoding", ip->encoding);
+    header_value(buf, "Content-Type", ip->type);
+    //Several Vary headers make one list
+    if( header_value(buf, "Vary", value) == 0 
+        && strlen(ip->vary) + strlen(value) + 2 < MAXLINE ){
+        if( ip->vary[0] )
+            strcat(ip->vary, ",");
+        strcat(ip->vary, value);
     }
 
     dbg_exit();
     return 0;
 }
 
+/*
+ * The remaining routines implement the io_uring engine
+ *   - one thread, one ring, one io_uring_enter() per batch of events
+ *   - multishot accept feeds new connections
+ *   - the request head is read into a registered buffer (READ_FIXED)
+ *   - cache hits are written and closed by a linked WRITE -> CLOSE pair
+ *   - anything else is handed to a blocking thread together with the
+ *     bytes already read, so the thread path sees an untouched request
+ */
+
+/*
+ * run_uring_engine - set up the ring and run the event loop
+ *
+ * return -1 if io_uring (or multishot accept) is unavailable,
+ *   before any connection is accepted
+ * return -1 if io_uring_enter fails for good, the connections still
+ *   in the ring are dropped
+ * never return otherwise
+ */
+static int run_uring_engine(int listenfd) {
+    dbg_enter();
+
+    uengine_t e;
+    struct iovec iov[UR_NBUFS];
+    struct io_uring_cqe *cqe;
+    unsigned long long data;
+    int i, res, accepted = 0;
+    unsigned flags;
+
+    if( uring_init(&e.ring, UR_ENTRIES) < 0 )
+        return -1;
+
+    if((e.bufs = (char*)malloc(UR_NBUFS * RIO_BUFSIZE)) == NULL ){
+        uring_destroy(&e.ring);
+        return -1;
+    }
+    for( i = 0; i < UR_NBUFS; ++i ){
+        iov[i].iov_base = e.bufs + i * RIO_BUFSIZE;
+        iov[i].iov_len = RIO_BUFSIZE;
+        e.free_slots[i] = i;
+    }
+    e.nfree = UR_NBUFS;
+    e.listenfd = listenfd;
+    e.err = 0;
+    e.read_ts.tv_sec = timeouts.idle / 1000;
+    e.read_ts.tv_nsec = (timeouts.idle % 1000) * 1000000LL;
+
+    if( uring_register_buffers(&e.ring, iov, UR_NBUFS) < 0 ){
+        free(e.bufs);
+        uring_destroy(&e.ring);
+        return -1;
+    }
+
+    uring_prep_accept_multishot(uring_sqe(&e), listenfd, UR_DATA(NULL, UR_ACCEPT));
+
+    while( e.err == 0 ) {
+        //Submit everything queued by the last batch and wait for more,
+        //a full completion ring (EBUSY) or a short of memory is drained
+        if( uring_submit_and_wait(&e.ring, 1) < 0
+            && errno != EBUSY && errno != EAGAIN ) {
+            e.err = errno;
+            break;
+        }
+
+        //Leave room for what a completion queues, so the handlers never
+        //submit; the rest is taken after the next submit
+        while( e.err == 0 && uring_sq_space(&e.ring) >= UR_CQE_SQES
+               && (cqe = uring_peek_cqe(&e.ring)) != NULL ) {
+            data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(&e.ring);
+
+            switch( UR_OP(data) ) {
+            case UR_ACCEPT:
+                if( res >= 0 ) {
+                    accepted = 1;
+                    uring_on_accept(&e, res);
+                }
+                else if( !accepted && res == -EINVAL ) {
+                    //Kernel without multishot accept, nothing in flight yet
+                    free(e.bufs);
+                    uring_destroy(&e.ring);
+                    return -1;
+                }
+                else
+                    fprintf(stderr, "error: accept: %s\n", strerror(-res));
+
+                if( !(flags & IORING_CQE_F_MORE) )
+                    uring_prep_accept_multishot(uring_sqe(&e), listenfd,
+                        UR_DATA(NULL, UR_ACCEPT));
+                break;
+            case UR_READ:
+                //The link timeout of a read has no connection
+                if( UR_CONN(data) != NULL )
+                    uring_on_read(&e, UR_CONN(data), res);
+                break;
+            case UR_WRITE:
+                uring_on_write(&e, UR_CONN(data), res);
+                break;
+            case UR_CLOSE:
+                //A linked close cancelled by a short write is resubmitted
+                if( res != -ECANCELED ) {
+                    free(UR_CONN(data)->resp);
+                    free(UR_CONN(data));
+                }
+                break;
+            }
+        }
+    }
+
+    fprintf(stderr, "error: io_uring_enter: %s\n", strerror(e.err));
+    free(e.bufs);
+    uring_destroy(&e.ring);
+    return -1;
+}
+
+/*
+ * uring_sqe - get an sqe, flushing the submission ring if it is full
+ *   - if the kernel takes none, stop the engine and hand out a scratch
+ *     sqe that is never submitted
+ */
+static struct io_uring_sqe *uring_sqe(uengine_t *ep) {
+    static struct io_uring_sqe scratch;
+    struct io_uring_sqe *sqe;
+    int rc;
+
+    while((sqe = uring_get_sqe(&ep->ring)) == NULL ) {
+        if( ep->err != 0 )
+            return &scratch;
+        if((rc = uring_submit_and_wait(&ep->ring, 0)) <= 0 )
+            ep->err = rc < 0 ? errno : EBUSY;
+    }
+    return sqe;
+}
+
+/*
+ * uring_on_accept - take a new connection and start reading its request
+ *   - without a free registered buffer, hand it to the blocking path
+ */
+static void uring_on_accept(uengine_t *ep, int fd) {
+    uconn_t *cp;
+    rio_t *rp;
+
+    dbg_printf("io_uring accept client on fd %d\n", fd);
+
+    if( ep->nfree == 0 ){
+        if((rp = (rio_t*)malloc(sizeof(rio_t))) == NULL ){
+            Close(fd);
+            return;
+        }
+        Rio_readinitb(rp, fd);
+        spawn_client_thread(rp);
+        return;
+    }
+
+    if((cp = (uconn_t*)malloc(sizeof(uconn_t))) == NULL ){
+        Close(fd);
+        return;
+    }
+    cp->fd = fd;
+    cp->slot = ep->free_slots[--ep->nfree];
+    cp->len = 0;
+    cp->resp = NULL;
+    cp->resp_len = 0;
+    cp->resp_off = 0;
+
+    uring_submit_read(ep, cp);
+}
+
+/*
+ * uring_submit_read - read more of the request into the registered buffer
+ */
+static void uring_submit_read(uengine_t *ep, uconn_t *cp) {
+    struct io_uring_sqe *sqe;
+
+    if( timeouts.idle == 0 ) {
+        uring_prep_read_fixed(uring_sqe(ep), cp->fd,
+            ep->bufs + cp->slot * RIO_BUFSIZE + cp->len,
+            RIO_BUFSIZE - cp->len, cp->slot, UR_DATA(cp, UR_READ));
+        return;
+    }
+
+    //A client that stalls holds a registered buffer, cancel its read
+    uring_reserve(ep, 2);
+    sqe = uring_sqe(ep);
+    uring_prep_read_fixed(sqe, cp->fd,
+        ep->bufs + cp->slot * RIO_BUFSIZE + cp->len,
+        RIO_BUFSIZE - cp->len, cp->slot, UR_DATA(cp, UR_READ));
+    sqe->flags |= IOSQE_IO_LINK;
+    uring_prep_link_timeout(uring_sqe(ep), &ep->read_ts,
+        UR_DATA(NULL, UR_READ));
+}
+
+/*
+ * uring_on_read - collect the request head until "\r\n\r\n" or full buffer
+ */
+static void uring_on_read(uengine_t *ep, uconn_t *cp, int res) {
+    char *buf = ep->bufs + cp->slot * RIO_BUFSIZE;
+
+    if( res <= 0 ){
+        if( res == -ECANCELED )
+            count_timeout(TO_REQUEST);
+        uring_close(ep, cp);
+        return;
+    }
+
+    cp->len += res;
+    if( cp->len < RIO_BUFSIZE && !has_head_end(buf, cp->len) ){
+        uring_submit_read(ep, cp);
+        return;
+    }
+
+    uring_dispatch(ep, cp);
+}
+
+/*
+ * uring_dispatch - serve a cache hit in the engine, hand off the rest
+ */
+static void uring_dispatch(uengine_t *ep, uconn_t *cp) {
+    dbg_enter();
+
+    char *buf = ep->bufs + cp->slot * RIO_BUFSIZE;
+    char line[MAXLINE];
+    char range[MAXLINE];
+    char accept[MAXLINE] = "";
+    char *eol;
+    request_line rl;
+    cid_t cid;
+    rio_t *rp;
+    int rc, accept_gzip;
+
+    //Copy out the request line, the buffer is not NUL-terminated
+    eol = memchr(buf, '\n', cp->len);
+    if( eol != NULL && eol - buf < MAXLINE - 1 ){
+        memcpy(line, buf, eol - buf + 1);
+        line[eol - buf + 1] = 0;
+
+        //Range requests need the thread path to build a 206
+        if( parse_request_line(&rl, line) == 0 
+            && strcmp("GET", rl.method) == 0 
+            && get_header(buf, cp->len, "Range", range) < 0 ){
+            get_header(buf, cp->len, "Accept-Encoding", accept);
+            accept_gzip = accepts_coding(accept, "gzip");
+
+            gen_cid(&cid, rl.host, rl.port, rl.path, accept_class(accept));
+            rc = copy_from_cache(&cache, &cid, &cp->resp, accept_gzip);
+            if( rc == 0 ){
+                gen_cid(&cid, rl.host, rl.port, rl.path, NULL);
+                rc = copy_from_cache(&cache, &cid, &cp->resp, accept_gzip);
+            }
+            if( rc > 0 ){
+                __sync_fetch_and_add(&requests, 1);
+                cp->resp_len = rc;
+                uring_release_slot(ep, cp);
+                uring_submit_write(ep, cp);
+                dbg_exit();
+                return;
+            }
+        }
+    }
+
+    //Cache miss or anything unusual: let a thread redo it from the start
+    if((rp = (rio_t*)malloc(sizeof(rio_t))) == NULL ){
+        uring_close(ep, cp);
+        return;
+    }
+    Rio_readinitb(rp, cp->fd);
+    memcpy(rp->rio_buf, buf, cp->len);
+    rp->rio_cnt = cp->len;
+
+    uring_release_slot(ep, cp);
+    free(cp);
+    spawn_client_thread(rp);
+    dbg_exit();
+}
+
+/*
+ * uring_submit_write - write the rest of the response, then close
+ *   - the close only runs if the write completes in full
+ */
+static void uring_submit_write(uengine_t *ep, uconn_t *cp) {
+    struct io_uring_sqe *sqe;
+
+    uring_reserve(ep, 2);
+    sqe = uring_sqe(ep);
+    uring_prep_write(sqe, cp->fd, cp->resp + cp->resp_off,
+        cp->resp_len - cp->resp_off, UR_DATA(cp, UR_WRITE));
+    sqe->flags |= IOSQE_IO_LINK;
+
+    uring_prep_close(uring_sqe(ep), cp->fd, UR_DATA(cp, UR_CLOSE));
+}
+
+/*
+ * uring_on_write - finish, continue or abandon the response
+ */
+static void uring_on_write(uengine_t *ep, uconn_t *cp, int res) {
+    if( res <= 0 ){
+        //The linked close was cancelled, close on our own
+        uring_close(ep, cp);
+        return;
+    }
+
+    cp->resp_off += res;
+    if( cp->resp_off < cp->resp_len )
+        uring_submit_write(ep, cp);
+}
+
+/*
+ * uring_close - close the client asynchronously, cp is freed on completion
+ */
+static void uring_close(uengine_t *ep, uconn_t *cp) {
+    uring_release_slot(ep, cp);
+    uring_prep_close(uring_sqe(ep), cp->fd, UR_DATA(cp, UR_CLOSE));
+}
+
+/*
+ * uring_release_slot - return the registered buffer of cp to the pool
+ */
+static void uring_release_slot(uengine_t *ep, uconn_t *cp) {
+    if( cp->slot < 0 )
+        return;
+    ep->free_slots[ep->nfree++] = cp->slot;
+    cp->slot = -1;
+}
+
+/*
+ * uring_reserve - make room for n sqes, so a linked chain is never split
+ *   across two submissions
+ */
+static void uring_reserve(uengine_t *ep, unsigned n) {
+    int rc;
+
+    while( ep->err == 0 && uring_sq_space(&ep->ring) < n )
+        if((rc = uring_submit_and_wait(&ep->ring, 0)) <= 0 )
+            ep->err = rc < 0 ? errno : EBUSY;
+}
+
+/*
+ * has_head_end - check if buf holds the blank line ending a request head
+ */
+static int has_head_end(const char *buf, size_t len) {
+    size_t i;
+
+    for( i = 3; i < len; ++i )
+        if( buf[i] == '\n' && buf[i-1] == '\r' 
+            && buf[i-2] == '\n' && buf[i-3] == '\r' )
+            return 1;
+    return 0;
+}
@@ -0,0 +1,303 @@
+/*
+ * range.c
+ *	 - parse "Range: bytes=..." request headers against an entity length
+ *	 - parse "Content-Range: bytes a-b/total" response headers
+ *	 - send 206 responses, single part or multipart/byteranges,
+ *	   built from the headers of the original response
+ *	 - send 416 when no range is satisfiable
+ *
+ * AndrewID: jiexil
+ * Name: Jiexi Lin
+ * Nickname: railgun
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "csapp.h"
+#include "range.h"
+
+static int part_header(char *buf, size_t maxlen, const char *type,
+	range_t *rp, long total);
+
+/*
+ * parse_range - parse the value of a Range header
+ *	 - drop the ranges that start beyond the entity
+ *	 - clip the last byte position to the entity
+ *
+ *	return 0 if the header should be ignored (malformed, not bytes,
+ *		or more than MAX_RANGES ranges)
+ *	return -1 if no range is satisfiable
+ *	return the number of satisfiable ranges stored in ranges
+ */
+int parse_range(const char *value, long total, range_t *ranges) {
+	const char *p = value;
+	char *end;
+	long first, last;
+	int n = 0, nspec = 0;
+
+	while( *p == ' ' )
+		++p;
+	if( strncasecmp(p, "bytes=", strlen("bytes=")) != 0 )
+		return 0;
+	p += strlen("bytes=");
+
+	while( *p ) {
+		while( *p == ' ' || *p == ',' )
+			++p;
+		if( *p == 0 )
+			break;
+		if( ++nspec > MAX_RANGES )
+			return 0;
+
+		if( *p == '-' ) {
+			//suffix range: the last N bytes
+			last = strtol(p + 1, &end, 10);
+			if( end == p + 1 || last < 0 )
+				return 0;
+			p = end;
+			if( last == 0 || total == 0 )
+				continue;
+			first = (last >= total) ? 0 : total - last;
+			last = total - 1;
+		}
+		else {
+			first = strtol(p, &end, 10);
+			if( end == p || *end != '-' || first < 0 )
+				return 0;
+			p = end + 1;
+			if( *p >= '0' && *p <= '9' ) {
+				last = strtol(p, &end, 10);
+				p = end;
+				if( last < first )
+					return 0;
+			}
+			else
+				last = total - 1;
+
+			if( first >= total )
+				continue;
+			if( last >= total )
+				last = total - 1;
+		}
+
+		while( *p == ' ' )
+			++p;
+		if( *p != ',' && *p != 0 )
+			return 0;
+
+		ranges[n].first = first;
+		ranges[n].last = last;
+		ranges[n].data = NULL;
+		++n;
+	}
+
+	if( nspec == 0 )
+		return 0;
+	return (n == 0) ? -1 : n;
+}
+
+/*
+ * parse_content_range - parse "bytes first-last/total"
+ *
+ *	return -1 on error, or when the total length is unknown ("*")
+ *	return 0 on success
+ */
+int parse_content_range(const char *value,
+	long *first, long *last, long *total) {
+
+	while( *value == ' ' )
+		++value;
+	if( sscanf(value, "bytes %ld-%ld/%ld", first, last, total) != 3 )
+		return -1;
+	if( *first < 0 || *last < *first || *last >= *total )
+		return -1;
+	return 0;
+}
+
+/*
+ * send_ranges - send a 206 response for ranges of an entity
+ *	 - head is the status line and headers of the original response,
+ *	   head_size covers the blank line ending it
+ *	 - ranges[i].data points to the bytes of range i
+ *
+ *	return -1 on error
+ *	return 0 on success
+ */
+int send_ranges(int fd, const char *head, int head_size, long total,
+	range_t *ranges, int n) {
+
+	char type[MAXLINE] = "";
+	char part[MAXLINE + 256];
+	char *buf, *bp;
+	const char *p, *eol;
+	long length = 0;
+	int i, rc = 0;
+
+	if((buf = (char*)malloc(head_size + MAXLINE + 128)) == NULL )
+		return -1;
+	get_header(head, head_size, "Content-Type", type);
+
+	//Entity length: all the parts, plus their delimiters if multipart
+	for( i = 0; i < n; ++i ) {
+		length += ranges[i].last - ranges[i].first + 1;
+		if( n > 1 )
+			length += part_header(part, sizeof(part), type, &ranges[i], total);
+	}
+	if( n > 1 )
+		length += strlen("\r\n--" RANGE_BOUNDARY "--\r\n");
+
+	bp = buf;
+	bp += sprintf(bp, "HTTP/1.0 206 Partial Content\r\n");
+
+	//Copy the original headers, except the ones describing the entity
+	p = memchr(head, '\n', head_size);
+	p = (p == NULL) ? head + head_size : p + 1;
+	while( p < head + head_size ) {
+		if((eol = memchr(p, '\n', head + head_size - p)) == NULL )
+			break;
+		++eol;
+		if( strncmp(p, "\r\n", 2) != 0
+			&& !header_is(p, "Content-Length")
+			&& !header_is(p, "Content-Range")
+			&& !header_is(p, "Transfer-Encoding")
+			&& !(n > 1 && header_is(p, "Content-Type")) ) {
+			memcpy(bp, p, eol - p);
+			bp += eol - p;
+		}
+		p = eol;
+	}
+
+	if( n == 1 )
+		bp += sprintf(bp, "Content-Range: bytes %ld-%ld/%ld\r\n",
+			ranges[0].first, ranges[0].last, total);
+	else
+		bp += sprintf(bp,
+			"Content-Type: multipart/byteranges; boundary=%s\r\n",
+			RANGE_BOUNDARY);
+	bp += sprintf(bp, "Content-Length: %ld\r\n\r\n", length);
+
+	if( Rio_writen(fd, buf, bp - buf) < 0 )
+		rc = -1;
+
+	for( i = 0; rc == 0 && i < n; ++i ) {
+		if( n > 1 ) {
+			part_header(part, sizeof(part), type, &ranges[i], total);
+			if( Rio_writen(fd, part, strlen(part)) < 0 ) {
+				rc = -1;
+				break;
+			}
+		}
+		if( Rio_writen(fd, (void *)ranges[i].data,
+				ranges[i].last - ranges[i].first + 1) < 0 )
+			rc = -1;
+	}
+
+	if( rc == 0 && n > 1 ) {
+		if( Rio_writen(fd, "\r\n--" RANGE_BOUNDARY "--\r\n",
+				strlen("\r\n--" RANGE_BOUNDARY "--\r\n")) < 0 )
+			rc = -1;
+	}
+
+	free(buf);
+	return rc;
+}
+
+/*
+ * send_unsatisfiable - send a 416 response for an entity of total bytes
+ *
+ *	return -1 on error
+ *	return 0 on success
+ */
+int send_unsatisfiable(int fd, long total) {
+	char buf[MAXLINE];
+
+	sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+		"Content-Range: bytes */%ld\r\n"
+		"Content-Length: 0\r\n\r\n", total);
+	if( Rio_writen(fd, buf, strlen(buf)) < 0 )
+		return -1;
+	return 0;
+}
+
+/*
+ * header_is - check if a header line has the given name, case insensitive
+ */
+int header_is(const char *line, const char *name) {
+	size_t len = strlen(name);
+
+	return strncasecmp(line, name, len) == 0 && line[len] == ':';
+}
+
+/*
+ * header_value - copy the value of a header line into value (MAXLINE)
+ *	 - leading spaces and the line ending are stripped
+ *
+ *	return -1 if the line is not a name header
+ *	return 0 on success
+ */
+int header_value(const char *line, const char *name, char *value) {
+	const char *p = line;
+	size_t len;
+
+	if( !header_is(line, name) )
+		return -1;
+
+	p += strlen(name) + 1;
+	while( *p == ' ' || *p == '\t' )
+		++p;
+	for( len = 0; p[len] && p[len] != '\r' && p[len] != '\n'; ++len )
+		;
+	if( len >= MAXLINE )
+		len = MAXLINE - 1;
+	memcpy(value, p, len);
+	value[len] = 0;
+	return 0;
+}
+
+/*
+ * get_header - find a header in head and copy its value (MAXLINE)
+ *
+ *	return -1 if not found
+ *	return 0 on success
+ */
+int get_header(const char *head, int head_size,
+	const char *name, char *value) {
+	const char *p = head, *eol;
+	char line[MAXLINE];
+	size_t len;
+
+	while( p < head + head_size ) {
+		if((eol = memchr(p, '\n', head + head_size - p)) == NULL )
+			break;
+		if( header_is(p, name) ) {
+			//The line may not be NUL-terminated within head
+			len = eol - p + 1;
+			if( len >= MAXLINE )
+				len = MAXLINE - 1;
+			memcpy(line, p, len);
+			line[len] = 0;
+			return header_value(line, name, value);
+		}
+		p = eol + 1;
+	}
+	return -1;
+}
+
+/*
+ * part_header - format the delimiter and headers of one multipart part
+ *
+ *	return the length of the part header
+ */
+static int part_header(char *buf, size_t maxlen, const char *type,
+	range_t *rp, long total) {
+
+	if( type[0] )
+		return snprintf(buf, maxlen, "\r\n--%s\r\nContent-Type: %s\r\n"
+			"Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+			RANGE_BOUNDARY, type, rp->first, rp->last, total);
+	return snprintf(buf, maxlen, "\r\n--%s\r\n"
+		"Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+		RANGE_BOUNDARY, rp->first, rp->last, total);
+}
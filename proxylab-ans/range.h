@@ -0,0 +1,34 @@
+/*
+ * range.h
+ *	 - HTTP byte range parsing and 206/416 responses
+ * AndrewID: jiexil
+ * Name: Jiexi Lin
+ * Nickname: railgun
+ *
+ */
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#define MAX_RANGES 16
+#define RANGE_BOUNDARY "PROXY_BYTERANGE_BOUNDARY"
+
+//a satisfiable byte range, both ends inclusive
+typedef struct {
+	long first;
+	long last;
+	const char *data;		//the bytes first..last of the entity
+} range_t;
+
+int parse_range(const char *value, long total, range_t *ranges);
+int parse_content_range(const char *value,
+	long *first, long *last, long *total);
+int send_ranges(int fd, const char *head, int head_size, long total,
+	range_t *ranges, int n);
+int send_unsatisfiable(int fd, long total);
+
+int header_is(const char *line, const char *name);
+int header_value(const char *line, const char *name, char *value);
+int get_header(const char *head, int head_size,
+	const char *name, char *value);
+
+#endif /* __RANGE_H__ */
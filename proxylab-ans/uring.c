@@ -0,0 +1,248 @@
+/*
+ * uring.c
+ *	 - a minimal io_uring wrapper for the proxy data path
+ *	 - set up the rings with io_uring_setup() and mmap()
+ *	 - hand out sqes, publish them in one batch per io_uring_enter()
+ *	 - all ring indices are accessed with acquire/release ordering
+ *
+ * AndrewID: jiexil
+ * Name: Jiexi Lin
+ * Nickname: railgun
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#define LOAD_ACQ(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static void prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+	const void *addr, unsigned len, unsigned long long data);
+
+/*
+ * uring_init - create a ring with at least entries sqes and map it
+ *
+ * return -1 on error (errno set, e.g. ENOSYS when io_uring is unavailable)
+ * return 0 on success
+ */
+int uring_init(uring_t *ur, unsigned entries) {
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(ur, 0, sizeof(uring_t));
+	memset(&p, 0, sizeof(p));
+
+	if((ur->ring_fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+
+	ur->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ur->cq_size > ur->sq_size)
+			ur->sq_size = ur->cq_size;
+		ur->cq_size = ur->sq_size;
+	}
+
+	ur->sq_ptr = mmap(NULL, ur->sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+	if(ur->sq_ptr == MAP_FAILED)
+		goto fail_fd;
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		ur->cq_ptr = ur->sq_ptr;
+	else {
+		ur->cq_ptr = mmap(NULL, ur->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_CQ_RING);
+		if(ur->cq_ptr == MAP_FAILED)
+			goto fail_sq;
+	}
+
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+	if(ur->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	sq = ur->sq_ptr;
+	ur->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ur->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ur->sq_entries = p.sq_entries;
+	ur->sq_local_tail = *ur->sq_tail;
+
+	cq = ur->cq_ptr;
+	ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ur->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+fail_cq:
+	if(ur->cq_ptr != ur->sq_ptr)
+		munmap(ur->cq_ptr, ur->cq_size);
+fail_sq:
+	munmap(ur->sq_ptr, ur->sq_size);
+fail_fd:
+	close(ur->ring_fd);
+	ur->ring_fd = -1;
+	return -1;
+}
+
+/*
+ * uring_destroy - unmap the rings and close the ring descriptor
+ */
+void uring_destroy(uring_t *ur) {
+	if(ur->ring_fd < 0)
+		return;
+	munmap(ur->sqes, ur->sqes_size);
+	if(ur->cq_ptr != ur->sq_ptr)
+		munmap(ur->cq_ptr, ur->cq_size);
+	munmap(ur->sq_ptr, ur->sq_size);
+	close(ur->ring_fd);
+	ur->ring_fd = -1;
+}
+
+/*
+ * uring_register_buffers - pin n buffers for READ_FIXED/WRITE_FIXED
+ *
+ * return -1 on error
+ * return 0 on success
+ */
+int uring_register_buffers(uring_t *ur, struct iovec *iov, unsigned n) {
+	if(syscall(__NR_io_uring_register, ur->ring_fd,
+			IORING_REGISTER_BUFFERS, iov, n) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * uring_get_sqe - get the next free sqe, cleared
+ *   - the sqe is only visible to the kernel after uring_submit_and_wait()
+ *
+ * return NULL if the submission ring is full
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ur) {
+	struct io_uring_sqe *sqe;
+	unsigned head = LOAD_ACQ(ur->sq_head);
+
+	if(ur->sq_local_tail - head >= ur->sq_entries)
+		return NULL;
+
+	sqe = &ur->sqes[ur->sq_local_tail & *ur->sq_mask];
+	ur->sq_array[ur->sq_local_tail & *ur->sq_mask] =
+		ur->sq_local_tail & *ur->sq_mask;
+	ur->sq_local_tail++;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/*
+ * uring_sq_space - the number of sqes uring_get_sqe can still hand out
+ */
+unsigned uring_sq_space(uring_t *ur) {
+	return ur->sq_entries - (ur->sq_local_tail - LOAD_ACQ(ur->sq_head));
+}
+
+/*
+ * uring_submit_and_wait - publish all queued sqes and wait for
+ *   at least wait_nr completions, all in one system call
+ *
+ * return -1 on error
+ * return the number of sqes consumed on success
+ */
+int uring_submit_and_wait(uring_t *ur, unsigned wait_nr) {
+	unsigned to_submit = ur->sq_local_tail - *ur->sq_tail;
+	unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	int rc;
+
+	STORE_REL(ur->sq_tail, ur->sq_local_tail);
+	if(to_submit == 0 && wait_nr == 0)
+		return 0;
+
+	do {
+		rc = syscall(__NR_io_uring_enter, ur->ring_fd,
+			to_submit, wait_nr, flags, NULL, 0);
+	} while(rc < 0 && errno == EINTR);
+
+	return rc;
+}
+
+/*
+ * uring_peek_cqe - return the oldest unseen completion, NULL if none
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ur) {
+	unsigned head = *ur->cq_head;
+
+	if(head == LOAD_ACQ(ur->cq_tail))
+		return NULL;
+	return &ur->cqes[head & *ur->cq_mask];
+}
+
+/*
+ * uring_cqe_seen - give the oldest completion slot back to the kernel
+ */
+void uring_cqe_seen(uring_t *ur) {
+	STORE_REL(ur->cq_head, *ur->cq_head + 1);
+}
+
+/*
+ * prep_rw - fill the fields shared by most opcodes
+ */
+static void prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+	const void *addr, unsigned len, unsigned long long data) {
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)addr;
+	sqe->len = len;
+	sqe->off = 0;
+	sqe->user_data = data;
+}
+
+/*
+ * uring_prep_accept_multishot - one sqe that keeps posting a cqe per
+ *   accepted connection until it is cancelled or fails
+ */
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+	unsigned long long data) {
+	prep_rw(sqe, IORING_OP_ACCEPT, fd, NULL, 0, data);
+	sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+}
+
+/*
+ * uring_prep_read_fixed - read into a slice of registered buffer buf_index
+ */
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd,
+	void *buf, unsigned len, int buf_index, unsigned long long data) {
+	prep_rw(sqe, IORING_OP_READ_FIXED, fd, buf, len, data);
+	sqe->buf_index = buf_index;
+}
+
+void uring_prep_write(struct io_uring_sqe *sqe, int fd,
+	const void *buf, unsigned len, unsigned long long data) {
+	prep_rw(sqe, IORING_OP_WRITE, fd, buf, len, data);
+}
+
+void uring_prep_close(struct io_uring_sqe *sqe, int fd,
+	unsigned long long data) {
+	prep_rw(sqe, IORING_OP_CLOSE, fd, NULL, 0, data);
+}
+
+/*
+ * uring_prep_link_timeout - cancel the linked sqe before this one if it
+ *   has not completed within *ts
+ *   - *ts is read when the sqe is submitted
+ */
+void uring_prep_link_timeout(struct io_uring_sqe *sqe,
+	struct __kernel_timespec *ts, unsigned long long data) {
+	prep_rw(sqe, IORING_OP_LINK_TIMEOUT, -1, ts, 1, data);
+}
@@ -0,0 +1,62 @@
+/*
+ * uring.h
+ *	 - a minimal io_uring wrapper built on the raw system calls
+ *	 - no liburing dependency, only the kernel uapi header
+ *
+ * AndrewID: jiexil
+ * Name: Jiexi Lin
+ * Nickname: railgun
+ *
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+//submission and completion rings mapped from the kernel
+typedef struct {
+	int ring_fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	unsigned sq_local_tail;		//sqes handed out but not yet published
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+} uring_t;
+
+int uring_init(uring_t *ur, unsigned entries);
+void uring_destroy(uring_t *ur);
+int uring_register_buffers(uring_t *ur, struct iovec *iov, unsigned n);
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ur);
+unsigned uring_sq_space(uring_t *ur);
+int uring_submit_and_wait(uring_t *ur, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ur);
+void uring_cqe_seen(uring_t *ur);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+	unsigned long long data);
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd,
+	void *buf, unsigned len, int buf_index, unsigned long long data);
+void uring_prep_write(struct io_uring_sqe *sqe, int fd,
+	const void *buf, unsigned len, unsigned long long data);
+void uring_prep_close(struct io_uring_sqe *sqe, int fd,
+	unsigned long long data);
+void uring_prep_link_timeout(struct io_uring_sqe *sqe,
+	struct __kernel_timespec *ts, unsigned long long data);
+
+#endif /* __URING_H__ */